@@ -1,675 +1,6255 @@
+#define _GNU_SOURCE
 #include<stdio.h>
 #include<unistd.h>
 #include<stdlib.h> 
 #include<fcntl.h>
 #include<string.h> 
 #include<sys/signal.h>
+#include<sys/signalfd.h>
 #include<sys/wait.h>
+#include<sys/resource.h>
 #include<ctype.h>
+#include<spawn.h>
+#include<errno.h>
+#include<limits.h>
+#include<sys/stat.h>
+#include<sys/mman.h>
+#include<sys/sendfile.h>
+#include<time.h>
+#include<pthread.h>
+#include<termios.h>
+#include<poll.h>
+#include<sys/socket.h>
+#include<sys/un.h>
+#include<dirent.h>
+#include<fnmatch.h>
+#include<sys/syscall.h>
+#include<sched.h>
+#include<sys/uio.h>
+#include<sys/epoll.h>
+#include<sys/ioctl.h>
+#include<linux/io_uring.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include<immintrin.h>
+#endif
 
-#define MAX_CMD_SIZE 100
-#define MAX_PARAMETERS 5
-#define MAX_BACKGROUND_TASKS 4
+#define COMMAND_HASH_BUCKETS 64
+#define INPUT_BUFFER_SIZE (64 * 1024)
+#define STREAM_BUFFER_SIZE (1024 * 1024)
+#define WORD_COUNT_CHUNK_SIZE (8 * 1024 * 1024)
+#define ARENA_BLOCK_SIZE (16 * 1024)
+#define PLAN_CACHE_BUCKETS 512
+#define PLAN_CACHE_LIMIT 1024 // Cached lines before the plan cache starts over
+#define LONG_PIPELINE_STAGES 3 // Pipelines this long get the largest pipe buffers by default
+#define HISTORY_NEWLINE '\x1e' // Stands in for a newline inside a history record
+#define SERVER_STATUS_PREFIX "mbash25-status: " // Last line of every --serve response
+#define CACHE_HEADER_SIZE 16 // "mbash25:%7d\n" status header in front of each cached output
+#define CACHE_DEFAULT_LIMIT (256L * 1024 * 1024) // set -o cachesize=auto
+#define TRACE_RING_EVENTS (1 << 16) // Power of two; the oldest events are overwritten
+#define PARSE_INCOMPLETE 2 // parse_command_line: the text ends inside a command
+#define HERE_DOCUMENT_LIMIT 16 // '<<' redirections allowed on one line
+#define SUBSTITUTION_BUFFER_SIZE 4096 // Starting size of a $(...) output buffer
+#define LISTING_CACHE_BUCKETS 256
+#define LISTING_CACHE_LIMIT 1024 // Cached directories before the listing cache starts over
+#define DIRECTORY_READ_SIZE (64 * 1024) // getdents64 buffer for directory scans
+#define VARIABLE_TABLE_MIN_CAPACITY 64
+#define POLICY_LIMIT_COUNT 4 // Resource limits a command wrapper can set (one per ulimit option)
+#define DEFAULT_NICE_ADJUSTMENT 10 // 'nice command' without -n, as in coreutils
+#define EXPANSION_SPLITTABLE 1 // expansion_buffer flag: from an unquoted $ expansion
+#define EXPANSION_UNQUOTED 2 // expansion_buffer flag: a glob character here is active
+#define OUTPUT_BUFFER_SIZE (256 * 1024) // Each of the output layer's two page-aligned buffers
+#define OUTPUT_STAGING_SIZE (16 * 1024) // stdio's own buffer in front of the output layer
+#define OUTPUT_RING_ENTRIES 8 // io_uring submission slots: one write plus queued syncs
+#define SESSION_LIMIT 16 // Sessions newt can have open at once
+#define SESSION_ESCAPE 0x1d // Ctrl-]: starts a session command while attached
+#define SESSION_SCROLLBACK_SIZE (64 * 1024) // Output kept for each session that is not attached
+#define OPTION_AUTO 0 // set -o name=auto for numeric options
+#define OPTION_MAX -1 // set -o name=max for numeric options
 
-pid_t background_task_ids[MAX_BACKGROUND_TASKS]; // Array to track background process IDs
-int active_background_count = 0; // Counter for active background processes
+// Lifecycle of a background job as last reported by waitpid
+typedef enum { JOB_RUNNING, JOB_STOPPED, JOB_DONE } job_state;
+
+// One background job launched with '&'
+typedef struct {
+    int job_number; // Number shown as %n
+    pid_t process_id; // Process launched for the job (also its process group)
+    char *command_text; // Command line as typed, for jobs/fg reports
+    job_state state;
+    int exit_status; // Exit code (or 128 + signal) once the job is done
+} background_job;
+
+background_job *job_table = NULL; // Growable table of background jobs
+int job_count = 0; // Jobs currently in the table
+int job_capacity = 0; // Allocated slots in job_table
+int child_signal_fd = -1; // signalfd reporting SIGCHLD, drained before each prompt
+int child_state_pending = 0; // SIGCHLDs drained by the parallel scheduler that the job table has not seen
+int shell_is_interactive = 0; // Set when stdin is a terminal the shell controls
+volatile sig_atomic_t server_stopping = 0; // Set by SIGTERM/SIGINT in the --serve supervisor
+extern char **environ; // Environment handed to every spawned command
+
+// One session opened with newt: a forked copy of the shell on its own
+// pseudo-terminal, serviced by the session event loop
+typedef struct {
+    int session_number; // Number shown by 'sessions' and used by 'attach'
+    pid_t process_id; // The session's shell
+    int master_fd; // Our end of its pseudo-terminal (non-blocking)
+    char terminal_name[32]; // The session's end, e.g. /dev/pts/3
+    char *scrollback; // Ring of the last output written while not attached
+    size_t scrollback_start; // Oldest byte in the ring
+    size_t scrollback_length;
+} shell_session;
+
+shell_session session_table[SESSION_LIMIT];
+int session_count = 0;
+int next_session_number = 1;
+int session_epoll_fd = -1; // Watches the terminal and every session's master_fd
+
+// Scheduling and resource settings a command gets between fork and exec
+typedef struct {
+    int nice_adjustment; // Added to the command's nice value (0 leaves it)
+    int has_cpu_set; // Non-zero restricts the command to cpu_set
+    cpu_set_t cpu_set;
+    int limit_count;
+    int limit_resources[POLICY_LIMIT_COUNT]; // RLIMIT_* set by a 'ulimit ... command' wrapper
+    struct rlimit limit_values[POLICY_LIMIT_COUNT];
+} resource_policy;
+
+// Describes how a spawned command is wired up before it starts
+typedef struct {
+    int input_fd; // Descriptor installed as the child's stdin (-1 inherits the shell's)
+    int output_fd; // Descriptor installed as the child's stdout (-1 inherits the shell's)
+    pid_t process_group; // -1 stays in the shell's group, 0 leads a new group, >0 joins that group
+    const char *program_path; // Binary already resolved by a cached plan (NULL resolves at spawn time)
+    char **environment; // Environment with NAME=value prefixes applied (NULL passes environ)
+    const resource_policy *policy; // nice / affinity / limits for the child (NULL for none)
+} spawn_options;
+
+// Bump allocator for everything parsed from one command line. Nodes and
+// words are never freed one by one; arena_reset drops the whole line.
+typedef struct arena_block {
+    struct arena_block *older_block; // Previously filled block
+    size_t used_bytes;
+    size_t capacity;
+    _Alignas(16) char block_data[];
+} arena_block;
+
+// Point in an arena to come back to with arena_release
+typedef struct {
+    arena_block *block;
+    size_t used_bytes;
+} arena_position;
+
+typedef struct {
+    arena_block *current_block; // Block new allocations come from
+} memory_arena;
+
+// Tokens produced by the single-pass lexer
+typedef enum {
+    TOKEN_WORD, TOKEN_PIPE, TOKEN_REVERSE_PIPE, TOKEN_AND, TOKEN_OR, TOKEN_SEMICOLON,
+    TOKEN_BACKGROUND, TOKEN_NEWLINE, TOKEN_REDIRECT_INPUT, TOKEN_REDIRECT_OUTPUT,
+    TOKEN_REDIRECT_APPEND, TOKEN_WORD_COUNT, TOKEN_CONCATENATE, TOKEN_MUTUAL_APPEND,
+    TOKEN_PARALLEL, TOKEN_FAN_OUT, TOKEN_GROUP_START, TOKEN_GROUP_SEPARATOR, TOKEN_GROUP_END,
+    TOKEN_HERE_STRING, TOKEN_HERE_DOCUMENT, TOKEN_END
+} token_type;
+
+// Lexer state; the parser pulls one token of lookahead at a time
+typedef struct {
+    const char *input_text;
+    size_t position; // Next unread character
+    size_t token_start; // Offset where the current token begins
+    token_type current_type;
+    char *current_word; // Raw text of the current TOKEN_WORD, quotes kept
+    memory_arena *arena;
+    int syntax_error; // Set once a parse error has been reported
+    int group_depth; // Open '|& {' groups; inside one ',' and '}' end words
+    int compound_depth; // Open for/while/repeat bodies; 'do' and 'done' end lists inside one
+    token_type previous_type; // Last token before the current one, newlines aside
+    int incomplete; // The error was running out of text: more lines may complete the command
+    struct redirection *pending_documents[HERE_DOCUMENT_LIMIT]; // '<<' bodies to read at the next newline
+    int pending_strip_tabs[HERE_DOCUMENT_LIMIT]; // '<<-': leading tabs are removed from the body
+    int pending_document_count;
+} command_lexer;
+
+typedef enum {
+    NODE_COMMAND, NODE_PIPELINE, NODE_AND, NODE_OR, NODE_SEQUENCE, NODE_BACKGROUND, NODE_TIMED,
+    NODE_PARALLEL, NODE_FAN_OUT, NODE_CACHED, NODE_FOR, NODE_WHILE, NODE_REPEAT
+} node_type;
+typedef enum { COMMAND_SIMPLE, COMMAND_WORD_COUNT, COMMAND_CONCATENATE, COMMAND_MUTUAL_APPEND } command_kind;
+
+// One '<', '>', '>>', '<<<' or '<<' attached to a command
+typedef struct redirection {
+    token_type redirect_type; // TOKEN_REDIRECT_INPUT, _OUTPUT, _APPEND, TOKEN_HERE_STRING or _DOCUMENT
+    char *target_word; // File name, quotes kept; here-string word; here-document body
+    int literal_document; // Here-document with a quoted delimiter: the body is not expanded
+    struct redirection *next_redirection;
+} redirection;
+
+// Commands the shell runs itself instead of spawning
+typedef int (*builtin_handler)(int argument_count, char **arguments);
+typedef struct {
+    const char *builtin_name;
+    builtin_handler handler;
+} builtin_entry;
+
+// AST node; which fields are used depends on the node type
+typedef struct syntax_node {
+    node_type type;
+    command_kind kind; // NODE_COMMAND: plain command or custom operator
+    int word_count; // NODE_COMMAND: words (operands for the operators); NODE_FOR: items;
+    char **words;   // NODE_REPEAT: the count
+    char *loop_variable; // NODE_FOR: variable set to each item
+    redirection *redirections; // NODE_COMMAND and loops: in source order
+    int stage_count; // NODE_PIPELINE: stages in execution order ('~' already reversed);
+                     // NODE_PARALLEL: jobs; NODE_FAN_OUT: consumers
+    struct syntax_node **stages;
+    struct syntax_node *left; // Operands of &&, || and ';', body of '&', 'time', 'cache' and loops,
+                              // producer of '|&', condition of 'while'
+    struct syntax_node *right; // Body of 'while'
+    char *source_text; // NODE_BACKGROUND: command text for job reports
+    char **plan_arguments; // Cached plans: argv built once (NULL when words expand at run time)
+    builtin_handler plan_builtin; // Cached plans: the builtin plan_arguments[0] names, if any
+    const char *plan_path; // Cached plans: resolved binary, valid for plan_path_generation
+    unsigned long plan_path_generation;
+} syntax_node;
+
+// Where the evaluator connects a command it starts
+typedef struct {
+    int input_fd; // stdin for the command (-1 keeps the shell's)
+    int output_fd; // stdout for the command (-1 keeps the shell's)
+    int unused_fd; // Pipe end a forked stage must close (-1 if none)
+    pid_t process_group; // -1 stays in the shell's group, 0 leads a new one
+    int in_child; // Non-zero runs shell-internal commands in a forked child
+    int in_pipeline; // Non-zero lets a redirect-only stage copy its input to its output
+} stage_wiring;
+
+// Persistent history: an append-only file with one record per line, mapped
+// read-only and indexed lazily so startup never reads it
+typedef struct {
+    int file_fd; // O_APPEND descriptor of the history file (-1 until opened)
+    char *mapped_data; // Shared read-only mapping of the file
+    size_t mapped_length;
+    size_t indexed_length; // Bytes of the mapping already split into entries
+    size_t *entry_offsets; // Start offset of each entry; entry n is entry_offsets[n - 1]
+    size_t entry_count;
+    size_t offset_capacity;
+} command_history;
+
+// One command run by the parallel scheduler
+typedef struct {
+    struct syntax_node *command_tree;
+    pid_t process_id; // 0 before the job starts and after it is reaped
+    int output_fd; // memfd collecting the job's stdout (-1 if unavailable)
+    int error_fd; // memfd collecting the job's stderr (-1 if unavailable)
+} parallel_job;
+
+// Source of command lines: a mapped script, a -c string or a buffered descriptor.
+// Lines are split in place, so reading a line never allocates.
+typedef struct {
+    int input_fd; // Descriptor read when the input is not mapped (-1 otherwise)
+    int interactive; // Non-zero prints a prompt before each line
+    char *line_data; // Mapped file, -c string or read buffer holding the lines
+    size_t data_length; // Bytes of valid input in line_data
+    size_t buffer_capacity; // Allocated size of line_data in buffered mode
+    size_t line_start; // Offset of the next unread line
+    int is_mapped; // Non-zero when line_data is an mmap of the whole input
+    int seek_input; // Non-zero keeps input_fd's offset just past the line being run
+    char *tail_line; // Copy of an unterminated final line of mapped input
+    int continuation; // Prompt with "> ": the line continues an unfinished command
+} input_reader;
+
+// One file operand of the '#' word counter
+typedef struct {
+    const char *file_name;
+    const unsigned char *mapped_data; // Whole file mapping (NULL if empty or unmappable)
+    size_t data_length;
+    unsigned long long word_count;
+    int open_error; // errno from opening/reading, 0 on success
+} word_count_file;
+
+// A slice of one mapped file counted independently by a worker thread
+typedef struct {
+    word_count_file *file;
+    size_t chunk_offset;
+    size_t chunk_length;
+    unsigned long long word_count;
+} word_count_chunk;
+
+// Shared work list the word counter threads pull chunks from
+typedef struct {
+    word_count_chunk *chunks;
+    int total_chunks;
+    int next_chunk; // Claimed with an atomic fetch-and-add
+} word_count_queue;
+
+// One remembered PATH resolution, chained per bucket
+typedef struct command_hash_entry {
+    char *command_name; // Name as typed by the user
+    char *resolved_path; // Absolute path found by the PATH search
+    unsigned long use_count; // Times this entry satisfied a lookup
+    struct command_hash_entry *next_entry;
+} command_hash_entry;
+
+command_hash_entry *command_hash_table[COMMAND_HASH_BUCKETS]; // bash-style command hash
+unsigned long command_hash_generation = 0; // Bumped whenever resolved paths are freed
+char *hashed_path_value = NULL; // PATH the hash table was filled against
+unsigned long command_hash_hits = 0; // Lookups answered from the table
+unsigned long command_hash_misses = 0; // Lookups that had to search PATH
+// Shell variable set by NAME=value or a for loop, or imported from the
+// environment at startup. The value lives in a "NAME=value" string that an
+// exported variable also lends to shell_environment.
+typedef struct {
+    char *variable_name; // NULL for an empty slot
+    char *assignment_text; // "NAME=value"
+    char *variable_value; // Points into assignment_text
+    unsigned int name_hash;
+    int environment_index; // Slot in shell_environment, -1 unless exported
+} shell_variable;
+
+shell_variable *variable_table = NULL; // Open addressing with linear probing; the capacity is a power of two
+int variable_count = 0;
+int variable_table_capacity = 0;
+char **shell_environment = NULL; // NULL-terminated envp of the exported variables; environ points here
+int environment_count = 0;
+int environment_capacity = 0;
+int last_exit_status = 0; // $?
+pid_t shell_process_id = 0; // $$, kept by subshells like bash
+pid_t last_background_id = 0; // $!, 0 until a job has been started
+
+// Text produced by expanding one word. Characters that came from an
+// unquoted $ expansion may be split into separate arguments, and unquoted
+// glob characters are expanded against the file system.
+typedef struct {
+    char *text;
+    char *character_flags; // Per character: EXPANSION_SPLITTABLE and EXPANSION_UNQUOTED bits
+    size_t length;
+    size_t capacity;
+    int has_quotes; // A quoted empty word still makes an (empty) argument
+} expansion_buffer;
+
+// Parsed command line kept by the plan cache, keyed by its exact text
+typedef struct command_plan {
+    char *line_text;
+    unsigned int line_hash;
+    syntax_node *command_tree; // With plan_* fields filled in for each command
+    struct command_plan *next_plan;
+} command_plan;
+
+command_plan *plan_cache_table[PLAN_CACHE_BUCKETS];
+memory_arena plan_arena = {NULL}; // Holds every cached line, tree and plan
+int plan_cache_count = 0;
+unsigned long plan_cache_hits = 0; // Lines run without lexing or parsing
+unsigned long plan_cache_misses = 0;
+char *stream_buffer = NULL; // Reusable buffer for in-process output that cannot be spliced
+
+// One entry of a cached directory listing
+typedef struct {
+    char *entry_name;
+    unsigned char entry_type; // d_type from getdents64 (DT_UNKNOWN on some file systems)
+} listing_entry;
+
+// A directory's entries, sorted byte-wise, as read at one modification time
+typedef struct directory_listing {
+    dev_t device;
+    ino_t inode;
+    struct timespec modified_time; // The entries are trusted while the directory's mtime is unchanged
+    int racy; // Read in the same second it was modified: a later change could keep the mtime
+    unsigned long checked_walk; // Glob walk that last validated the listing
+    listing_entry *entries; // "." and ".." left out
+    int entry_count;
+    char *name_storage; // Every entry name, NUL-terminated, in one block
+    struct directory_listing *next_listing;
+} directory_listing;
+
+directory_listing *listing_cache_table[LISTING_CACHE_BUCKETS];
+int listing_cache_count = 0;
+unsigned long glob_walk_number = 0; // Counts glob expansions; a walk checks each directory's mtime once
+unsigned long listing_cache_hits = 0; // Directories globbed without reading them again
+unsigned long listing_cache_scans = 0;
+
+// One glob pattern being matched, split at '/'
+typedef struct {
+    memory_arena *arena;
+    char **segments; // Backslash-escaped patterns; a final "**" is followed by "*"
+    int segment_count;
+    char **matches; // The argument vector the matches are appended to
+    int match_count;
+    int match_capacity;
+} glob_search;
+
+// Resource usage of one command started while statistics are collected
+typedef struct {
+    pid_t process_id; // 0 for commands the shell ran in-process
+    char *command_label; // Command words joined for the report
+    struct timespec start_time; // Taken just before the shell starts the command
+    struct rusage shell_usage; // Shell's own usage at start, for in-process commands
+    double wall_seconds;
+    double user_seconds;
+    double system_seconds;
+    long max_rss_kb; // Peak resident set of the child (-1 for in-process commands)
+    long voluntary_switches;
+    long involuntary_switches;
+    double spawn_seconds; // Time the shell spent in fork/posix_spawn for the command
+    int finished; // Set once the command has been reaped or has returned
+} stage_statistics;
+
+stage_statistics *collected_stages = NULL; // Commands started inside the current timed region
+int collected_stage_count = 0;
+int collected_stage_capacity = 0;
+int statistics_depth = 0; // Non-zero while a 'time' prefix or stats mode is collecting
+int stats_mode_enabled = 0; // set -o stats: report every command line
+int history_enabled = 0; // set -o history: record lines and expand !references (on when interactive)
+command_history shell_history = {-1, NULL, 0, 0, NULL, 0, 0};
+long pipe_size_setting = OPTION_AUTO; // set -o pipesize: bytes, OPTION_AUTO or OPTION_MAX
+long parallel_job_setting = OPTION_AUTO; // set -o parallel: ':::' job limit, auto = online CPUs
+long system_pipe_max_size = 0; // /proc/sys/fs/pipe-max-size, read on first use
+long cache_size_setting = OPTION_AUTO; // set -o cachesize: bytes kept by 'cache', auto = 256M
+long background_nice_setting = OPTION_AUTO; // set -o bgnice: nice adjustment for '&' jobs, auto = none
+char *background_cpu_list = NULL; // set -o bgcpus: CPUs reserved for '&' jobs (NULL = any)
+
+// 128-bit content key of a 'cache' command, named in hex on disk
+typedef struct {
+    unsigned long long low;
+    unsigned long long high;
+} cache_key;
+
+// One cache file as seen by eviction and 'cache --stats'
+typedef struct {
+    char entry_name[33];
+    long long entry_bytes;
+    long long last_used; // mtime in nanoseconds, refreshed on every hit
+} cache_entry_info;
+
+int cache_directory_fd = -1; // Opened on first use
+long long cache_total_bytes = -1; // Running size of the cache directory, -1 until the first scan
+unsigned long cache_hits = 0; // Session counters for 'cache --stats'
+unsigned long cache_misses = 0;
+unsigned long cache_bypasses = 0; // Commands run uncached (output redirections, '+', '&', stdin from a pipe)
+unsigned long cache_evictions = 0;
+
+// Kinds of binary trace events
+typedef enum { TRACE_EXEC, TRACE_FORK, TRACE_REAP, TRACE_PIPE_CLOSE } trace_event_type;
+
+// One fixed-size trace record (64 bytes, one cache line)
+typedef struct {
+    unsigned long long sequence; // Position in the stream plus one once the slot is complete
+    unsigned long long timestamp_ns; // CLOCK_MONOTONIC
+    unsigned long long start_ns; // TRACE_EXEC/TRACE_FORK: when the shell began starting the child
+    int event_type;
+    pid_t emitter_id; // Shell process that recorded the event
+    pid_t process_id; // Child spawned or reaped
+    int detail; // TRACE_REAP: exit status; TRACE_PIPE_CLOSE: descriptor
+    char label[24]; // Program name or pipe end, truncated
+} trace_event;
+
+// Ring of the most recent events in a shared anonymous mapping, so
+// events from forked shell children land in the same ring
+typedef struct {
+    unsigned long long next_sequence; // Claimed with an atomic fetch-and-add
+    unsigned long long first_sequence; // Moved forward by 'trace clear'
+    char padding[48]; // Keeps the counter off the first event's cache line
+    trace_event events[TRACE_RING_EVENTS];
+} trace_ring_buffer;
+
+int trace_enabled = 0; // set -o trace: record fork/exec/pipe/reap events
+trace_ring_buffer *trace_ring = NULL; // Mapped on the first recorded event
+pid_t trace_shell_id = 0; // Process ID every Chrome trace event is grouped under
+
+// io_uring instance behind the output layer, driven with raw syscalls
+typedef struct {
+    int ring_fd; // -1 until first needed, -2 once io_uring turned out to be unavailable
+    unsigned *submission_tail;
+    unsigned *submission_mask;
+    unsigned *submission_array;
+    unsigned *completion_head;
+    unsigned *completion_tail;
+    unsigned *completion_mask;
+    struct io_uring_sqe *submission_entries;
+    struct io_uring_cqe *completion_entries;
+    unsigned pending_operations; // Writes and syncs submitted but not yet reaped
+} output_ring;
+
+// Everything the shell writes itself (builtins, the '#' counter, operator
+// messages) goes through stdout into this layer. It collects stdio's
+// chunks in two large reusable buffers and writes one while the other
+// fills, through io_uring when available and write/writev otherwise.
+typedef struct {
+    char *buffers[2]; // OUTPUT_BUFFER_SIZE each, page-aligned and kept for the life of the shell
+    int active_buffer; // Buffer being filled; the other one may be in flight
+    size_t buffered_bytes; // Bytes waiting in the active buffer
+    int write_in_flight; // One ring write at a time keeps the output in order
+    size_t flight_bytes; // Length of that write
+    int shares_errors; // stdout and stderr are one file: flush after each builtin to keep them in order
+    int batching; // stdout is a file or pipe, where builtin output is worth collecting
+    int write_error; // errno of a failed write not yet reported by a builtin
+    output_ring ring;
+} output_layer;
+
+output_layer shell_output = {0}; // Set up by init_output_layer
+int output_ring_enabled = 1; // set -o uring: hand full buffers to io_uring when the kernel has it
+int output_sync_enabled = 0; // set -o syncout: fdatasync files builtins wrote through '>' and '>>'
+unsigned long output_ring_writes = 0; // Session counters for 'stats'
+unsigned long output_direct_writes = 0;
+unsigned long output_syncs = 0;
+unsigned long long output_bytes = 0;
+
+// Named settings changed with set -o / set +o. Flags are on/off; numeric
+// options take a value (set -o name=value) and set +o returns them to auto.
+typedef struct {
+    const char *option_name;
+    int *option_flag; // On/off option (NULL for numeric options)
+    long *option_size; // Numeric option: a count or bytes, OPTION_AUTO or OPTION_MAX
+    char **option_cpu_list; // CPU list option such as 0-3,6 (NULL when unset)
+} shell_option;
+
+shell_option shell_options[] = {
+    {"stats", &stats_mode_enabled, NULL, NULL},
+    {"history", &history_enabled, NULL, NULL},
+    {"trace", &trace_enabled, NULL, NULL},
+    {"pipesize", NULL, &pipe_size_setting, NULL},
+    {"parallel", NULL, &parallel_job_setting, NULL},
+    {"cachesize", NULL, &cache_size_setting, NULL},
+    {"bgnice", NULL, &background_nice_setting, NULL},
+    {"bgcpus", NULL, NULL, &background_cpu_list},
+    {"uring", &output_ring_enabled, NULL, NULL},
+    {"syncout", &output_sync_enabled, NULL, NULL},
+    {NULL, NULL, NULL, NULL}
+};
 
 // ======== FORWARD DECLARATIONS ======== //
-char* get_user_command();
-void remove_whitespace(char *text);
-void run_single_command(char *cmd_text, pid_t process_id);
-int validate_argument_count(char *cmd_text);
-void run_command_direct(char *cmd_text);
-int create_new_terminal();
-void handle_piped_commands(char *cmd_text);
-void process_word_counter(char *cmd_text);
-void process_file_concatenation(char *cmd_text);
-void process_mutual_file_append(char *cmd_text);
-void handle_reversed_pipe(char *cmd_text);
-void manage_background_execution(char *cmd_text);
-void handle_input_redirection(char *cmd_text);
-void run_sequential_commands(char *cmd_text);
-void handle_conditional_execution(char *cmd_text);
-void handle_output_redirection(char *cmd_text, char *redirect_type);
-
-// ======== CORE FUNCTIONS ======== //
-
-char* get_user_command() {
-    char *user_input = malloc(150 * sizeof(char)); // Allocate memory for command input
-    printf("mbash25$"); // Display custom shell prompt
-    fgets(user_input, 150, stdin); // Read user input from stdin
-    user_input[strcspn(user_input, "\n")] = '\0'; // Remove newline character
-    return user_input; // Return the cleaned command string
-}
-
-void remove_whitespace(char *text) {
-    if (!text || !*text) return; // Handle null or empty strings
-    
-    char *beginning = text; // Find start of non-whitespace content
-    while (*beginning && isspace((unsigned char)*beginning)) 
-        beginning++;
-    
-    if (!*beginning) { // String is all whitespace
-        *text = '\0';
+int open_input_reader(input_reader *reader, int input_fd, int interactive);
+void open_string_reader(input_reader *reader, const char *command_string);
+char* get_user_command(input_reader *reader);
+void close_input_reader(input_reader *reader);
+char* expand_history(const char *line, int *failed);
+void add_history_entry(const char *line);
+int is_operator_character(const char *text, int in_group);
+pid_t spawn_command(char *const parameters[], const spawn_options *options);
+pid_t spawn_with_policy(const char *program_path, char *const parameters[], char **command_environment,
+                        const spawn_options *options);
+int wait_for_command(pid_t process_id);
+void flush_shell_output();
+int finish_builtin_output(const char *command_name, int redirected, int exit_status);
+void exit_shell_child(int exit_status);
+void detach_output_ring();
+void check_output_target();
+void sync_output_target();
+int begin_stage_statistics(syntax_node *command, int argument_count, char **arguments);
+void record_stage_launch(int stage_index, pid_t process_id);
+void finish_stage_statistics(pid_t process_id, const struct rusage *usage);
+int execute_with_statistics(memory_arena *arena, syntax_node *node);
+unsigned long long trace_clock_ns();
+void trace_record(trace_event_type event_type, pid_t process_id, int detail, const char *label,
+                  unsigned long long start_ns);
+int parallel_job_limit(long requested_limit, int command_count);
+int run_parallel_jobs(memory_arena *arena, syntax_node **commands, int command_count, int job_limit);
+int execute_cached(memory_arena *arena, syntax_node *node);
+const char* resolve_command_path(const char *command_name);
+void forget_command_path(const char *command_name);
+void clear_command_hash();
+int create_session();
+int attach_session(int session_number);
+void run_session_loop(int attached_number);
+int process_word_counter(int file_count, char **file_list);
+unsigned long long count_word_starts(const unsigned char *data, size_t length, int previous_is_space);
+int count_file_words(word_count_file *counted_files, int file_count);
+int process_file_concatenation(int file_count, char **file_list);
+int stream_file_to_output(int source_fd, const char *file_name, int output_fd, const char *error_prefix);
+int process_mutual_file_append(const char *first_file, const char *second_file);
+long long copy_file_region(int source_fd, off_t source_offset, int destination_fd,
+                           off_t destination_offset, off_t length);
+int run_fan_out_pump(int source_fd, int *consumer_fds, int consumer_count);
+void init_job_control(int interactive);
+void update_job_states();
+void reap_background_jobs(int report_done);
+void* arena_alloc(memory_arena *arena, size_t size);
+void* arena_zalloc(memory_arena *arena, size_t size);
+void arena_reset(memory_arena *arena);
+syntax_node* parse_command_line(memory_arena *arena, const char *line_text, int *parse_failed);
+syntax_node* find_command_plan(const char *line_text, int *parse_failed);
+void report_incomplete_command();
+const char* planned_program_path(syntax_node *command);
+syntax_node* parse_fan_out(command_lexer *lexer, syntax_node *producer);
+syntax_node* parse_command(command_lexer *lexer);
+syntax_node* parse_list(command_lexer *lexer);
+size_t skip_substitution(const char *text, size_t start);
+void** append_to_array(memory_arena *arena, void **array, int count, int *capacity, void *item);
+char* expand_word(memory_arena *arena, char *word);
+char** expand_arguments(memory_arena *arena, syntax_node *command, int *argument_count);
+builtin_handler find_builtin(const char *command_name);
+const char* find_shell_variable(const char *variable_name, size_t name_length);
+void set_shell_variable(const char *variable_name, const char *variable_value, int export_variable);
+int is_assignment_word(const char *word);
+char* expand_text(memory_arena *arena, char *word, int here_document);
+void expand_into_buffer(memory_arena *arena, const char *word, int here_document, expansion_buffer *buffer);
+int execute_node(memory_arena *arena, syntax_node *node);
+pid_t fork_shell_child(const stage_wiring *wiring);
+pid_t start_command(memory_arena *arena, syntax_node *command, stage_wiring wiring, int *finished_status);
+int start_background_job(memory_arena *arena, syntax_node *background);
+int run_command_loop(input_reader *reader, memory_arena *line_arena);
+int builtin_killterm(int argument_count, char **arguments);
+int builtin_newt(int argument_count, char **arguments);
+int builtin_sessions(int argument_count, char **arguments);
+int builtin_attach(int argument_count, char **arguments);
+int builtin_hash(int argument_count, char **arguments);
+int builtin_stats(int argument_count, char **arguments);
+int builtin_jobs(int argument_count, char **arguments);
+int builtin_fg(int argument_count, char **arguments);
+int builtin_bg(int argument_count, char **arguments);
+int builtin_wait(int argument_count, char **arguments);
+int builtin_cd(int argument_count, char **arguments);
+int builtin_echo(int argument_count, char **arguments);
+int builtin_pwd(int argument_count, char **arguments);
+int builtin_true(int argument_count, char **arguments);
+int builtin_false(int argument_count, char **arguments);
+int builtin_test(int argument_count, char **arguments);
+int builtin_export(int argument_count, char **arguments);
+int builtin_set(int argument_count, char **arguments);
+int builtin_parallel(int argument_count, char **arguments);
+int builtin_history(int argument_count, char **arguments);
+int builtin_cache(int argument_count, char **arguments);
+int builtin_trace(int argument_count, char **arguments);
+int builtin_ulimit(int argument_count, char **arguments);
+
+// Builtins the evaluator checks before spawning anything; the common
+// trivial commands come first since scripts run them the most
+builtin_entry builtin_table[] = {
+    {"echo", builtin_echo},
+    {"true", builtin_true},
+    {"false", builtin_false},
+    {"test", builtin_test},
+    {"[", builtin_test},
+    {"cd", builtin_cd},
+    {"pwd", builtin_pwd},
+    {"export", builtin_export},
+    {"set", builtin_set},
+    {"killterm", builtin_killterm},
+    {"newt", builtin_newt},
+    {"sessions", builtin_sessions},
+    {"attach", builtin_attach},
+    {"hash", builtin_hash},
+    {"stats", builtin_stats},
+    {"jobs", builtin_jobs},
+    {"fg", builtin_fg},
+    {"bg", builtin_bg},
+    {"wait", builtin_wait},
+    {"parallel", builtin_parallel},
+    {"history", builtin_history},
+    {"cache", builtin_cache},
+    {"trace", builtin_trace},
+    {"ulimit", builtin_ulimit},
+    {NULL, NULL}
+};
+
+// ======== INPUT READER ======== //
+
+int open_input_reader(input_reader *reader, int input_fd, int interactive) {
+    struct stat file_info;
+    memset(reader, 0, sizeof(*reader));
+    reader->input_fd = input_fd;
+    reader->interactive = interactive;
+
+    if (!interactive && fstat(input_fd, &file_info) == 0 && S_ISREG(file_info.st_mode) &&
+        file_info.st_size > 0) { // Regular files are mapped once and split in place
+        off_t start_offset = lseek(input_fd, 0, SEEK_CUR);
+        if (start_offset < 0 || start_offset > file_info.st_size) start_offset = 0;
+        void *mapped = mmap(NULL, file_info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, input_fd, 0);
+        if (mapped != MAP_FAILED) {
+            madvise(mapped, file_info.st_size, MADV_SEQUENTIAL);
+            reader->line_data = mapped;
+            reader->data_length = file_info.st_size;
+            reader->line_start = start_offset;
+            reader->is_mapped = 1;
+            reader->seek_input = (input_fd == STDIN_FILENO); // Children may read the rest of stdin
+            return 0;
+        }
+    }
+
+    reader->buffer_capacity = INPUT_BUFFER_SIZE; // One buffer reused for every line
+    reader->line_data = malloc(reader->buffer_capacity);
+    return reader->line_data ? 0 : -1;
+}
+
+void open_string_reader(input_reader *reader, const char *command_string) {
+    memset(reader, 0, sizeof(*reader));
+    reader->input_fd = -1;
+    reader->line_data = strdup(command_string); // Writable copy so lines split in place
+    reader->data_length = strlen(command_string);
+}
+
+char* next_mapped_line(input_reader *reader) {
+    if (reader->seek_input) { // A child may have consumed part of stdin since the last line
+        off_t shared_offset = lseek(reader->input_fd, 0, SEEK_CUR);
+        if (shared_offset >= 0 && (size_t)shared_offset <= reader->data_length)
+            reader->line_start = shared_offset;
+    }
+    if (reader->line_start >= reader->data_length) return NULL; // End of input
+    char *line_begin = reader->line_data + reader->line_start;
+    size_t remaining = reader->data_length - reader->line_start;
+    char *line_end = memchr(line_begin, '\n', remaining);
+
+    if (!line_end) { // Unterminated last line: no room to write a terminator in place
+        free(reader->tail_line);
+        reader->tail_line = strndup(line_begin, remaining);
+        reader->line_start = reader->data_length;
+        line_begin = reader->tail_line;
+    } else {
+        *line_end = '\0';
+        reader->line_start = line_end + 1 - reader->line_data;
+    }
+    if (reader->seek_input) lseek(reader->input_fd, reader->line_start, SEEK_SET);
+    return line_begin;
+}
+
+char* next_buffered_line(input_reader *reader) {
+    while (1) {
+        char *line_begin = reader->line_data + reader->line_start;
+        size_t pending = reader->data_length - reader->line_start;
+        char *line_end = memchr(line_begin, '\n', pending);
+        if (line_end) { // Complete line already buffered
+            *line_end = '\0';
+            reader->line_start = line_end + 1 - reader->line_data;
+            return line_begin;
+        }
+
+        memmove(reader->line_data, line_begin, pending); // Compact the partial line to the front
+        reader->line_start = 0;
+        reader->data_length = pending;
+        if (pending + 1 >= reader->buffer_capacity) { // Line longer than the buffer
+            char *grown_buffer = realloc(reader->line_data, reader->buffer_capacity * 2);
+            if (!grown_buffer) return NULL;
+            reader->line_data = grown_buffer;
+            reader->buffer_capacity *= 2;
+        }
+
+        if (reader->interactive && session_count > 0) run_session_loop(0); // Keep sessions drained meanwhile
+        ssize_t read_bytes = read(reader->input_fd, reader->line_data + pending,
+                                  reader->buffer_capacity - pending - 1);
+        if (read_bytes < 0 && errno == EINTR) continue;
+        if (read_bytes <= 0) { // EOF: hand out any unterminated last line once
+            if (pending == 0) return NULL;
+            reader->line_data[pending] = '\0';
+            reader->line_start = reader->data_length = pending;
+            return reader->line_data;
+        }
+        reader->data_length += read_bytes;
+    }
+}
+
+char* get_user_command(input_reader *reader) {
+    if (reader->interactive) {
+        printf(reader->continuation ? "> " : "mbash25$"); // Display custom shell prompt
+        flush_shell_output();
+    }
+    if (reader->input_fd < 0 || reader->is_mapped) return next_mapped_line(reader);
+    return next_buffered_line(reader); // Read user input from the descriptor
+}
+
+void close_input_reader(input_reader *reader) {
+    if (reader->is_mapped) munmap(reader->line_data, reader->data_length);
+    else free(reader->line_data);
+    free(reader->tail_line);
+    memset(reader, 0, sizeof(*reader));
+    reader->input_fd = -1;
+}
+
+// ======== HISTORY ======== //
+
+// Opens the history file on first use: $MBASH25_HISTFILE, else ~/.mbash25_history
+int open_history() {
+    if (shell_history.file_fd >= 0) return 0;
+    const char *file_path = getenv("MBASH25_HISTFILE");
+    char default_path[4096];
+    if (!file_path || !*file_path) {
+        const char *home_directory = getenv("HOME");
+        if (!home_directory) return -1;
+        snprintf(default_path, sizeof(default_path), "%s/.mbash25_history", home_directory);
+        file_path = default_path;
+    }
+    shell_history.file_fd = open(file_path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    return shell_history.file_fd >= 0 ? 0 : -1;
+}
+
+// Brings the mapping and the offset index up to date with the file. Only
+// the bytes appended since the last call (by this shell or any other) are
+// scanned; an unterminated last record still being written is left for later.
+int sync_history() {
+    struct stat file_info;
+    if (open_history() < 0 || fstat(shell_history.file_fd, &file_info) < 0) return -1;
+    size_t file_length = file_info.st_size;
+    if (file_length == shell_history.mapped_length) return 0;
+    if (file_length < shell_history.mapped_length) { // Truncated behind our back: start over
+        munmap(shell_history.mapped_data, shell_history.mapped_length);
+        shell_history.mapped_data = NULL;
+        shell_history.mapped_length = shell_history.indexed_length = shell_history.entry_count = 0;
+        if (file_length == 0) return 0;
+    }
+
+    void *mapped = shell_history.mapped_data
+        ? mremap(shell_history.mapped_data, shell_history.mapped_length, file_length, MREMAP_MAYMOVE)
+        : mmap(NULL, file_length, PROT_READ, MAP_SHARED, shell_history.file_fd, 0);
+    if (mapped == MAP_FAILED) return -1;
+    shell_history.mapped_data = mapped;
+    shell_history.mapped_length = file_length;
+
+    const char *record_start = shell_history.mapped_data + shell_history.indexed_length;
+    const char *data_end = shell_history.mapped_data + file_length;
+    const char *record_end;
+    while (record_start < data_end && (record_end = memchr(record_start, '\n', data_end - record_start))) {
+        if (shell_history.entry_count == shell_history.offset_capacity) {
+            size_t new_capacity = shell_history.offset_capacity ? shell_history.offset_capacity * 2 : 1024;
+            size_t *grown = realloc(shell_history.entry_offsets, new_capacity * sizeof(size_t));
+            if (!grown) return -1;
+            shell_history.entry_offsets = grown;
+            shell_history.offset_capacity = new_capacity;
+        }
+        shell_history.entry_offsets[shell_history.entry_count++] = record_start - shell_history.mapped_data;
+        record_start = record_end + 1;
+    }
+    shell_history.indexed_length = record_start - shell_history.mapped_data;
+    return 0;
+}
+
+// Text of entry number (1-based) inside the mapping, not NUL-terminated
+const char* history_entry(size_t entry_number, size_t *entry_length) {
+    if (entry_number < 1 || entry_number > shell_history.entry_count) return NULL;
+    size_t entry_start = shell_history.entry_offsets[entry_number - 1];
+    size_t entry_end = (entry_number < shell_history.entry_count)
+        ? shell_history.entry_offsets[entry_number] : shell_history.indexed_length;
+    *entry_length = entry_end - entry_start - 1; // Without the record's newline
+    return shell_history.mapped_data + entry_start;
+}
+
+// Appends one record with a single O_APPEND write, so concurrent shells
+// never interleave inside a record. Newlines are stored as \x1e.
+void add_history_entry(const char *line) {
+    size_t line_length = strlen(line);
+    if (line_length == 0 || line[0] == ' ' || open_history() < 0) return; // Leading space: keep it private
+    char *record = malloc(line_length + 1);
+    if (!record) return;
+    for (size_t char_index = 0; char_index < line_length; char_index++)
+        record[char_index] = (line[char_index] == '\n') ? HISTORY_NEWLINE : line[char_index];
+    record[line_length] = '\n';
+    if (write(shell_history.file_fd, record, line_length + 1) < 0) perror("history");
+    free(record);
+}
+
+void print_history_entry(size_t entry_number) {
+    size_t entry_length;
+    const char *entry_text = history_entry(entry_number, &entry_length);
+    printf("%5zu  ", entry_number);
+    for (size_t char_index = 0; char_index < entry_length; char_index++)
+        putchar(entry_text[char_index] == HISTORY_NEWLINE ? '\n' : entry_text[char_index]);
+    putchar('\n');
+}
+
+// Latest entry starting with prefix (0 if none); scans back from the end
+size_t find_history_prefix(const char *prefix, size_t prefix_length) {
+    for (size_t entry_number = shell_history.entry_count; entry_number > 0; entry_number--) {
+        size_t entry_length;
+        const char *entry_text = history_entry(entry_number, &entry_length);
+        if (entry_length >= prefix_length && memcmp(entry_text, prefix, prefix_length) == 0) return entry_number;
+    }
+    return 0;
+}
+
+// Performs !!, !n, !-n and !prefix substitution on an input line. Returns a
+// malloc'd expanded line, or NULL when the line has no history reference
+// (*failed is set, after a message, when a reference cannot be resolved).
+char* expand_history(const char *line, int *failed) {
+    *failed = 0;
+    if (!strchr(line, '!')) return NULL;
+    size_t expanded_capacity = strlen(line) + 1, expanded_length = 0;
+    char *expanded = malloc(expanded_capacity);
+    int in_single_quotes = 0, substituted = 0;
+    if (!expanded) return NULL;
+
+    for (const char *cursor = line; *cursor; ) {
+        const char *reference_end = cursor + 1;
+        size_t entry_number = 0;
+        int is_reference = 0;
+        if (*cursor == '\'') in_single_quotes = !in_single_quotes;
+        if (*cursor == '!' && !in_single_quotes && cursor[1] && !strchr(" \t=(\n", cursor[1]) &&
+            !(cursor > line && cursor[-1] == '$')) { // $! is the last background job
+            is_reference = 1;
+            sync_history();
+            if (cursor[1] == '!') { // !! is the previous command
+                entry_number = shell_history.entry_count;
+                reference_end = cursor + 2;
+            } else if (isdigit((unsigned char)cursor[1]) || (cursor[1] == '-' && isdigit((unsigned char)cursor[2]))) {
+                char *number_end;
+                long requested = strtol(cursor + 1, &number_end, 10);
+                long resolved = (requested < 0) ? (long)shell_history.entry_count + 1 + requested : requested;
+                entry_number = (resolved > 0) ? (size_t)resolved : 0;
+                reference_end = number_end;
+            } else { // !prefix runs up to the end of the word
+                while (*reference_end && !isspace((unsigned char)*reference_end) &&
+                       !is_operator_character(reference_end, 0))
+                    reference_end++;
+                entry_number = find_history_prefix(cursor + 1, reference_end - cursor - 1);
+            }
+        }
+
+        size_t entry_length = reference_end - cursor;
+        const char *replacement = cursor;
+        if (is_reference) {
+            replacement = history_entry(entry_number, &entry_length);
+            if (!replacement) {
+                fprintf(stderr, "mbash25: %.*s: event not found\n", (int)(reference_end - cursor), cursor);
+                free(expanded);
+                *failed = 1;
+                return NULL;
+            }
+            substituted = 1;
+        }
+        if (expanded_length + entry_length + 1 > expanded_capacity) {
+            expanded_capacity = (expanded_length + entry_length + 1) * 2;
+            char *grown = realloc(expanded, expanded_capacity);
+            if (!grown) {
+                free(expanded);
+                return NULL;
+            }
+            expanded = grown;
+        }
+        for (size_t char_index = 0; char_index < entry_length; char_index++) // Decode stored newlines
+            expanded[expanded_length++] = (replacement[char_index] == HISTORY_NEWLINE) ? '\n' : replacement[char_index];
+        cursor = reference_end;
+    }
+    expanded[expanded_length] = '\0';
+    if (!substituted) {
+        free(expanded);
+        return NULL;
+    }
+    return expanded;
+}
+
+// history [N] lists all (or the last N) entries; history -s PATTERN lists
+// the entries containing PATTERN, searching the mapped file directly
+int builtin_history(int argument_count, char **arguments) {
+    if (sync_history() < 0) {
+        fprintf(stderr, "history: cannot open history file\n");
+        return 1;
+    }
+    if (argument_count > 1 && strcmp(arguments[1], "-s") == 0) {
+        if (argument_count != 3 || !*arguments[2]) {
+            fprintf(stderr, "history: usage: history -s pattern\n");
+            return 2;
+        }
+        size_t pattern_length = strlen(arguments[2]), entry_index = 0;
+        const char *search_start = shell_history.mapped_data;
+        const char *data_end = shell_history.mapped_data + shell_history.indexed_length;
+        const char *match;
+        int found = 0;
+        while (search_start < data_end &&
+               (match = memmem(search_start, data_end - search_start, arguments[2], pattern_length))) {
+            size_t match_offset = match - shell_history.mapped_data;
+            size_t low = entry_index, high = shell_history.entry_count; // Entry holding the match
+            while (high - low > 1) {
+                size_t middle = (low + high) / 2;
+                if (shell_history.entry_offsets[middle] <= match_offset) low = middle;
+                else high = middle;
+            }
+            entry_index = low;
+            size_t entry_length;
+            const char *entry_text = history_entry(entry_index + 1, &entry_length);
+            if (match + pattern_length <= entry_text + entry_length) { // Not across two records
+                print_history_entry(entry_index + 1);
+                found = 1;
+            }
+            search_start = entry_text + entry_length + 1; // One line per entry
+            entry_index++;
+        }
+        return found ? 0 : 1;
+    }
+
+    size_t first_entry = 1;
+    if (argument_count > 1) {
+        char *number_end;
+        long last_count = strtol(arguments[1], &number_end, 10);
+        if (*number_end || last_count < 0) {
+            fprintf(stderr, "history: %s: numeric argument required\n", arguments[1]);
+            return 2;
+        }
+        if ((size_t)last_count < shell_history.entry_count) first_entry = shell_history.entry_count - last_count + 1;
+    }
+    for (size_t entry_number = first_entry; entry_number <= shell_history.entry_count; entry_number++)
+        print_history_entry(entry_number);
+    return 0;
+}
+
+// ======== SESSIONS ======== //
+
+int find_session(int session_number) {
+    for (int session_index = 0; session_index < session_count; session_index++)
+        if (session_table[session_index].session_number == session_number) return session_index;
+    return -1;
+}
+
+// Writes all of data to a descriptor, waiting for room when it is non-blocking
+void write_session_data(int output_fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(output_fd, data, length);
+        if (written < 0 && errno == EAGAIN) {
+            struct pollfd writable = {output_fd, POLLOUT, 0};
+            poll(&writable, 1, -1);
+            continue;
+        }
+        if (written < 0 && errno == EINTR) continue;
+        if (written < 0) return;
+        data += written;
+        length -= written;
+    }
+}
+
+// Appends output to a session's scrollback ring, keeping the newest bytes
+void keep_scrollback(shell_session *session, const char *data, size_t length) {
+    if (!session->scrollback && !(session->scrollback = malloc(SESSION_SCROLLBACK_SIZE))) return;
+    if (length > SESSION_SCROLLBACK_SIZE) {
+        data += length - SESSION_SCROLLBACK_SIZE;
+        length = SESSION_SCROLLBACK_SIZE;
+    }
+    size_t write_offset = (session->scrollback_start + session->scrollback_length) % SESSION_SCROLLBACK_SIZE;
+    size_t first_part = SESSION_SCROLLBACK_SIZE - write_offset;
+    if (first_part > length) first_part = length;
+    memcpy(session->scrollback + write_offset, data, first_part);
+    memcpy(session->scrollback, data + first_part, length - first_part);
+    session->scrollback_length += length;
+    if (session->scrollback_length > SESSION_SCROLLBACK_SIZE) { // Oldest bytes were overwritten
+        session->scrollback_start = (session->scrollback_start + session->scrollback_length -
+                                     SESSION_SCROLLBACK_SIZE) % SESSION_SCROLLBACK_SIZE;
+        session->scrollback_length = SESSION_SCROLLBACK_SIZE;
+    }
+}
+
+// Makes a session the attached one: its terminal takes our window size
+// and whatever it printed while away is shown first
+void show_session(shell_session *session) {
+    struct winsize window_size;
+    if (ioctl(STDIN_FILENO, TIOCGWINSZ, &window_size) == 0) ioctl(session->master_fd, TIOCSWINSZ, &window_size);
+    char banner[64];
+    int banner_length = snprintf(banner, sizeof(banner), "\r\n[session %d]\r\n", session->session_number);
+    write_session_data(STDOUT_FILENO, banner, banner_length);
+    if (session->scrollback_length) {
+        size_t first_part = SESSION_SCROLLBACK_SIZE - session->scrollback_start;
+        if (first_part > session->scrollback_length) first_part = session->scrollback_length;
+        write_session_data(STDOUT_FILENO, session->scrollback + session->scrollback_start, first_part);
+        write_session_data(STDOUT_FILENO, session->scrollback, session->scrollback_length - first_part);
+        session->scrollback_start = session->scrollback_length = 0;
+    }
+}
+
+// Drops a session whose shell has gone (its terminal reads EIO)
+void remove_session(int session_index) {
+    shell_session *session = &session_table[session_index];
+    epoll_ctl(session_epoll_fd, EPOLL_CTL_DEL, session->master_fd, NULL);
+    close(session->master_fd);
+    waitpid(session->process_id, NULL, 0);
+    free(session->scrollback);
+    session_table[session_index] = session_table[--session_count];
+}
+
+// The session event loop. Every session's output is drained as it
+// arrives: to the terminal for the attached session, into its scrollback
+// for the others, and sessions whose shell has gone are removed. With no
+// session attached (attached_number 0) it returns once the terminal has
+// input for the main shell. Attached, it relays keystrokes until Ctrl-] d
+// detaches or the session ends; Ctrl-] n and Ctrl-] 1-9 switch sessions.
+void run_session_loop(int attached_number) {
+    struct epoll_event events[SESSION_LIMIT + 1];
+    char relay_buffer[4096];
+    int escape_pending = 0;
+    while (session_count > 0) {
+        int ready_count = epoll_wait(session_epoll_fd, events, SESSION_LIMIT + 1, -1);
+        if (ready_count < 0 && errno == EINTR) continue;
+        if (ready_count < 0) {
+            perror("epoll_wait");
+            return;
+        }
+        for (int event_index = 0; event_index < ready_count; event_index++) {
+            int session_number = events[event_index].data.u32;
+            if (session_number == 0) { // The terminal
+                if (!attached_number) return;
+                ssize_t read_bytes = read(STDIN_FILENO, relay_buffer, sizeof(relay_buffer));
+                if (read_bytes < 0 && errno == EINTR) continue;
+                if (read_bytes <= 0) return;
+                int attached_index = find_session(attached_number);
+                if (attached_index < 0) return;
+                ssize_t run_start = 0; // Plain keystrokes are forwarded in runs
+                for (ssize_t byte_index = 0; byte_index <= read_bytes; byte_index++) {
+                    int key = byte_index < read_bytes ? (unsigned char)relay_buffer[byte_index] : -1;
+                    if (!escape_pending && key != SESSION_ESCAPE && key != -1) continue;
+                    write_session_data(session_table[attached_index].master_fd, relay_buffer + run_start,
+                                       byte_index - run_start);
+                    run_start = byte_index + 1;
+                    if (key == -1) break;
+                    if (!escape_pending) {
+                        escape_pending = 1;
+                        continue;
+                    }
+                    escape_pending = 0;
+                    if (key == SESSION_ESCAPE) { // Ctrl-] twice sends one through
+                        run_start = byte_index;
+                    } else if (key == 'd') {
+                        return;
+                    } else if (key == 'n' || (key >= '1' && key <= '9')) {
+                        int next_index = (key == 'n') ? (attached_index + 1) % session_count
+                                                      : find_session(key - '0');
+                        if (next_index < 0) continue;
+                        attached_index = next_index;
+                        attached_number = session_table[attached_index].session_number;
+                        show_session(&session_table[attached_index]);
+                    }
+                }
+                continue;
+            }
+            int session_index = find_session(session_number);
+            if (session_index < 0) continue; // Removed earlier in this round
+            shell_session *session = &session_table[session_index];
+            ssize_t read_bytes = read(session->master_fd, relay_buffer, sizeof(relay_buffer));
+            if (read_bytes < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+            if (read_bytes <= 0) { // The session's shell and everything it started have closed the terminal
+                remove_session(session_index);
+                if (session_number != attached_number) continue;
+                char notice[64];
+                int notice_length = snprintf(notice, sizeof(notice), "\r\n[session %d ended]\r\n", session_number);
+                write_session_data(STDOUT_FILENO, notice, notice_length);
+                return;
+            }
+            if (session_number == attached_number) write_session_data(STDOUT_FILENO, relay_buffer, read_bytes);
+            else keep_scrollback(session, relay_buffer, read_bytes);
+        }
+    }
+}
+
+// Runs the user's terminal raw and hands it to a session until detached
+int attach_session(int session_number) {
+    struct termios saved_mode, raw_mode;
+    int session_index = find_session(session_number);
+    if (session_index < 0) return 1;
+    if (tcgetattr(STDIN_FILENO, &saved_mode) < 0) {
+        fprintf(stderr, "attach: needs a terminal\n");
+        return 1;
+    }
+    flush_shell_output();
+    raw_mode = saved_mode;
+    cfmakeraw(&raw_mode);
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw_mode);
+    show_session(&session_table[session_index]);
+    run_session_loop(session_number);
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &saved_mode);
+    printf("\n");
+    return 0;
+}
+
+// Starts a session: a forked copy of this shell, so it begins with the
+// command hash, plan and listing caches already filled (shared
+// copy-on-write) and the same history file, but from here on keeps its
+// own directory, variables and jobs. No terminal emulator or X display
+// is involved; the session lives on a pseudo-terminal this shell serves.
+// Returns the new session's number, or -1.
+int create_session() {
+    if (session_count == SESSION_LIMIT) {
+        fprintf(stderr, "newt: %d sessions already open\n", SESSION_LIMIT);
+        return -1;
+    }
+    shell_session *session = &session_table[session_count];
+    memset(session, 0, sizeof(*session));
+    session->master_fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (session->master_fd < 0 || grantpt(session->master_fd) < 0 || unlockpt(session->master_fd) < 0 ||
+        ptsname_r(session->master_fd, session->terminal_name, sizeof(session->terminal_name)) != 0) {
+        perror("newt");
+        if (session->master_fd >= 0) close(session->master_fd);
+        return -1;
+    }
+    fcntl(session->master_fd, F_SETFL, O_NONBLOCK);
+    struct winsize window_size;
+    if (ioctl(STDIN_FILENO, TIOCGWINSZ, &window_size) == 0) ioctl(session->master_fd, TIOCSWINSZ, &window_size);
+    if (session_epoll_fd < 0) {
+        session_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        struct epoll_event terminal_event = {EPOLLIN, {.u32 = 0}};
+        if (isatty(STDIN_FILENO)) epoll_ctl(session_epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &terminal_event);
+    }
+
+    flush_shell_output();
+    unsigned long long fork_start_ns = trace_enabled ? trace_clock_ns() : 0;
+    session->process_id = fork();
+    if (session->process_id < 0) {
+        perror("Fork failed");
+        close(session->master_fd);
+        return -1;
+    }
+    if (session->process_id == 0) {
+        for (int session_index = 0; session_index <= session_count; session_index++)
+            close(session_table[session_index].master_fd); // Our own terminal included
+        if (session_epoll_fd >= 0) close(session_epoll_fd);
+        session_epoll_fd = -1;
+        session_count = 0;
+        detach_output_ring();
+        setsid(); // The first terminal a session leader opens becomes its controlling terminal
+        int terminal_fd = open(session->terminal_name, O_RDWR);
+        if (terminal_fd < 0) _exit(127);
+        for (int stream_fd = STDIN_FILENO; stream_fd <= STDERR_FILENO; stream_fd++) dup2(terminal_fd, stream_fd);
+        if (terminal_fd > STDERR_FILENO) close(terminal_fd);
+        check_output_target();
+        job_count = 0; // The main shell's jobs are not this session's children
+        shell_process_id = getpid();
+        last_background_id = 0;
+        shell_is_interactive = history_enabled = 1;
+        input_reader session_reader;
+        memory_arena session_arena = {NULL};
+        if (open_input_reader(&session_reader, STDIN_FILENO, 1) < 0) exit_shell_child(EXIT_FAILURE);
+        exit_shell_child(run_command_loop(&session_reader, &session_arena));
+    }
+    if (trace_enabled) trace_record(TRACE_FORK, session->process_id, 0, "session", fork_start_ns);
+    session->session_number = next_session_number++;
+    struct epoll_event session_event = {EPOLLIN, {.u32 = session->session_number}};
+    epoll_ctl(session_epoll_fd, EPOLL_CTL_ADD, session->master_fd, &session_event);
+    session_count++;
+    return session->session_number;
+}
+
+// ======== RESOURCE POLICY ======== //
+
+// Resource limits ulimit knows, with bash's option letters and units
+typedef struct {
+    char option_letter;
+    int resource;
+    const char *description;
+    const char *unit_name; // NULL for plain counts
+    rlim_t unit_size; // Bytes (or seconds) per unit shown and accepted
+} resource_limit_entry;
+
+const resource_limit_entry resource_limits[] = {
+    {'t', RLIMIT_CPU, "cpu time", "seconds", 1},
+    {'f', RLIMIT_FSIZE, "file size", "blocks", 1024},
+    {'n', RLIMIT_NOFILE, "open files", NULL, 1},
+    {'v', RLIMIT_AS, "virtual memory", "kbytes", 1024},
+    {0, 0, NULL, NULL, 0}
+};
+
+const resource_limit_entry* find_resource_limit(char option_letter) {
+    for (const resource_limit_entry *entry = resource_limits; entry->description; entry++)
+        if (entry->option_letter == option_letter) return entry;
+    return NULL;
+}
+
+// Parses a CPU list such as "0-3,6" into a set. Returns -1 if malformed or empty.
+int parse_cpu_list(const char *text, cpu_set_t *cpu_set) {
+    CPU_ZERO(cpu_set);
+    const char *cursor = text;
+    while (*cursor) {
+        char *number_end;
+        long first_cpu = strtol(cursor, &number_end, 10), last_cpu = first_cpu;
+        if (number_end == cursor || first_cpu < 0) return -1;
+        cursor = number_end;
+        if (*cursor == '-') {
+            last_cpu = strtol(cursor + 1, &number_end, 10);
+            if (number_end == cursor + 1 || last_cpu < first_cpu) return -1;
+            cursor = number_end;
+        }
+        if (last_cpu >= CPU_SETSIZE) return -1;
+        for (long cpu = first_cpu; cpu <= last_cpu; cpu++) CPU_SET(cpu, cpu_set);
+        if (*cursor == ',') cursor++;
+        else if (*cursor) return -1;
+    }
+    return CPU_COUNT(cpu_set) ? 0 : -1;
+}
+
+// Parses a taskset-style hexadecimal mask such as "0x6" (CPUs 1 and 2)
+int parse_cpu_mask(const char *text, cpu_set_t *cpu_set) {
+    CPU_ZERO(cpu_set);
+    if (text[0] == '0' && (text[1] == 'x' || text[1] == 'X')) text += 2;
+    size_t digit_count = strlen(text);
+    if (!digit_count || strspn(text, "0123456789abcdefABCDEF") != digit_count || digit_count * 4 > CPU_SETSIZE)
+        return -1;
+    for (size_t digit_index = 0; digit_index < digit_count; digit_index++) {
+        char digit = text[digit_count - 1 - digit_index]; // Lowest CPUs are on the right
+        int nibble = isdigit((unsigned char)digit) ? digit - '0' : tolower((unsigned char)digit) - 'a' + 10;
+        for (int bit = 0; bit < 4; bit++)
+            if (nibble & (1 << bit)) CPU_SET(digit_index * 4 + bit, cpu_set);
+    }
+    return CPU_COUNT(cpu_set) ? 0 : -1;
+}
+
+// Parses a ulimit value: "unlimited" or a count of the limit's units
+int parse_limit_value(const char *text, const resource_limit_entry *entry, rlim_t *value) {
+    if (strcmp(text, "unlimited") == 0) {
+        *value = RLIM_INFINITY;
+        return 0;
+    }
+    char *number_end;
+    errno = 0;
+    unsigned long long units = strtoull(text, &number_end, 10);
+    if (errno || number_end == text || *number_end || text[0] == '-' || units > RLIM_INFINITY / entry->unit_size)
+        return -1;
+    *value = units * entry->unit_size;
+    return 0;
+}
+
+// Parses ulimit's options ([-S] [-H] -t|-f|-n|-v [VALUE] ...) from
+// arguments[1]. Limits with a value are stored in the policy, replacing an
+// earlier setting of the same resource (the last one wins, as in bash), and
+// counted in set_count when given; with print_letters set, the letters of
+// the limits given without a value are collected there. Returns the index
+// of the first argument after the options, or -1 for a bad one (reported
+// unless quiet).
+int parse_ulimit_options(int argument_count, char **arguments, resource_policy *policy, char *print_letters,
+                         int *set_count, int quiet) {
+    int set_soft = 0, set_hard = 0, print_count = 0, argument_index = 1;
+    for (; argument_index < argument_count && arguments[argument_index][0] == '-'; argument_index++) {
+        for (const char *letter = arguments[argument_index] + 1; *letter; letter++) {
+            if (*letter == 'S') { set_soft = 1; continue; }
+            if (*letter == 'H') { set_hard = 1; continue; }
+            const resource_limit_entry *entry = find_resource_limit(*letter);
+            if (!entry) {
+                if (quiet) return -1;
+                fprintf(stderr, "mbash25: ulimit: -%c: invalid option\n", *letter);
+                fprintf(stderr, "ulimit: usage: ulimit [-SH] [-tfnv] [limit|unlimited] [command ...]\n");
+                return -1;
+            }
+            const char *value_text = (argument_index + 1 < argument_count && !letter[1]) ? arguments[argument_index + 1]
+                                                                                         : NULL;
+            rlim_t value;
+            if (!value_text || (value_text[0] != 'u' && !isdigit((unsigned char)value_text[0]))) {
+                if (print_letters) print_letters[print_count++] = *letter;
+                continue;
+            }
+            if (parse_limit_value(value_text, entry, &value) < 0) {
+                if (!quiet) fprintf(stderr, "mbash25: ulimit: %s: invalid number\n", value_text);
+                return -1;
+            }
+            int slot = 0;
+            while (slot < policy->limit_count && policy->limit_resources[slot] != entry->resource) slot++;
+            if (slot == POLICY_LIMIT_COUNT) { // Only when a resource table entry has no slot
+                if (!quiet) fprintf(stderr, "mbash25: ulimit: -%c: too many limits\n", *letter);
+                return -1;
+            }
+            struct rlimit current_limit;
+            if (slot < policy->limit_count) current_limit = policy->limit_values[slot];
+            else getrlimit(entry->resource, &current_limit);
+            if (set_soft || !set_hard) current_limit.rlim_cur = value; // bash sets both unless told otherwise
+            if (set_hard || !set_soft) current_limit.rlim_max = value;
+            policy->limit_resources[slot] = entry->resource;
+            policy->limit_values[slot] = current_limit;
+            if (slot == policy->limit_count) policy->limit_count++;
+            if (set_count) (*set_count)++;
+            argument_index++;
+            break;
+        }
+    }
+    if (print_letters) print_letters[print_count] = '\0';
+    return argument_index;
+}
+
+// Consumes leading 'nice [-n N]', 'taskset -c LIST' / 'taskset MASK' and
+// 'ulimit -X VALUE' words that wrap a command ("nice -n 5 taskset -c 2
+// make") into the policy. Returns how many words they took, 0 when the
+// command is not wrapped (so a bare 'nice' or 'taskset -p' still runs the
+// real program), or -1 after reporting a bad setting.
+int parse_policy_prefixes(int argument_count, char **arguments, resource_policy *policy) {
+    int consumed = 0;
+    while (consumed < argument_count) {
+        char **words = arguments + consumed;
+        int remaining = argument_count - consumed, used = 0;
+        if (strcmp(words[0], "nice") == 0) {
+            long adjustment = DEFAULT_NICE_ADJUSTMENT;
+            const char *value_text = NULL;
+            used = 1;
+            if (remaining > 2 && strcmp(words[1], "-n") == 0) value_text = words[2], used = 3;
+            else if (remaining > 1 && strncmp(words[1], "-n", 2) == 0 && words[1][2]) value_text = words[1] + 2, used = 2;
+            else if (remaining > 1 && words[1][0] == '-' && isdigit((unsigned char)words[1][1]))
+                value_text = words[1] + 1, used = 2;
+            if (value_text) {
+                char *number_end;
+                adjustment = strtol(value_text, &number_end, 10);
+                if (number_end == value_text || *number_end) {
+                    fprintf(stderr, "mbash25: nice: %s: invalid adjustment\n", value_text);
+                    return -1;
+                }
+            }
+            if (used < remaining) policy->nice_adjustment += adjustment;
+        } else if (strcmp(words[0], "taskset") == 0 && remaining > 2) {
+            int is_list = (strcmp(words[1], "-c") == 0 || strcmp(words[1], "--cpu-list") == 0);
+            if (!is_list && words[1][0] == '-') break; // -p and friends are the real taskset's job
+            used = is_list ? 3 : 2;
+            const char *cpu_text = words[used - 1];
+            if ((is_list ? parse_cpu_list(cpu_text, &policy->cpu_set) : parse_cpu_mask(cpu_text, &policy->cpu_set)) < 0) {
+                fprintf(stderr, "mbash25: taskset: %s: invalid CPU %s\n", cpu_text, is_list ? "list" : "mask");
+                return -1;
+            }
+            if (used < remaining) policy->has_cpu_set = 1;
+        } else if (strcmp(words[0], "ulimit") == 0) {
+            resource_policy saved_policy = *policy;
+            int set_count = 0;
+            used = parse_ulimit_options(remaining, words, policy, NULL, &set_count, 1);
+            if (used < 0 || !set_count) { // The builtin reports or prints
+                *policy = saved_policy;
+                break;
+            }
+        } else {
+            break;
+        }
+        if (used >= remaining) break; // Nothing left to run: the word is a command of its own
+        consumed += used;
+    }
+    return consumed;
+}
+
+// Defaults for '&' jobs from set -o bgnice and set -o bgcpus
+void add_background_policy(resource_policy *policy) {
+    if (background_nice_setting != OPTION_AUTO)
+        policy->nice_adjustment = (background_nice_setting == OPTION_MAX) ? 19 : background_nice_setting;
+    if (background_cpu_list && parse_cpu_list(background_cpu_list, &policy->cpu_set) == 0)
+        policy->has_cpu_set = 1;
+}
+
+int policy_is_empty(const resource_policy *policy) {
+    return !policy->nice_adjustment && !policy->has_cpu_set && !policy->limit_count;
+}
+
+// Applies a policy to the calling process, which is about to exec (or is a
+// forked shell whose children inherit it). Only plain system calls are
+// made, so it is safe in a vfork child. Returns the name of the setting
+// that failed, with errno set, or NULL.
+const char* apply_resource_policy(const resource_policy *policy) {
+    for (int limit_index = 0; limit_index < policy->limit_count; limit_index++)
+        if (setrlimit(policy->limit_resources[limit_index], &policy->limit_values[limit_index]) < 0) return "ulimit";
+    if (policy->nice_adjustment) {
+        errno = 0;
+        if (nice(policy->nice_adjustment) == -1 && errno) return "nice";
+    }
+    if (policy->has_cpu_set && sched_setaffinity(0, sizeof(cpu_set_t), &policy->cpu_set) < 0) return "taskset";
+    return NULL;
+}
+
+void print_resource_limit(const resource_limit_entry *entry, int hard_limit, int with_description) {
+    struct rlimit current_limit;
+    if (getrlimit(entry->resource, &current_limit) < 0) return;
+    rlim_t value = hard_limit ? current_limit.rlim_max : current_limit.rlim_cur;
+    if (with_description) { // Same layout as bash's ulimit -a
+        char label[32];
+        if (entry->unit_name) snprintf(label, sizeof(label), "(%s, -%c)", entry->unit_name, entry->option_letter);
+        else snprintf(label, sizeof(label), "(-%c)", entry->option_letter);
+        printf("%-*s%s ", (int)(36 - strlen(label)), entry->description, label);
+    }
+    if (value == RLIM_INFINITY) printf("unlimited\n");
+    else printf("%llu\n", (unsigned long long)(value / entry->unit_size));
+}
+
+// ulimit -t|-f|-n|-v VALUE sets the shell's own limits, which every later
+// command inherits; without a value it prints the limit, and -a prints
+// them all. 'ulimit -X VALUE command' limits only that command (handled
+// as a wrapper by the evaluator).
+int builtin_ulimit(int argument_count, char **arguments) {
+    if (argument_count == 2 && strcmp(arguments[1], "-a") == 0) {
+        for (const resource_limit_entry *entry = resource_limits; entry->description; entry++)
+            print_resource_limit(entry, 0, 1);
+        return 0;
+    }
+    resource_policy policy = {0};
+    char print_letters[32];
+    int next_argument = parse_ulimit_options(argument_count, arguments, &policy, print_letters, NULL, 0);
+    if (next_argument < 0) return 2;
+    if (next_argument < argument_count) {
+        fprintf(stderr, "mbash25: ulimit: %s: invalid number\n", arguments[next_argument]);
+        return 2;
+    }
+    int hard_limit = (argument_count > 1 && strchr(arguments[1], 'H') && !strchr(arguments[1], 'S'));
+    if (!policy.limit_count && !print_letters[0]) strcpy(print_letters, "f"); // bash's default
+    for (const char *letter = print_letters; *letter; letter++)
+        print_resource_limit(find_resource_limit(*letter), hard_limit, strlen(print_letters) > 1);
+    if (apply_resource_policy(&policy)) {
+        perror("mbash25: ulimit");
+        return 1;
+    }
+    return 0;
+}
+
+// ======== OUTPUT LAYER ======== //
+
+// Maps a ring for the output layer (no liburing). Fails on kernels without
+// io_uring, when it is disabled, or when a write cannot use the file position.
+int setup_output_ring(output_ring *ring) {
+    struct io_uring_params parameters = {0};
+    int ring_fd = syscall(SYS_io_uring_setup, OUTPUT_RING_ENTRIES, &parameters);
+    if (ring_fd < 0) return -1;
+    size_t submission_size = parameters.sq_off.array + parameters.sq_entries * sizeof(unsigned);
+    size_t completion_size = parameters.cq_off.cqes + parameters.cq_entries * sizeof(struct io_uring_cqe);
+    size_t entries_size = parameters.sq_entries * sizeof(struct io_uring_sqe);
+    int single_mapping = (parameters.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mapping && completion_size > submission_size) submission_size = completion_size;
+    char *submission_ring = mmap(NULL, submission_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                 ring_fd, IORING_OFF_SQ_RING);
+    char *completion_ring = single_mapping ? submission_ring :
+                            mmap(NULL, completion_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                 ring_fd, IORING_OFF_CQ_RING);
+    void *submission_entries = mmap(NULL, entries_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                    ring_fd, IORING_OFF_SQES);
+    if (submission_ring == MAP_FAILED || completion_ring == MAP_FAILED || submission_entries == MAP_FAILED ||
+        !(parameters.features & IORING_FEAT_RW_CUR_POS)) { // Writes pass offset -1 for "where the file is"
+        if (submission_ring != MAP_FAILED) munmap(submission_ring, submission_size);
+        if (!single_mapping && completion_ring != MAP_FAILED) munmap(completion_ring, completion_size);
+        if (submission_entries != MAP_FAILED) munmap(submission_entries, entries_size);
+        close(ring_fd);
+        return -1;
+    }
+    ring->submission_tail = (unsigned *)(submission_ring + parameters.sq_off.tail);
+    ring->submission_mask = (unsigned *)(submission_ring + parameters.sq_off.ring_mask);
+    ring->submission_array = (unsigned *)(submission_ring + parameters.sq_off.array);
+    ring->completion_head = (unsigned *)(completion_ring + parameters.cq_off.head);
+    ring->completion_tail = (unsigned *)(completion_ring + parameters.cq_off.tail);
+    ring->completion_mask = (unsigned *)(completion_ring + parameters.cq_off.ring_mask);
+    ring->submission_entries = submission_entries;
+    ring->completion_entries = (struct io_uring_cqe *)(completion_ring + parameters.cq_off.cqes);
+    ring->pending_operations = 0;
+    ring->ring_fd = ring_fd;
+    return 0;
+}
+
+// True when full buffers should go to io_uring; the ring is set up on first use
+int output_ring_ready() {
+    if (!output_ring_enabled) return 0;
+    if (shell_output.ring.ring_fd == -1 && setup_output_ring(&shell_output.ring) < 0)
+        shell_output.ring.ring_fd = -2; // Stay with direct writes for the rest of this process
+    return shell_output.ring.ring_fd >= 0;
+}
+
+// Latches a failed write for finish_builtin_output to report
+void report_output_error(int error_number) {
+    if (error_number == EPIPE) raise(SIGPIPE); // What a plain write would have done
+    if (!shell_output.write_error) shell_output.write_error = error_number;
+}
+
+// Writes the pieces to stdout with writev, picking up after short writes
+void write_output_vector(struct iovec *pieces, int piece_count) {
+    output_direct_writes++;
+    while (piece_count > 0) {
+        ssize_t written = writev(STDOUT_FILENO, pieces, piece_count);
+        if (written < 0 && errno == EINTR) continue;
+        if (written < 0) {
+            report_output_error(errno);
+            return;
+        }
+        output_bytes += written;
+        while (piece_count > 0 && (size_t)written >= pieces->iov_len) {
+            written -= pieces->iov_len;
+            pieces++;
+            piece_count--;
+        }
+        if (piece_count > 0) {
+            pieces->iov_base = (char *)pieces->iov_base + written;
+            pieces->iov_len -= written;
+        }
+    }
+}
+
+// Handles one finished ring operation: a sync closes its private
+// descriptor, a write that fell short has the rest written directly
+void finish_output_operation(unsigned long long user_data, int result) {
+    shell_output.ring.pending_operations--;
+    if (user_data) { // fdatasync of a redirect target (user_data is its descriptor + 1)
+        if (result < 0) fprintf(stderr, "mbash25: syncout: %s\n", strerror(-result));
+        close((int)user_data - 1);
+        return;
+    }
+    shell_output.write_in_flight = 0;
+    if (result < 0 && result != -EINTR && result != -EAGAIN) {
+        report_output_error(-result);
+        return;
+    }
+    size_t written = result > 0 ? (size_t)result : 0;
+    output_bytes += written;
+    if (written < shell_output.flight_bytes) {
+        struct iovec rest = {shell_output.buffers[1 - shell_output.active_buffer] + written,
+                             shell_output.flight_bytes - written};
+        write_output_vector(&rest, 1);
+    }
+}
+
+// Reaps completions, waiting until the in-flight write is done (when
+// wait_for_write is set) and at most pending_limit operations remain
+void reap_output_ring(int wait_for_write, unsigned pending_limit) {
+    output_ring *ring = &shell_output.ring;
+    while (1) {
+        unsigned head = *ring->completion_head;
+        while (head != __atomic_load_n(ring->completion_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *completion = &ring->completion_entries[head & *ring->completion_mask];
+            unsigned long long user_data = completion->user_data;
+            int result = completion->res;
+            __atomic_store_n(ring->completion_head, ++head, __ATOMIC_RELEASE);
+            finish_output_operation(user_data, result);
+        }
+        if ((!wait_for_write || !shell_output.write_in_flight) && ring->pending_operations <= pending_limit) return;
+        if (syscall(SYS_io_uring_enter, ring->ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+            errno != EINTR) {
+            perror("io_uring_enter");
+            shell_output.write_in_flight = 0;
+            ring->pending_operations = 0;
+            return;
+        }
+    }
+}
+
+// Clears the next submission slot for the caller to fill in, first
+// making room when every slot is still busy
+struct io_uring_sqe* claim_output_entry() {
+    output_ring *ring = &shell_output.ring;
+    if (ring->pending_operations >= OUTPUT_RING_ENTRIES) reap_output_ring(0, OUTPUT_RING_ENTRIES - 1);
+    unsigned slot = *ring->submission_tail & *ring->submission_mask;
+    struct io_uring_sqe *entry = &ring->submission_entries[slot];
+    memset(entry, 0, sizeof(*entry));
+    ring->submission_array[slot] = slot;
+    return entry;
+}
+
+// Submits the claimed slot. Returns -1 (with the slot handed back) when
+// the kernel refuses it.
+int submit_output_entry() {
+    output_ring *ring = &shell_output.ring;
+    unsigned tail = *ring->submission_tail;
+    __atomic_store_n(ring->submission_tail, tail + 1, __ATOMIC_RELEASE);
+    long submitted;
+    while ((submitted = syscall(SYS_io_uring_enter, ring->ring_fd, 1, 0, 0, NULL, 0)) < 0 && errno == EINTR) {}
+    if (submitted != 1) { // Nothing was consumed, so the slot can be taken back
+        __atomic_store_n(ring->submission_tail, tail, __ATOMIC_RELEASE);
+        return -1;
+    }
+    ring->pending_operations++;
+    return 0;
+}
+
+// Hands the active buffer to the kernel. With asynchronous set and a ring
+// available the write runs while the shell fills the other buffer;
+// otherwise (and at flush points, which wait anyway) it is written directly.
+void queue_output_buffer(int asynchronous) {
+    size_t length = shell_output.buffered_bytes;
+    if (length == 0) return;
+    char *buffer = shell_output.buffers[shell_output.active_buffer];
+    shell_output.buffered_bytes = 0;
+    if (shell_output.write_in_flight) reap_output_ring(1, UINT_MAX); // The previous buffer lands first
+    if (asynchronous && output_ring_ready()) {
+        struct io_uring_sqe *entry = claim_output_entry();
+        entry->opcode = IORING_OP_WRITE;
+        entry->fd = STDOUT_FILENO;
+        entry->off = (__u64)-1;
+        entry->addr = (unsigned long)buffer;
+        entry->len = length;
+        if (submit_output_entry() == 0) {
+            output_ring_writes++;
+            shell_output.write_in_flight = 1;
+            shell_output.flight_bytes = length;
+            shell_output.active_buffer = 1 - shell_output.active_buffer;
+            return;
+        }
+    }
+    struct iovec whole = {buffer, length};
+    write_output_vector(&whole, 1);
+}
+
+// fopencookie write function behind stdout. Chunks are gathered in the
+// active buffer; one too big to be worth copying goes out in a single
+// writev behind whatever is already buffered.
+ssize_t write_output_cookie(void *cookie, const char *data, size_t length) {
+    (void)cookie;
+    if (shell_output.buffered_bytes + length > OUTPUT_BUFFER_SIZE) {
+        if (length >= OUTPUT_BUFFER_SIZE / 2) {
+            if (shell_output.write_in_flight) reap_output_ring(1, UINT_MAX);
+            struct iovec pieces[2] = {{shell_output.buffers[shell_output.active_buffer], shell_output.buffered_bytes},
+                                      {(char *)data, length}};
+            shell_output.buffered_bytes = 0;
+            write_output_vector(pieces[0].iov_len ? pieces : pieces + 1, pieces[0].iov_len ? 2 : 1);
+            return length;
+        }
+        queue_output_buffer(1);
+    }
+    memcpy(shell_output.buffers[shell_output.active_buffer] + shell_output.buffered_bytes, data, length);
+    shell_output.buffered_bytes += length;
+    return length;
+}
+
+// Pushes everything the shell has written so far to stdout's descriptor.
+// Called before anything else can write there (spawned commands, forked
+// children, splice copies), before stdout is redirected or restored, and
+// before the prompt.
+void flush_shell_output() {
+    fflush(stdout);
+    if (!shell_output.buffers[0]) return;
+    queue_output_buffer(0);
+    if (shell_output.write_in_flight) reap_output_ring(1, UINT_MAX);
+}
+
+// Flushes and also waits for queued syncs, for when the process ends
+void finish_shell_output() {
+    flush_shell_output();
+    if (shell_output.ring.ring_fd >= 0) reap_output_ring(1, 0);
+    if (shell_output.write_error) fprintf(stderr, "mbash25: write error: %s\n", strerror(shell_output.write_error));
+    shell_output.write_error = 0;
+}
+
+// Ends an in-process command's output. It is flushed right away unless
+// batching pays off (a file or pipe that stays in place and is not shared
+// with stderr); a failed write turns the status into 1 with bash's
+// "write error" message.
+int finish_builtin_output(const char *command_name, int redirected, int exit_status) {
+    if (redirected || shell_output.shares_errors || !shell_output.batching) flush_shell_output();
+    if (!shell_output.write_error) return exit_status;
+    fprintf(stderr, "%s: write error: %s\n", command_name, strerror(shell_output.write_error));
+    shell_output.write_error = 0;
+    return 1;
+}
+
+// Ends a forked copy of the shell without losing its buffered output
+void exit_shell_child(int exit_status) {
+    finish_shell_output();
+    _exit(exit_status);
+}
+
+// A forked child must not use the parent's ring: it drops its copy and
+// sets up its own if it writes enough to need one. The parent flushed
+// before forking, so nothing of the child's is in flight.
+void detach_output_ring() {
+    if (shell_output.ring.ring_fd >= 0) {
+        close(shell_output.ring.ring_fd);
+        shell_output.ring.ring_fd = -1;
+    }
+    shell_output.ring.pending_operations = 0;
+    shell_output.write_in_flight = 0;
+}
+
+// Notes what stdout now reaches: builtins flush as they finish when it is
+// a terminal or device, or the same file as stderr (so messages interleave
+// as they were written)
+void check_output_target() {
+    struct stat output_status, error_status;
+    int output_known = fstat(STDOUT_FILENO, &output_status) == 0;
+    shell_output.batching = output_known && (S_ISREG(output_status.st_mode) || S_ISFIFO(output_status.st_mode) ||
+                                             S_ISSOCK(output_status.st_mode));
+    shell_output.shares_errors = output_known && fstat(STDERR_FILENO, &error_status) == 0 &&
+                                 output_status.st_dev == error_status.st_dev &&
+                                 output_status.st_ino == error_status.st_ino;
+}
+
+// set -o syncout: once a builtin's '>' or '>>' file is complete, fdatasync
+// it. On the ring the sync is queued on a private copy of the descriptor
+// (stdout is restored right after) and the shell does not wait for it.
+void sync_output_target() {
+    struct stat target_status;
+    if (fstat(STDOUT_FILENO, &target_status) < 0 || !S_ISREG(target_status.st_mode)) return;
+    output_syncs++;
+    int sync_fd;
+    if (output_ring_ready() && (sync_fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10)) >= 0) {
+        struct io_uring_sqe *entry = claim_output_entry();
+        entry->opcode = IORING_OP_FSYNC;
+        entry->fd = sync_fd;
+        entry->fsync_flags = IORING_FSYNC_DATASYNC;
+        entry->user_data = sync_fd + 1;
+        if (submit_output_entry() == 0) return;
+        close(sync_fd);
+    }
+    if (fdatasync(STDOUT_FILENO) < 0) fprintf(stderr, "mbash25: syncout: %s\n", strerror(errno));
+}
+
+// Puts the output layer behind stdout. stdio keeps a small buffer of its
+// own so putchar stays cheap; the layer sees its chunks.
+void init_output_layer() {
+    shell_output.ring.ring_fd = -1;
+    void *first_buffer = NULL, *second_buffer = NULL;
+    cookie_io_functions_t output_functions = {NULL, write_output_cookie, NULL, NULL};
+    FILE *output_stream = NULL;
+    if (posix_memalign(&first_buffer, 4096, OUTPUT_BUFFER_SIZE) != 0 ||
+        posix_memalign(&second_buffer, 4096, OUTPUT_BUFFER_SIZE) != 0 ||
+        !(output_stream = fopencookie(NULL, "w", output_functions))) {
+        free(first_buffer); // Plain stdio then; flush_shell_output only calls fflush
+        free(second_buffer);
+        return;
+    }
+    shell_output.buffers[0] = first_buffer;
+    shell_output.buffers[1] = second_buffer;
+    setvbuf(output_stream, NULL, _IOFBF, OUTPUT_STAGING_SIZE);
+    stdout = output_stream;
+    check_output_target();
+    atexit(finish_shell_output);
+}
+
+// ======== SPAWN LAYER ======== //
+
+// Every command the shell launches goes through here. posix_spawn uses
+// CLONE_VM|CLONE_VFORK under glibc, so the shell's page tables are never
+// copied and launch latency does not grow with the shell's memory size.
+// Descriptors the shell opens for a child (pipes, redirect targets) are
+// created O_CLOEXEC, so only the ones installed by dup2 survive the exec.
+pid_t spawn_command(char *const parameters[], const spawn_options *options) {
+    posix_spawn_file_actions_t file_actions;
+    posix_spawnattr_t spawn_attributes;
+    short spawn_flags = 0;
+    pid_t process_id;
+
+    posix_spawn_file_actions_init(&file_actions);
+    posix_spawnattr_init(&spawn_attributes);
+    if (options) {
+        if (options->input_fd >= 0 && options->input_fd != STDIN_FILENO)
+            posix_spawn_file_actions_adddup2(&file_actions, options->input_fd, STDIN_FILENO);
+        if (options->output_fd >= 0 && options->output_fd != STDOUT_FILENO)
+            posix_spawn_file_actions_adddup2(&file_actions, options->output_fd, STDOUT_FILENO);
+        if (options->process_group >= 0) { // Equivalent of setpgid(0, group) in the child
+            posix_spawnattr_setpgroup(&spawn_attributes, options->process_group);
+            spawn_flags |= POSIX_SPAWN_SETPGROUP;
+        }
+    }
+    sigset_t empty_mask, default_signals; // Children start with the signal state the shell changed reset
+    sigemptyset(&empty_mask);
+    sigemptyset(&default_signals);
+    sigaddset(&default_signals, SIGCHLD);
+    sigaddset(&default_signals, SIGTTOU);
+    sigaddset(&default_signals, SIGPIPE); // --serve workers ignore it for themselves only
+    posix_spawnattr_setsigmask(&spawn_attributes, &empty_mask);
+    posix_spawnattr_setsigdefault(&spawn_attributes, &default_signals);
+    spawn_flags |= POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+    posix_spawnattr_setflags(&spawn_attributes, spawn_flags);
+    flush_shell_output(); // Keep shell messages ordered before the child's output
+
+    unsigned long long spawn_start_ns = trace_enabled ? trace_clock_ns() : 0;
+    const char *program_path = (options && options->program_path) ? options->program_path
+                                                                   : resolve_command_path(parameters[0]);
+    char **command_environment = (options && options->environment) ? options->environment : environ;
+    int spawn_error = program_path ? 0 : ENOENT;
+    if (program_path && options && options->policy) {
+        posix_spawn_file_actions_destroy(&file_actions);
+        posix_spawnattr_destroy(&spawn_attributes);
+        process_id = spawn_with_policy(program_path, parameters, command_environment, options);
+        if (process_id == -1 && errno == ENOENT && program_path != parameters[0]) { // Cached binary vanished
+            forget_command_path(parameters[0]);
+            program_path = resolve_command_path(parameters[0]);
+            if (program_path) process_id = spawn_with_policy(program_path, parameters, command_environment, options);
+            else errno = ENOENT;
+        }
+        if (process_id == -2) return -1; // Already reported
+        if (process_id < 0) {
+            perror("Execution failed");
+            return -1;
+        }
+        if (trace_enabled) trace_record(TRACE_EXEC, process_id, 0, parameters[0], spawn_start_ns);
+        return process_id;
+    }
+    if (program_path) {
+        spawn_error = posix_spawn(&process_id, program_path, &file_actions,
+                                  &spawn_attributes, parameters, command_environment);
+        if (spawn_error == ENOENT && program_path != parameters[0]) { // Cached binary vanished
+            forget_command_path(parameters[0]);
+            program_path = resolve_command_path(parameters[0]);
+            if (program_path)
+                spawn_error = posix_spawn(&process_id, program_path, &file_actions,
+                                          &spawn_attributes, parameters, command_environment);
+        }
+    }
+    posix_spawn_file_actions_destroy(&file_actions);
+    posix_spawnattr_destroy(&spawn_attributes);
+    if (spawn_error != 0) { // Exec failures are reported back by posix_spawn
+        errno = spawn_error;
+        perror("Execution failed");
+        return -1;
+    }
+    // The vfork-style spawn returns after the exec, so this is the exec time
+    if (trace_enabled) trace_record(TRACE_EXEC, process_id, 0, parameters[0], spawn_start_ns);
+    return process_id;
+}
+
+// Launches a command that carries a resource policy. posix_spawn has no
+// attributes for nice values, CPU affinity or resource limits, so the
+// child is started with vfork instead: it still borrows the shell's memory
+// rather than copying page tables, applies the policy and its wiring, and
+// execs. Failures are passed back through the shared memory.
+pid_t spawn_with_policy(const char *program_path, char *const parameters[], char **command_environment,
+                        const spawn_options *options) {
+    volatile int child_error = 0;
+    const char * volatile failed_step = NULL;
+    sigset_t empty_mask;
+    sigemptyset(&empty_mask);
+    pid_t process_id = vfork();
+    if (process_id == 0) {
+        if (options->input_fd >= 0 && options->input_fd != STDIN_FILENO) dup2(options->input_fd, STDIN_FILENO);
+        if (options->output_fd >= 0 && options->output_fd != STDOUT_FILENO) dup2(options->output_fd, STDOUT_FILENO);
+        if (options->process_group >= 0) setpgid(0, options->process_group);
+        signal(SIGCHLD, SIG_DFL); // The same reset posix_spawn's attributes give other commands
+        signal(SIGTTOU, SIG_DFL);
+        signal(SIGPIPE, SIG_DFL);
+        sigprocmask(SIG_SETMASK, &empty_mask, NULL);
+        const char *policy_failure = apply_resource_policy(options->policy);
+        if (!policy_failure) execve(program_path, parameters, command_environment);
+        child_error = errno;
+        failed_step = policy_failure;
+        _exit(127);
+    }
+    if (process_id < 0) return -1;
+    if (child_error) { // The child has already exited
+        waitpid(process_id, NULL, 0);
+        if (failed_step) fprintf(stderr, "mbash25: %s: %s\n", failed_step, strerror(child_error));
+        errno = child_error;
+        return failed_step ? -2 : -1;
+    }
+    return process_id;
+}
+
+// Waits for a foreground command. wait4 hands back the child's rusage at
+// no extra cost, which feeds 'time' and stats mode.
+int wait_for_command(pid_t process_id) {
+    int process_status;
+    struct rusage usage;
+    if (wait4(process_id, &process_status, 0, &usage) < 0) return -1;
+    if (statistics_depth) finish_stage_statistics(process_id, &usage);
+    int exit_status = WIFEXITED(process_status) ? WEXITSTATUS(process_status) : 128 + WTERMSIG(process_status);
+    if (trace_enabled) trace_record(TRACE_REAP, process_id, exit_status, NULL, 0);
+    return exit_status;
+}
+
+// ======== RESOURCE STATISTICS ======== //
+
+double seconds_between(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+double timeval_seconds(const struct timeval *time_value) {
+    return time_value->tv_sec + time_value->tv_usec / 1e6;
+}
+
+// Opens a statistics record for a command about to start. Returns its
+// index, or -1 when nothing is being collected.
+int begin_stage_statistics(syntax_node *command, int argument_count, char **arguments) {
+    if (!statistics_depth) return -1;
+    if (collected_stage_count == collected_stage_capacity) {
+        int new_capacity = collected_stage_capacity ? collected_stage_capacity * 2 : 8;
+        stage_statistics *grown = realloc(collected_stages, new_capacity * sizeof(stage_statistics));
+        if (!grown) return -1;
+        collected_stages = grown;
+        collected_stage_capacity = new_capacity;
+    }
+    stage_statistics *stage = &collected_stages[collected_stage_count];
+    memset(stage, 0, sizeof(*stage));
+
+    char label[64]; // Long command lines are cut to keep the report on one line
+    size_t label_length = 0;
+    const char *prefix = (command->kind == COMMAND_WORD_COUNT) ? "#" :
+                         (command->kind == COMMAND_CONCATENATE) ? "++" : NULL;
+    if (prefix) label_length = snprintf(label, sizeof(label), "%s", prefix);
+    for (int argument_index = 0; argument_index < argument_count && label_length < sizeof(label) - 1;
+         argument_index++) {
+        const char *separator = (command->kind == COMMAND_MUTUAL_APPEND && argument_index == 1) ? " + " : " ";
+        if (label_length == 0) separator = "";
+        label_length += snprintf(label + label_length, sizeof(label) - label_length, "%s%s",
+                                 separator, arguments[argument_index]);
+    }
+    if (label_length >= sizeof(label) - 1) strcpy(label + sizeof(label) - 4, "...");
+    if (label_length == 0) strcpy(label, "(redirections)");
+    stage->command_label = strdup(label);
+
+    getrusage(RUSAGE_SELF, &stage->shell_usage);
+    clock_gettime(CLOCK_MONOTONIC, &stage->start_time);
+    return collected_stage_count++;
+}
+
+// Called once the shell is done starting a command: a PID means a child is
+// running and the time so far was fork/spawn overhead; 0 means the command
+// ran (or failed) in-process and is charged to the shell's own usage.
+void record_stage_launch(int stage_index, pid_t process_id) {
+    if (stage_index < 0) return;
+    stage_statistics *stage = &collected_stages[stage_index];
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (process_id > 0) {
+        stage->process_id = process_id;
+        stage->spawn_seconds = seconds_between(&stage->start_time, &now);
+        return;
+    }
+    struct rusage shell_usage;
+    getrusage(RUSAGE_SELF, &shell_usage);
+    stage->wall_seconds = seconds_between(&stage->start_time, &now);
+    stage->user_seconds = timeval_seconds(&shell_usage.ru_utime) - timeval_seconds(&stage->shell_usage.ru_utime);
+    stage->system_seconds = timeval_seconds(&shell_usage.ru_stime) - timeval_seconds(&stage->shell_usage.ru_stime);
+    stage->max_rss_kb = -1;
+    stage->voluntary_switches = shell_usage.ru_nvcsw - stage->shell_usage.ru_nvcsw;
+    stage->involuntary_switches = shell_usage.ru_nivcsw - stage->shell_usage.ru_nivcsw;
+    stage->finished = 1;
+}
+
+// Fills in the record of a reaped child from the rusage wait4 returned
+void finish_stage_statistics(pid_t process_id, const struct rusage *usage) {
+    for (int stage_index = collected_stage_count - 1; stage_index >= 0; stage_index--) {
+        stage_statistics *stage = &collected_stages[stage_index];
+        if (stage->process_id != process_id || stage->finished) continue;
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        stage->wall_seconds = seconds_between(&stage->start_time, &now);
+        stage->user_seconds = timeval_seconds(&usage->ru_utime);
+        stage->system_seconds = timeval_seconds(&usage->ru_stime);
+        stage->max_rss_kb = usage->ru_maxrss;
+        stage->voluntary_switches = usage->ru_nvcsw;
+        stage->involuntary_switches = usage->ru_nivcsw;
+        stage->finished = 1;
+        return;
+    }
+}
+
+void print_time_line(const char *name, double seconds) {
+    int minutes = (int)(seconds / 60);
+    fprintf(stderr, "%s\t%dm%.3fs\n", name, minutes, seconds - minutes * 60);
+}
+
+// Prints one row per command of the region (commands still running in the
+// background are left out), then bash's real/user/sys lines and the time
+// the shell itself spent starting processes.
+void report_statistics(int first_stage, double real_seconds, double user_seconds, double system_seconds) {
+    double spawn_total = 0;
+    int spawned_count = 0;
+    fprintf(stderr, "%7s %9s %9s %9s %9s %11s %9s  %s\n",
+            "PID", "WALL", "USER", "SYS", "MAXRSS", "CSW(v/i)", "SPAWN", "COMMAND");
+    for (int stage_index = first_stage; stage_index < collected_stage_count; stage_index++) {
+        stage_statistics *stage = &collected_stages[stage_index];
+        if (!stage->finished) continue;
+        char process_text[16] = "-", rss_text[24] = "-", spawn_text[24] = "-";
+        if (stage->process_id > 0) {
+            snprintf(process_text, sizeof(process_text), "%d", (int)stage->process_id);
+            snprintf(spawn_text, sizeof(spawn_text), "%.0fus", stage->spawn_seconds * 1e6);
+            spawn_total += stage->spawn_seconds;
+            spawned_count++;
+        }
+        if (stage->max_rss_kb >= 0) snprintf(rss_text, sizeof(rss_text), "%ldK", stage->max_rss_kb);
+        fprintf(stderr, "%7s %8.3fs %8.3fs %8.3fs %9s %5ld/%-5ld %9s  %s\n", process_text,
+                stage->wall_seconds, stage->user_seconds, stage->system_seconds, rss_text,
+                stage->voluntary_switches, stage->involuntary_switches, spawn_text, stage->command_label);
+    }
+    print_time_line("real", real_seconds);
+    print_time_line("user", user_seconds);
+    print_time_line("sys", system_seconds);
+    fprintf(stderr, "shell\t%.0fus starting %d process%s\n", spawn_total * 1e6, spawned_count,
+            spawned_count == 1 ? "" : "es");
+}
+
+// Runs a node with statistics collection on ('time' prefix or stats mode).
+// Totals are the shell's plus its reaped children's usage over the region,
+// like bash's time. Nested regions fold into the outermost one.
+int execute_with_statistics(memory_arena *arena, syntax_node *node) {
+    if (statistics_depth) return execute_node(arena, node);
+
+    int first_stage = collected_stage_count;
+    struct timespec start_time, end_time;
+    struct rusage shell_before, children_before, shell_after, children_after;
+    getrusage(RUSAGE_SELF, &shell_before);
+    getrusage(RUSAGE_CHILDREN, &children_before);
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    statistics_depth++;
+    int exit_status = execute_node(arena, node);
+    statistics_depth--;
+
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    getrusage(RUSAGE_SELF, &shell_after);
+    getrusage(RUSAGE_CHILDREN, &children_after);
+    flush_shell_output();
+    report_statistics(first_stage, seconds_between(&start_time, &end_time),
+                      timeval_seconds(&shell_after.ru_utime) - timeval_seconds(&shell_before.ru_utime) +
+                      timeval_seconds(&children_after.ru_utime) - timeval_seconds(&children_before.ru_utime),
+                      timeval_seconds(&shell_after.ru_stime) - timeval_seconds(&shell_before.ru_stime) +
+                      timeval_seconds(&children_after.ru_stime) - timeval_seconds(&children_before.ru_stime));
+
+    for (int stage_index = first_stage; stage_index < collected_stage_count; stage_index++)
+        free(collected_stages[stage_index].command_label);
+    collected_stage_count = first_stage;
+    return exit_status;
+}
+
+// ======== EVENT TRACE ======== //
+
+unsigned long long trace_clock_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now); // vDSO: no system call
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Records one event. Slots are claimed with an atomic fetch-and-add on a
+// counter that lives in the shared mapping, and published by storing the
+// slot's sequence number last, so the shell, its forked children and
+// worker threads never take a lock. Call sites check trace_enabled first,
+// so a disabled trace costs one load per site.
+void trace_record(trace_event_type event_type, pid_t process_id, int detail, const char *label,
+                  unsigned long long start_ns) {
+    if (!trace_ring) {
+        void *mapped = mmap(NULL, sizeof(trace_ring_buffer), PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (mapped == MAP_FAILED) return;
+        trace_ring = mapped; // Zero-filled: no slot is published yet
+        trace_shell_id = getpid();
+    }
+    unsigned long long sequence = __atomic_fetch_add(&trace_ring->next_sequence, 1, __ATOMIC_RELAXED);
+    trace_event *event = &trace_ring->events[sequence & (TRACE_RING_EVENTS - 1)];
+    __atomic_store_n(&event->sequence, 0, __ATOMIC_RELAXED); // Unpublished while being rewritten
+    event->timestamp_ns = trace_clock_ns();
+    event->start_ns = start_ns ? start_ns : event->timestamp_ns;
+    event->event_type = event_type;
+    event->emitter_id = getpid();
+    event->process_id = process_id;
+    event->detail = detail;
+    size_t label_length = label ? strnlen(label, sizeof(event->label) - 1) : 0;
+    memcpy(event->label, label, label_length);
+    event->label[label_length] = '\0';
+    __atomic_store_n(&event->sequence, sequence + 1, __ATOMIC_RELEASE);
+}
+
+void write_json_string(FILE *output, const char *text) {
+    fputc('"', output);
+    for (const unsigned char *cursor = (const unsigned char *)text; *cursor; cursor++) {
+        if (*cursor == '"' || *cursor == '\\') fprintf(output, "\\%c", *cursor);
+        else if (*cursor < 0x20) fprintf(output, "\\u%04x", *cursor);
+        else fputc(*cursor, output);
+    }
+    fputc('"', output);
+}
+
+// Writes the events still in the ring as a Chrome trace (chrome://tracing,
+// Perfetto). Each child gets its own track, from exec (or fork) to reap;
+// the time the shell spent in fork/posix_spawn and the pipe closes appear
+// on the track of the shell process that did them.
+int trace_dump(const char *file_name) {
+    FILE *output = fopen(file_name, "we");
+    if (!output) {
+        perror(file_name);
+        return 1;
+    }
+    fprintf(output, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    int first_written = 1;
+    if (trace_ring) {
+        unsigned long long end_sequence = __atomic_load_n(&trace_ring->next_sequence, __ATOMIC_ACQUIRE);
+        unsigned long long start_sequence = trace_ring->first_sequence;
+        if (end_sequence - start_sequence > TRACE_RING_EVENTS) start_sequence = end_sequence - TRACE_RING_EVENTS;
+        for (unsigned long long sequence = start_sequence; sequence < end_sequence; sequence++) {
+            trace_event event = trace_ring->events[sequence & (TRACE_RING_EVENTS - 1)];
+            if (__atomic_load_n(&trace_ring->events[sequence & (TRACE_RING_EVENTS - 1)].sequence,
+                                __ATOMIC_ACQUIRE) != sequence + 1 || event.sequence != sequence + 1)
+                continue; // Overwritten or still being written
+            double timestamp_us = event.timestamp_ns / 1e3, start_us = event.start_ns / 1e3;
+            const char *separator = first_written ? "" : ",\n";
+            first_written = 0;
+            switch (event.event_type) {
+            case TRACE_EXEC:
+            case TRACE_FORK:
+                fprintf(output, "%s{\"name\":", separator);
+                write_json_string(output, event.event_type == TRACE_EXEC ? "posix_spawn" : "fork");
+                fprintf(output, ",\"cat\":\"spawn\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,"
+                        "\"args\":{\"child\":%d}},\n", start_us, timestamp_us - start_us, (int)trace_shell_id,
+                        (int)event.emitter_id, (int)event.process_id);
+                fprintf(output, "{\"name\":");
+                write_json_string(output, event.label);
+                fprintf(output, ",\"cat\":\"child\",\"ph\":\"B\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+                        timestamp_us, (int)trace_shell_id, (int)event.process_id);
+                break;
+            case TRACE_REAP:
+                fprintf(output, "%s{\"cat\":\"child\",\"ph\":\"E\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d,"
+                        "\"args\":{\"status\":%d}}", separator, timestamp_us, (int)trace_shell_id,
+                        (int)event.process_id, event.detail);
+                break;
+            case TRACE_PIPE_CLOSE:
+                fprintf(output, "%s{\"name\":", separator);
+                write_json_string(output, event.label);
+                fprintf(output, ",\"cat\":\"pipe\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d,"
+                        "\"args\":{\"fd\":%d}}", timestamp_us, (int)trace_shell_id, (int)event.emitter_id,
+                        event.detail);
+                break;
+            }
+        }
+    }
+    fprintf(output, "\n]}\n");
+    if (fclose(output) != 0) {
+        perror(file_name);
+        return 1;
+    }
+    return 0;
+}
+
+// trace dump FILE writes the ring as a Chrome trace; trace clear empties it
+int builtin_trace(int argument_count, char **arguments) {
+    if (argument_count == 3 && strcmp(arguments[1], "dump") == 0) return trace_dump(arguments[2]);
+    if (argument_count == 2 && strcmp(arguments[1], "clear") == 0) {
+        if (trace_ring) trace_ring->first_sequence = __atomic_load_n(&trace_ring->next_sequence, __ATOMIC_ACQUIRE);
+        return 0;
+    }
+    fprintf(stderr, "trace: usage: trace dump FILE | trace clear (record with set -o trace)\n");
+    return 2;
+}
+
+// ======== COMMAND HASH ======== //
+
+unsigned int hash_command_name(const char *command_name) {
+    unsigned int hash_value = 2166136261u; // FNV-1a over the command name
+    while (*command_name) {
+        hash_value ^= (unsigned char)*command_name++;
+        hash_value *= 16777619u;
+    }
+    return hash_value % COMMAND_HASH_BUCKETS;
+}
+
+void clear_command_hash() {
+    command_hash_generation++;
+    for (int bucket = 0; bucket < COMMAND_HASH_BUCKETS; bucket++) {
+        command_hash_entry *entry = command_hash_table[bucket];
+        while (entry) { // Free every chained entry
+            command_hash_entry *next_entry = entry->next_entry;
+            free(entry->command_name);
+            free(entry->resolved_path);
+            free(entry);
+            entry = next_entry;
+        }
+        command_hash_table[bucket] = NULL;
+    }
+}
+
+void forget_command_path(const char *command_name) {
+    command_hash_entry **link = &command_hash_table[hash_command_name(command_name)];
+    while (*link) {
+        if (strcmp((*link)->command_name, command_name) == 0) { // Unlink stale entry
+            command_hash_entry *stale_entry = *link;
+            *link = stale_entry->next_entry;
+            command_hash_generation++;
+            free(stale_entry->command_name);
+            free(stale_entry->resolved_path);
+            free(stale_entry);
+            return;
+        }
+        link = &(*link)->next_entry;
+    }
+}
+
+char* search_path_for_command(const char *command_name, const char *path_value) {
+    size_t name_length = strlen(command_name);
+    const char *directory_start = path_value;
+    while (1) {
+        const char *directory_end = strchrnul(directory_start, ':');
+        size_t directory_length = directory_end - directory_start;
+        char candidate[directory_length + name_length + 3];
+        if (directory_length == 0) { // Empty PATH element means the current directory
+            strcpy(candidate, ".");
+        } else {
+            memcpy(candidate, directory_start, directory_length);
+            candidate[directory_length] = '\0';
+        }
+        strcat(candidate, "/");
+        strcat(candidate, command_name);
+
+        struct stat file_info;
+        if (stat(candidate, &file_info) == 0 && S_ISREG(file_info.st_mode) &&
+            access(candidate, X_OK) == 0)
+            return strdup(candidate); // First executable match wins, as with execvp
+
+        if (*directory_end == '\0') return NULL;
+        directory_start = directory_end + 1;
+    }
+}
+
+// Resolves a command name to the binary to exec. Names containing '/'
+// are used as typed; everything else is looked up in the hash table and
+// only searched for in PATH on a miss. A changed PATH empties the table.
+const char* resolve_command_path(const char *command_name) {
+    if (strchr(command_name, '/')) return command_name;
+
+    const char *path_value = getenv("PATH");
+    if (!path_value) path_value = "/bin:/usr/bin";
+    if (!hashed_path_value || strcmp(hashed_path_value, path_value) != 0) {
+        clear_command_hash(); // PATH changed since the table was filled
+        free(hashed_path_value);
+        hashed_path_value = strdup(path_value);
+    }
+
+    unsigned int bucket = hash_command_name(command_name);
+    for (command_hash_entry *entry = command_hash_table[bucket]; entry; entry = entry->next_entry) {
+        if (strcmp(entry->command_name, command_name) == 0) {
+            entry->use_count++;
+            command_hash_hits++;
+            return entry->resolved_path;
+        }
+    }
+
+    command_hash_misses++;
+    char *resolved_path = search_path_for_command(command_name, path_value);
+    if (!resolved_path) return NULL;
+
+    command_hash_entry *entry = malloc(sizeof(command_hash_entry));
+    entry->command_name = strdup(command_name);
+    entry->resolved_path = resolved_path;
+    entry->use_count = 1;
+    entry->next_entry = command_hash_table[bucket];
+    command_hash_table[bucket] = entry;
+    return resolved_path;
+}
+
+int builtin_hash(int argument_count, char **arguments) {
+    if (argument_count == 1) { // List the table the way bash does
+        int printed_header = 0;
+        for (int bucket = 0; bucket < COMMAND_HASH_BUCKETS; bucket++) {
+            for (command_hash_entry *entry = command_hash_table[bucket]; entry; entry = entry->next_entry) {
+                if (!printed_header) {
+                    printf("hits\tcommand\n");
+                    printed_header = 1;
+                }
+                printf("%4lu\t%s\n", entry->use_count, entry->resolved_path);
+            }
+        }
+        if (!printed_header) printf("hash: hash table empty\n");
+        return 0;
+    }
+    if (strcmp(arguments[1], "-r") == 0) { // Flush every remembered location
+        clear_command_hash();
+        return 0;
+    }
+    if (strcmp(arguments[1], "-s") == 0) { // Lookup counters
+        printf("hash: %lu hits, %lu misses\n", command_hash_hits, command_hash_misses);
+        return 0;
+    }
+    int exit_status = 0;
+    for (int argument_index = 1; argument_index < argument_count; argument_index++) {
+        forget_command_path(arguments[argument_index]); // Re-resolve the named commands now
+        if (!resolve_command_path(arguments[argument_index])) {
+            fprintf(stderr, "hash: %s: not found\n", arguments[argument_index]);
+            exit_status = 1;
+        }
+    }
+    return exit_status;
+}
+
+// Session counters of the plan cache, the glob listing cache and the output layer
+int builtin_stats(int argument_count, char **arguments) {
+    (void)arguments;
+    if (argument_count > 1) {
+        fprintf(stderr, "stats: usage: stats\n");
+        return 2;
+    }
+    printf("plans: %lu hits, %lu misses, %d cached\n", plan_cache_hits, plan_cache_misses, plan_cache_count);
+    printf("globs: %lu listing hits, %lu scans, %d cached\n", listing_cache_hits, listing_cache_scans,
+           listing_cache_count);
+    printf("output: %llu bytes, %lu ring writes, %lu direct writes, %lu syncs (%s)\n", output_bytes,
+           output_ring_writes, output_direct_writes, output_syncs,
+           shell_output.ring.ring_fd >= 0 ? "io_uring" : "writev");
+    return 0;
+}
+
+// ======== NEW FUNCTIONALITY ======== //
+
+int process_word_counter(int file_count, char **file_list) {
+    if (file_count < 1) { // Validate file count
+        printf("Invalid file count (at least 1 required)\n");
+        return 1;
+    }
+    
+    word_count_file counted_files[file_count];
+    for (int file_counter = 0; file_counter < file_count; file_counter++)
+        counted_files[file_counter].file_name = file_list[file_counter];
+    count_file_words(counted_files, file_count);
+
+    // Column width follows wc: one file prints bare, several are padded to the total size's digits
+    unsigned long long total_words = 0, total_bytes = 0;
+    int exit_status = 0;
+    for (int file_counter = 0; file_counter < file_count; file_counter++)
+        total_bytes += counted_files[file_counter].data_length;
+    int column_width = 1;
+    if (file_count > 1)
+        for (unsigned long long digits = total_bytes; digits >= 10; digits /= 10) column_width++;
+
+    for (int file_counter = 0; file_counter < file_count; file_counter++) {
+        word_count_file *counted = &counted_files[file_counter];
+        if (counted->open_error) {
+            fprintf(stderr, "#: %s: %s\n", counted->file_name, strerror(counted->open_error));
+            exit_status = 1;
+            continue;
+        }
+        total_words += counted->word_count;
+        printf("%*llu %s\n", column_width, counted->word_count, counted->file_name);
+    }
+    if (file_count > 1) printf("%*llu total\n", column_width, total_words);
+    return exit_status;
+}
+
+// ======== WORD COUNTER ENGINE ======== //
+
+// A word starts at every non-space byte whose predecessor is a space (the
+// C locale's isspace set: ' ' and \t through \r). Each kernel counts those
+// starts, given whether the byte just before the buffer was a space.
+static inline int is_word_separator(unsigned char byte) {
+    return byte == ' ' || (byte >= '\t' && byte <= '\r');
+}
+
+unsigned long long count_word_starts_scalar(const unsigned char *data, size_t length, int previous_is_space) {
+    unsigned long long word_starts = 0;
+    for (size_t byte_index = 0; byte_index < length; byte_index++) {
+        int is_space = is_word_separator(data[byte_index]);
+        word_starts += (!is_space) & previous_is_space;
+        previous_is_space = is_space;
+    }
+    return word_starts;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+unsigned long long count_word_starts_sse2(const unsigned char *data, size_t length, int previous_is_space) {
+    const __m128i space_byte = _mm_set1_epi8(' ');
+    const __m128i tab_byte = _mm_set1_epi8('\t');
+    const __m128i control_span = _mm_set1_epi8('\r' - '\t');
+    unsigned long long word_starts = 0;
+    unsigned int carry = previous_is_space;
+    size_t byte_index = 0;
+
+    for (; byte_index + 16 <= length; byte_index += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(data + byte_index));
+        __m128i offset = _mm_sub_epi8(block, tab_byte); // \t..\r map to 0..4, unsigned
+        __m128i is_control = _mm_cmpeq_epi8(_mm_min_epu8(offset, control_span), offset);
+        unsigned int space_mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block, space_byte), is_control));
+        unsigned int preceded_by_space = (space_mask << 1) | carry;
+        word_starts += __builtin_popcount(~space_mask & preceded_by_space & 0xFFFF);
+        carry = (space_mask >> 15) & 1;
+    }
+    return word_starts + count_word_starts_scalar(data + byte_index, length - byte_index, carry);
+}
+
+__attribute__((target("avx2,popcnt")))
+unsigned long long count_word_starts_avx2(const unsigned char *data, size_t length, int previous_is_space) {
+    const __m256i space_byte = _mm256_set1_epi8(' ');
+    const __m256i tab_byte = _mm256_set1_epi8('\t');
+    const __m256i control_span = _mm256_set1_epi8('\r' - '\t');
+    unsigned long long word_starts = 0;
+    unsigned long long carry = previous_is_space;
+    size_t byte_index = 0;
+
+    for (; byte_index + 32 <= length; byte_index += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(data + byte_index));
+        __m256i offset = _mm256_sub_epi8(block, tab_byte);
+        __m256i is_control = _mm256_cmpeq_epi8(_mm256_min_epu8(offset, control_span), offset);
+        unsigned long long space_mask = (unsigned int)_mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(block, space_byte), is_control));
+        unsigned long long preceded_by_space = (space_mask << 1) | carry;
+        word_starts += __builtin_popcountll(~space_mask & preceded_by_space & 0xFFFFFFFFull);
+        carry = (space_mask >> 31) & 1;
+    }
+    return word_starts + count_word_starts_sse2(data + byte_index, length - byte_index, (int)carry);
+}
+#endif
+
+unsigned long long count_word_starts(const unsigned char *data, size_t length, int previous_is_space) {
+#if defined(__x86_64__) || defined(__i386__)
+    static int has_avx2 = -1; // Probed once
+    if (has_avx2 < 0) has_avx2 = __builtin_cpu_supports("avx2");
+    if (has_avx2) return count_word_starts_avx2(data, length, previous_is_space);
+    return count_word_starts_sse2(data, length, previous_is_space);
+#else
+    return count_word_starts_scalar(data, length, previous_is_space);
+#endif
+}
+
+void* word_count_worker(void *queue_argument) {
+    word_count_queue *queue = queue_argument;
+    while (1) {
+        int chunk_index = __atomic_fetch_add(&queue->next_chunk, 1, __ATOMIC_RELAXED);
+        if (chunk_index >= queue->total_chunks) return NULL;
+        word_count_chunk *chunk = &queue->chunks[chunk_index];
+        const unsigned char *chunk_data = chunk->file->mapped_data + chunk->chunk_offset;
+        // A chunk edge splits a word only if the byte before it is not a space
+        int previous_is_space = chunk->chunk_offset == 0 || is_word_separator(chunk_data[-1]);
+        chunk->word_count = count_word_starts(chunk_data, chunk->chunk_length, previous_is_space);
+    }
+}
+
+// Counts words in files that cannot be mapped (pipes, devices) block by block
+int count_unmapped_words(int file_descriptor, word_count_file *counted) {
+    if (!stream_buffer && !(stream_buffer = malloc(STREAM_BUFFER_SIZE))) return ENOMEM;
+    int previous_is_space = 1;
+    while (1) {
+        ssize_t read_bytes = read(file_descriptor, stream_buffer, STREAM_BUFFER_SIZE);
+        if (read_bytes < 0 && errno == EINTR) continue;
+        if (read_bytes < 0) return errno;
+        if (read_bytes == 0) return 0;
+        counted->word_count += count_word_starts((unsigned char *)stream_buffer, read_bytes, previous_is_space);
+        previous_is_space = is_word_separator(stream_buffer[read_bytes - 1]);
+        counted->data_length += read_bytes;
+    }
+}
+
+// Maps every file, splits large ones into chunks and counts all chunks on
+// up to one thread per online CPU. Chunks of one file are summed afterwards.
+int count_file_words(word_count_file *counted_files, int file_count) {
+    int total_chunks = 0;
+    for (int file_counter = 0; file_counter < file_count; file_counter++) {
+        word_count_file *counted = &counted_files[file_counter];
+        counted->mapped_data = NULL;
+        counted->data_length = 0;
+        counted->word_count = 0;
+        counted->open_error = 0;
+
+        int file_descriptor = open(counted->file_name, O_RDONLY | O_CLOEXEC);
+        struct stat file_info;
+        if (file_descriptor < 0 || fstat(file_descriptor, &file_info) < 0) {
+            counted->open_error = errno;
+            if (file_descriptor >= 0) close(file_descriptor);
+            continue;
+        }
+        if (S_ISREG(file_info.st_mode) && file_info.st_size > 0) {
+            void *mapped = mmap(NULL, file_info.st_size, PROT_READ, MAP_PRIVATE, file_descriptor, 0);
+            if (mapped != MAP_FAILED) {
+                madvise(mapped, file_info.st_size, MADV_SEQUENTIAL | MADV_WILLNEED);
+                counted->mapped_data = mapped;
+                counted->data_length = file_info.st_size;
+                total_chunks += (file_info.st_size + WORD_COUNT_CHUNK_SIZE - 1) / WORD_COUNT_CHUNK_SIZE;
+            }
+        }
+        if (!counted->mapped_data && !(S_ISREG(file_info.st_mode) && file_info.st_size == 0))
+            counted->open_error = count_unmapped_words(file_descriptor, counted);
+        close(file_descriptor);
+    }
+
+    word_count_chunk *chunks = malloc((total_chunks + 1) * sizeof(word_count_chunk));
+    if (!chunks) return -1;
+    word_count_queue queue = {chunks, 0, 0};
+    for (int file_counter = 0; file_counter < file_count; file_counter++) {
+        word_count_file *counted = &counted_files[file_counter];
+        if (!counted->mapped_data) continue;
+        for (size_t chunk_offset = 0; chunk_offset < counted->data_length; chunk_offset += WORD_COUNT_CHUNK_SIZE) {
+            size_t chunk_length = counted->data_length - chunk_offset;
+            if (chunk_length > WORD_COUNT_CHUNK_SIZE) chunk_length = WORD_COUNT_CHUNK_SIZE;
+            chunks[queue.total_chunks++] = (word_count_chunk){counted, chunk_offset, chunk_length, 0};
+        }
+    }
+
+    long online_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int helper_count = (online_cpus > 1 ? online_cpus : 1) - 1; // The calling thread works too
+    if (helper_count > queue.total_chunks - 1) helper_count = queue.total_chunks - 1;
+    if (helper_count < 0) helper_count = 0;
+    pthread_t helpers[helper_count + 1];
+    int started_helpers = 0;
+    for (; started_helpers < helper_count; started_helpers++)
+        if (pthread_create(&helpers[started_helpers], NULL, word_count_worker, &queue) != 0) break;
+    word_count_worker(&queue);
+    for (int helper_index = 0; helper_index < started_helpers; helper_index++)
+        pthread_join(helpers[helper_index], NULL);
+
+    for (int chunk_index = 0; chunk_index < queue.total_chunks; chunk_index++)
+        chunks[chunk_index].file->word_count += chunks[chunk_index].word_count;
+    for (int file_counter = 0; file_counter < file_count; file_counter++)
+        if (counted_files[file_counter].mapped_data)
+            munmap((void *)counted_files[file_counter].mapped_data, counted_files[file_counter].data_length);
+    free(chunks);
+    return 0;
+}
+
+int process_file_concatenation(int file_count, char **file_list) {
+    if (file_count < 2) { // Validate file count
+        printf("Invalid file count (at least 2 required)\n");
+        return 1;
+    }
+    
+    int exit_status = 0;
+    flush_shell_output(); // Shell output written so far goes first
+    int next_fd = open(file_list[0], O_RDONLY | O_CLOEXEC);
+    int next_error = errno;
+    for (int file_counter = 0; file_counter < file_count; file_counter++) {
+        int current_fd = next_fd, open_error = next_error;
+        next_fd = -1;
+        if (file_counter + 1 < file_count) { // Start reading the next file while this one streams
+            next_fd = open(file_list[file_counter + 1], O_RDONLY | O_CLOEXEC);
+            next_error = errno;
+            if (next_fd >= 0) posix_fadvise(next_fd, 0, 0, POSIX_FADV_WILLNEED);
+        }
+        if (current_fd < 0) {
+            fprintf(stderr, "++: %s: %s\n", file_list[file_counter], strerror(open_error));
+            exit_status = 1;
+            continue;
+        }
+        posix_fadvise(current_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        if (stream_file_to_output(current_fd, file_list[file_counter], STDOUT_FILENO, "++") < 0) exit_status = 1;
+        close(current_fd);
+    }
+    return exit_status;
+}
+
+// Streams source_fd to output_fd until end of input. Whenever either side
+// is a pipe the data moves with splice, a regular file output is fed with
+// sendfile, so the data stays in the kernel; anything else (a terminal, a
+// socket) gets large writes from one reusable buffer.
+int stream_file_to_output(int source_fd, const char *file_name, int output_fd, const char *error_prefix) {
+    struct stat output_info, source_info;
+    int use_splice = 0, use_sendfile = 0;
+    if (fstat(output_fd, &output_info) == 0) {
+        use_splice = S_ISFIFO(output_info.st_mode);
+        use_sendfile = S_ISREG(output_info.st_mode);
+    }
+    if (!use_splice && fstat(source_fd, &source_info) == 0) use_splice = S_ISFIFO(source_info.st_mode);
+
+    while (1) {
+        ssize_t moved_bytes;
+        if (use_splice) {
+            moved_bytes = splice(source_fd, NULL, output_fd, NULL, STREAM_BUFFER_SIZE,
+                                 SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (moved_bytes < 0 && errno == EINVAL) { // The other side cannot be spliced
+                use_splice = 0;
+                continue;
+            }
+        } else if (use_sendfile) {
+            moved_bytes = sendfile(output_fd, source_fd, NULL, STREAM_BUFFER_SIZE);
+            if (moved_bytes < 0 && (errno == EINVAL || errno == ENOSYS)) { // e.g. O_APPEND output
+                use_sendfile = 0;
+                continue;
+            }
+        } else {
+            if (!stream_buffer && !(stream_buffer = malloc(STREAM_BUFFER_SIZE))) return -1;
+            moved_bytes = read(source_fd, stream_buffer, STREAM_BUFFER_SIZE);
+            for (ssize_t written_total = 0; moved_bytes > 0 && written_total < moved_bytes; ) {
+                ssize_t written_bytes = write(output_fd, stream_buffer + written_total,
+                                              moved_bytes - written_total);
+                if (written_bytes < 0 && errno == EINTR) continue;
+                if (written_bytes < 0) {
+                    moved_bytes = -1;
+                    break;
+                }
+                written_total += written_bytes;
+            }
+        }
+        if (moved_bytes < 0 && errno == EINTR) continue;
+        if (moved_bytes < 0) {
+            fprintf(stderr, "%s: %s: %s\n", error_prefix, file_name, strerror(errno));
+            return -1;
+        }
+        if (moved_bytes == 0) return 0; // End of file
+    }
+}
+
+int process_mutual_file_append(const char *first_file, const char *second_file) {
+    const char *file_list[2] = {first_file, second_file};
+
+    int first_fd = open(file_list[0], O_RDWR | O_CLOEXEC); // Both files are read and appended
+    if (first_fd < 0) {
+        perror("Open failed");
+        return 1;
+    }
+    int second_fd = open(file_list[1], O_RDWR | O_CLOEXEC);
+    if (second_fd < 0) {
+        perror("Open failed");
+        close(first_fd);
+        return 1;
+    }
+
+    // Snapshot sizes up front so each direction copies exactly its intended range
+    struct stat first_info, second_info;
+    fstat(first_fd, &first_info);
+    fstat(second_fd, &second_info);
+    if (first_info.st_dev == second_info.st_dev && first_info.st_ino == second_info.st_ino) {
+        printf("Cannot mutually append a file to itself\n");
+        close(first_fd);
+        close(second_fd);
+        return 1;
+    }
+    off_t first_size = first_info.st_size;
+    off_t second_size = second_info.st_size;
+
+    struct timespec start_time, end_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    // Step 1: Append file2 to file1
+    long long first_copied = copy_file_region(second_fd, 0, first_fd, first_size, second_size);
+    // Step 2: Append updated file1 (original file1 + file2) to file2
+    long long second_copied = (first_copied == second_size)
+        ? copy_file_region(first_fd, 0, second_fd, second_size, first_size + second_size) : -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    close(first_fd);
+    close(second_fd);
+    if (first_copied < 0 || second_copied < 0) {
+        perror("Copy failed");
+        return 1;
+    }
+
+    double elapsed_seconds = (end_time.tv_sec - start_time.tv_sec) +
+                             (end_time.tv_nsec - start_time.tv_nsec) / 1e9;
+    long long moved_bytes = first_copied + second_copied;
+    printf("Mutually appended %s and %s (%lld bytes in %.3f s, %.1f MB/s)\n",
+           file_list[0], file_list[1], moved_bytes, elapsed_seconds,
+           elapsed_seconds > 0 ? moved_bytes / elapsed_seconds / (1024 * 1024) : 0.0);
+    return 0;
+}
+
+// Copies length bytes starting at source_offset into destination at
+// destination_offset without passing the data through user space where the
+// kernel allows it: copy_file_range first (reflinks on supporting
+// filesystems), then sendfile, then a plain pread/pwrite loop.
+long long copy_file_region(int source_fd, off_t source_offset, int destination_fd,
+                           off_t destination_offset, off_t length) {
+    off_t remaining = length;
+    int use_copy_range = 1, use_sendfile = 1;
+
+    while (remaining > 0) {
+        ssize_t copied_bytes = -1;
+        if (use_copy_range) {
+            copied_bytes = copy_file_range(source_fd, &source_offset, destination_fd,
+                                           &destination_offset, remaining, 0);
+            if (copied_bytes < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+                                     errno == EOPNOTSUPP || errno == EBADF)) {
+                use_copy_range = 0; // Filesystem cannot do it; fall back to sendfile
+                continue;
+            }
+        } else if (use_sendfile) {
+            if (lseek(destination_fd, destination_offset, SEEK_SET) < 0) return -1;
+            copied_bytes = sendfile(destination_fd, source_fd, &source_offset, remaining);
+            if (copied_bytes < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                use_sendfile = 0; // Last resort is copying through a buffer
+                continue;
+            }
+            if (copied_bytes > 0) destination_offset += copied_bytes;
+        } else {
+            char data_buffer[64 * 1024]; // Buffer for file content transfer
+            size_t chunk = remaining < (off_t)sizeof(data_buffer) ? (size_t)remaining : sizeof(data_buffer);
+            copied_bytes = pread(source_fd, data_buffer, chunk, source_offset);
+            if (copied_bytes > 0) {
+                ssize_t written_bytes = pwrite(destination_fd, data_buffer, copied_bytes, destination_offset);
+                if (written_bytes < 0) return -1;
+                copied_bytes = written_bytes;
+                source_offset += copied_bytes;
+                destination_offset += copied_bytes;
+            }
+        }
+        if (copied_bytes < 0 && errno == EINTR) continue;
+        if (copied_bytes < 0) return -1;
+        if (copied_bytes == 0) break; // Source shrank underneath us
+        remaining -= copied_bytes;
+    }
+    return length - remaining;
+}
+
+// ======== FAN-OUT PUMP ======== //
+
+// Moves exactly length bytes between two pipes with splice
+int splice_exactly(int source_fd, int destination_fd, size_t length) {
+    while (length > 0) {
+        ssize_t moved_bytes = splice(source_fd, NULL, destination_fd, NULL, length, SPLICE_F_MOVE);
+        if (moved_bytes < 0 && errno == EINTR) continue;
+        if (moved_bytes <= 0) return -1;
+        length -= moved_bytes;
+    }
+    return 0;
+}
+
+// One hop of the fan-out chain. source_fd holds exactly length bytes: they
+// are duplicated into the consumer with tee and then spliced on to the
+// next hop (forward_fd), or, on the last hop, spliced into the consumer.
+// tee is always asked for everything left in source_fd, so it stops on
+// buffer boundaries and the next hop never needs more pipe slots than
+// this one. A consumer that has exited is closed and skipped.
+int fan_out_hop(int source_fd, int *consumer_fd, int forward_fd, int discard_fd, size_t length) {
+    while (length > 0) {
+        ssize_t moved_bytes;
+        if (forward_fd < 0) {
+            moved_bytes = splice(source_fd, NULL, *consumer_fd >= 0 ? *consumer_fd : discard_fd, NULL,
+                                 length, SPLICE_F_MOVE);
+        } else if (*consumer_fd >= 0) {
+            moved_bytes = tee(source_fd, *consumer_fd, length, 0);
+            if (moved_bytes > 0 && splice_exactly(source_fd, forward_fd, moved_bytes) < 0) return -1;
+        } else {
+            moved_bytes = splice(source_fd, NULL, forward_fd, NULL, length, SPLICE_F_MOVE);
+        }
+        if (moved_bytes < 0 && errno == EINTR) continue;
+        if (moved_bytes < 0 && errno == EPIPE && *consumer_fd >= 0) { // Consumer quit early
+            close(*consumer_fd);
+            *consumer_fd = -1;
+            continue;
+        }
+        if (moved_bytes <= 0) return -1;
+        length -= moved_bytes;
+    }
+    return 0;
+}
+
+// Body of the '|&' pump process: copies everything the producer writes to
+// source_fd into every consumer pipe without the data passing through
+// user space. Each chunk is spliced into a private pipe and handed down a
+// chain of hop pipes, one per live consumer. A chunk must reach every
+// consumer before the next one is taken, so the slowest consumer sets the
+// pace and a full consumer pipe stalls the producer (backpressure).
+int run_fan_out_pump(int source_fd, int *consumer_fds, int consumer_count) {
+    signal(SIGPIPE, SIG_IGN); // A consumer that exits shows up as EPIPE
+    int hop_pipes[consumer_count][2];
+    int discard_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    int source_size = fcntl(source_fd, F_GETPIPE_SZ), chunk_limit = INT_MAX;
+    for (int hop_index = 0; hop_index < consumer_count; hop_index++) {
+        if (pipe2(hop_pipes[hop_index], O_CLOEXEC) < 0) {
+            perror("Pipe failed");
+            return 1;
+        }
+        if (source_size > 0) fcntl(hop_pipes[hop_index][1], F_SETPIPE_SZ, source_size);
+        int hop_size = fcntl(hop_pipes[hop_index][1], F_GETPIPE_SZ);
+        if (hop_size > 0 && hop_size < chunk_limit) chunk_limit = hop_size;
+    }
+    // The first hop must not hold more buffers than any later one
+    if (fcntl(hop_pipes[0][1], F_GETPIPE_SZ) > chunk_limit) fcntl(hop_pipes[0][1], F_SETPIPE_SZ, chunk_limit);
+
+    int exit_status = 0;
+    while (1) {
+        int last_live = -1;
+        for (int consumer_index = 0; consumer_index < consumer_count; consumer_index++)
+            if (consumer_fds[consumer_index] >= 0) last_live = consumer_index;
+        if (last_live < 0) break; // Nobody is reading any more: let the producer see EPIPE
+
+        ssize_t chunk_length = splice(source_fd, NULL, hop_pipes[0][1], NULL, chunk_limit, SPLICE_F_MOVE);
+        if (chunk_length < 0 && errno == EINTR) continue;
+        if (chunk_length <= 0) { // End of the producer's output (or a broken source)
+            if (chunk_length < 0) exit_status = 1;
+            break;
+        }
+
+        int hop_index = 0;
+        for (int consumer_index = 0; consumer_index <= last_live && !exit_status; consumer_index++) {
+            if (consumer_fds[consumer_index] < 0) continue;
+            int forward_fd = (consumer_index == last_live) ? -1 : hop_pipes[hop_index + 1][1];
+            if (fan_out_hop(hop_pipes[hop_index][0], &consumer_fds[consumer_index], forward_fd, discard_fd,
+                            chunk_length) < 0) {
+                perror("|&");
+                exit_status = 1;
+            }
+            hop_index++;
+        }
+        if (exit_status) break;
+    }
+    for (int consumer_index = 0; consumer_index < consumer_count; consumer_index++)
+        if (consumer_fds[consumer_index] >= 0) close(consumer_fds[consumer_index]);
+    return exit_status;
+}
+
+// ======== JOB CONTROL ======== //
+
+void add_job(pid_t process_id, const char *command_text) {
+    if (job_count == job_capacity) { // Grow the job table
+        int new_capacity = job_capacity ? job_capacity * 2 : 16;
+        background_job *grown_table = realloc(job_table, new_capacity * sizeof(background_job));
+        if (!grown_table) {
+            perror("Job table");
+            return;
+        }
+        job_table = grown_table;
+        job_capacity = new_capacity;
+    }
+    background_job *job = &job_table[job_count++];
+    job->job_number = (job_count > 1) ? job_table[job_count - 2].job_number + 1 : 1;
+    job->process_id = process_id;
+    job->command_text = strdup(command_text);
+    job->state = JOB_RUNNING;
+    job->exit_status = 0;
+    printf("[%d] Started background process %d: %s\n", job->job_number, process_id, job->command_text);
+}
+
+// Starts the body of a '&' node in its own process group. A plain external
+// command is spawned directly; anything else (pipelines, && chains,
+// operators) runs in a forked copy of the shell that leads the group.
+int start_background_job(memory_arena *arena, syntax_node *background) {
+    syntax_node *body = background->left;
+    stage_wiring wiring = {-1, -1, -1, 0, 1, 0};
+    int finished_status = 0;
+    pid_t process_id;
+
+    if (body->type == NODE_COMMAND) {
+        process_id = start_command(arena, body, wiring, &finished_status);
+    } else {
+        process_id = fork_shell_child(&wiring);
+        if (process_id == 0) {
+            resource_policy policy = {0};
+            add_background_policy(&policy); // Everything the job's shell starts inherits it
+            const char *failed_setting = apply_resource_policy(&policy);
+            if (failed_setting) {
+                fprintf(stderr, "mbash25: %s: %s\n", failed_setting, strerror(errno));
+                _exit(125);
+            }
+            int exit_status = execute_node(arena, body);
+            exit_shell_child(exit_status);
+        }
+    }
+    if (process_id <= 0) return finished_status ? finished_status : 1;
+    add_job(process_id, background->source_text);
+    last_background_id = process_id;
+    return 0;
+}
+
+// SIGCHLD is blocked and read through a signalfd, so the shell learns that
+// some child changed state without a handler interrupting its syscalls.
+// Job statuses are collected with targeted waitpid calls: a foreground wait
+// can never swallow a background job's status and vice versa.
+void init_job_control(int interactive) {
+    sigset_t child_signals;
+    sigemptyset(&child_signals);
+    sigaddset(&child_signals, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &child_signals, NULL);
+    child_signal_fd = signalfd(-1, &child_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    shell_is_interactive = interactive;
+    if (interactive) signal(SIGTTOU, SIG_IGN); // Needed to take the terminal back after fg
+}
+
+int record_job_status(background_job *job, int process_status) {
+    if (WIFSTOPPED(process_status)) {
+        job->state = JOB_STOPPED;
+    } else if (WIFCONTINUED(process_status)) {
+        job->state = JOB_RUNNING;
+    } else {
+        job->state = JOB_DONE;
+        job->exit_status = WIFEXITED(process_status) ? WEXITSTATUS(process_status)
+                                                    : 128 + WTERMSIG(process_status);
+        if (trace_enabled) trace_record(TRACE_REAP, job->process_id, job->exit_status, NULL, 0);
+    }
+    return job->state;
+}
+
+void remove_job(int job_index) {
+    free(job_table[job_index].command_text);
+    memmove(&job_table[job_index], &job_table[job_index + 1],
+            (job_count - job_index - 1) * sizeof(background_job));
+    job_count--;
+}
+
+const char* job_state_name(const background_job *job) {
+    if (job->state == JOB_RUNNING) return "Running";
+    if (job->state == JOB_STOPPED) return "Stopped";
+    return job->exit_status == 0 ? "Done" : "Exit";
+}
+
+void print_job(const background_job *job) {
+    char marker = (job == &job_table[job_count - 1]) ? '+' : ' '; // Current job, as in bash
+    if (job->state == JOB_DONE && job->exit_status != 0)
+        printf("[%d]%c  Exit %-19d %s\n", job->job_number, marker, job->exit_status, job->command_text);
+    else
+        printf("[%d]%c  %-24s%s\n", job->job_number, marker, job_state_name(job), job->command_text);
+}
+
+// Refreshes job states. Nothing is scanned unless the signalfd says a
+// SIGCHLD arrived since the last call (or the parallel scheduler drained one).
+void update_job_states() {
+    struct signalfd_siginfo signal_info;
+    int child_changed = child_state_pending;
+    while (read(child_signal_fd, &signal_info, sizeof(signal_info)) == sizeof(signal_info))
+        child_changed = 1; // SIGCHLDs coalesce, so any one means "scan the table"
+    if (!child_changed) return;
+    child_state_pending = 0;
+
+    for (int job_index = 0; job_index < job_count; job_index++) {
+        background_job *job = &job_table[job_index];
+        int process_status;
+        if (job->state != JOB_DONE &&
+            waitpid(job->process_id, &process_status, WNOHANG | WUNTRACED | WCONTINUED) > 0)
+            record_job_status(job, process_status);
+    }
+}
+
+// Collects finished background jobs so they never linger as zombies. Done
+// jobs leave the table after being reported (interactive shells) or
+// silently (scripts).
+void reap_background_jobs(int report_done) {
+    update_job_states();
+    for (int job_index = 0; job_index < job_count; ) {
+        if (job_table[job_index].state != JOB_DONE) {
+            job_index++;
+            continue;
+        }
+        if (report_done) print_job(&job_table[job_index]);
+        remove_job(job_index);
+    }
+}
+
+// Resolves "%n", "%%", "%+", a PID or nothing (the current job) to a table index
+int find_job(const char *job_spec) {
+    if (job_count == 0) return -1;
+    if (!job_spec || strcmp(job_spec, "%%") == 0 || strcmp(job_spec, "%+") == 0) return job_count - 1;
+    int by_number = (job_spec[0] == '%');
+    long wanted = strtol(job_spec + by_number, NULL, 10);
+    for (int job_index = 0; job_index < job_count; job_index++) {
+        if (by_number ? job_table[job_index].job_number == wanted
+                      : job_table[job_index].process_id == wanted)
+            return job_index;
+    }
+    return -1;
+}
+
+// Waits for a job in the foreground, handing it the terminal when the
+// shell owns one. Returns the job's exit status, or -1 if it stopped again.
+int wait_for_job(int job_index, int give_terminal) {
+    background_job *job = &job_table[job_index];
+    if (give_terminal) tcsetpgrp(STDIN_FILENO, job->process_id);
+    if (job->state == JOB_STOPPED) kill(-job->process_id, SIGCONT);
+    job->state = JOB_RUNNING;
+
+    int process_status;
+    while (job->state == JOB_RUNNING) {
+        if (waitpid(job->process_id, &process_status, give_terminal ? WUNTRACED : 0) < 0) {
+            if (errno == EINTR) continue;
+            job->state = JOB_DONE; // Already collected elsewhere
+            break;
+        }
+        record_job_status(job, process_status);
+    }
+    if (give_terminal) tcsetpgrp(STDIN_FILENO, getpgrp()); // Take the terminal back
+
+    if (job->state == JOB_STOPPED) {
+        printf("\n");
+        print_job(job);
+        return -1;
+    }
+    int exit_status = job->exit_status;
+    remove_job(job_index);
+    return exit_status;
+}
+
+int builtin_jobs(int argument_count, char **arguments) {
+    (void)argument_count, (void)arguments;
+    update_job_states();
+    for (int job_index = 0; job_index < job_count; job_index++) // List every tracked job
+        print_job(&job_table[job_index]);
+    reap_background_jobs(0); // Done jobs have now been reported
+    return 0;
+}
+
+// fg and bg share the job lookup; fg waits, bg resumes in the background
+int resume_job(int argument_count, char **arguments, int in_foreground) {
+    update_job_states();
+    int job_index = find_job(argument_count > 1 ? arguments[1] : NULL);
+    if (job_index < 0) {
+        fprintf(stderr, "%s: %s: no such job\n", arguments[0], argument_count > 1 ? arguments[1] : "current");
+        return 1;
+    }
+    background_job *job = &job_table[job_index];
+    if (!in_foreground) { // bg: resume a stopped job where it is
+        if (job->state == JOB_STOPPED) kill(-job->process_id, SIGCONT);
+        job->state = JOB_RUNNING;
+        printf("[%d]+ %s &\n", job->job_number, job->command_text);
+        return 0;
+    }
+    printf("%s\n", job->command_text); // fg: bring it to the foreground
+    flush_shell_output();
+    int exit_status = wait_for_job(job_index, shell_is_interactive);
+    return exit_status < 0 ? 148 : exit_status; // 128 + SIGTSTP when it stopped again
+}
+
+int builtin_fg(int argument_count, char **arguments) {
+    return resume_job(argument_count, arguments, 1);
+}
+
+int builtin_bg(int argument_count, char **arguments) {
+    return resume_job(argument_count, arguments, 0);
+}
+
+// wait [job...]: with no operands, wait for every background job
+int builtin_wait(int argument_count, char **arguments) {
+    int exit_status = 0;
+    update_job_states();
+    if (argument_count == 1) {
+        while (job_count > 0) wait_for_job(0, 0);
+        return 0;
+    }
+    for (int argument_index = 1; argument_index < argument_count; argument_index++) {
+        int job_index = find_job(arguments[argument_index]);
+        if (job_index < 0) {
+            fprintf(stderr, "wait: %s: no such job\n", arguments[argument_index]);
+            exit_status = 127;
+        } else {
+            exit_status = wait_for_job(job_index, 0);
+        }
+    }
+    return exit_status;
+}
+
+// ======== PARALLEL SCHEDULER ======== //
+
+// Number of jobs ':::' and parallel run at once: a positive count, OPTION_AUTO
+// for one per online CPU, or OPTION_MAX for no limit
+int parallel_job_limit(long requested_limit, int command_count) {
+    if (requested_limit == OPTION_AUTO) {
+        long online_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        requested_limit = (online_cpus > 0) ? online_cpus : 1;
+    }
+    if (requested_limit == OPTION_MAX || requested_limit > command_count) requested_limit = command_count;
+    return requested_limit > 0 ? (int)requested_limit : 1;
+}
+
+// Starts one job in a forked shell with stdout and stderr captured in
+// memfds, so its output can be written out in one piece when it ends
+int start_parallel_job(memory_arena *arena, parallel_job *job, int null_input_fd) {
+    job->output_fd = memfd_create("mbash25-parallel-out", MFD_CLOEXEC);
+    job->error_fd = memfd_create("mbash25-parallel-err", MFD_CLOEXEC);
+    stage_wiring wiring = {null_input_fd, job->output_fd, -1, -1, 1, 0};
+    job->process_id = fork_shell_child(&wiring);
+    if (job->process_id == 0) {
+        if (job->error_fd >= 0) dup2(job->error_fd, STDERR_FILENO);
+        check_output_target();
+        int exit_status = execute_node(arena, job->command_tree);
+        exit_shell_child(exit_status);
+    }
+    return job->process_id > 0 ? 0 : -1;
+}
+
+// Writes a finished job's captured output to the shell's stdout and stderr
+void flush_parallel_job(parallel_job *job) {
+    flush_shell_output();
+    if (job->output_fd >= 0) {
+        lseek(job->output_fd, 0, SEEK_SET);
+        stream_file_to_output(job->output_fd, "job output", STDOUT_FILENO, "parallel");
+        close(job->output_fd);
+    }
+    if (job->error_fd >= 0) {
+        lseek(job->error_fd, 0, SEEK_SET);
+        stream_file_to_output(job->error_fd, "job output", STDERR_FILENO, "parallel");
+        close(job->error_fd);
+    }
+    job->output_fd = job->error_fd = -1;
+}
+
+// Blocks until one of the running jobs exits and returns its index. The
+// SIGCHLD signalfd wakes the scheduler; each running job is then checked
+// with a targeted waitpid so background jobs are never reaped here.
+int wait_for_parallel_job(parallel_job *jobs, int job_count, int *exit_status) {
+    while (1) {
+        int first_running = -1;
+        for (int job_index = 0; job_index < job_count; job_index++) {
+            if (jobs[job_index].process_id <= 0) continue;
+            if (first_running < 0) first_running = job_index;
+            int process_status;
+            if (waitpid(jobs[job_index].process_id, &process_status, WNOHANG) > 0) {
+                *exit_status = WIFEXITED(process_status) ? WEXITSTATUS(process_status)
+                                                         : 128 + WTERMSIG(process_status);
+                if (trace_enabled) trace_record(TRACE_REAP, jobs[job_index].process_id, *exit_status, NULL, 0);
+                return job_index;
+            }
+        }
+        if (first_running < 0) return -1;
+        if (child_signal_fd < 0) { // No signalfd: wait on the oldest job
+            *exit_status = wait_for_command(jobs[first_running].process_id);
+            return first_running;
+        }
+
+        struct pollfd signal_poll = {child_signal_fd, POLLIN, 0};
+        if (poll(&signal_poll, 1, -1) < 0 && errno != EINTR) return -1;
+        struct signalfd_siginfo signal_info;
+        while (read(child_signal_fd, &signal_info, sizeof(signal_info)) == sizeof(signal_info))
+            child_state_pending = 1; // The targeted waitpid calls above find what changed; '&' jobs scan later
+    }
+}
+
+// Runs every command with at most job_limit running at once. Each job's
+// output appears as a block when the job ends (completion order). Like GNU
+// parallel, the status is the number of failed jobs, capped at 101.
+int run_parallel_jobs(memory_arena *arena, syntax_node **commands, int command_count, int job_limit) {
+    if (command_count == 0) return 0;
+    parallel_job *jobs = arena_zalloc(arena, command_count * sizeof(parallel_job));
+    int null_input_fd = open("/dev/null", O_RDONLY | O_CLOEXEC); // Jobs must not share the shell's stdin
+    int next_job = 0, running_count = 0, failed_count = 0;
+
+    while (next_job < command_count || running_count > 0) {
+        while (running_count < job_limit && next_job < command_count) {
+            parallel_job *job = &jobs[next_job];
+            job->command_tree = commands[next_job++];
+            if (start_parallel_job(arena, job, null_input_fd) < 0) {
+                flush_parallel_job(job);
+                failed_count++;
+                continue;
+            }
+            running_count++;
+        }
+
+        int exit_status;
+        int finished_index = wait_for_parallel_job(jobs, next_job, &exit_status);
+        if (finished_index < 0) break;
+        jobs[finished_index].process_id = 0;
+        running_count--;
+        flush_parallel_job(&jobs[finished_index]);
+        if (exit_status != 0) failed_count++;
+    }
+    if (null_input_fd >= 0) close(null_input_fd);
+    return failed_count > 101 ? 101 : failed_count;
+}
+
+// parallel [-j N] [file...]: runs the command lines read from the files (or
+// stdin) concurrently, N at a time (default: one per online CPU, 0: all)
+int builtin_parallel(int argument_count, char **arguments) {
+    long requested_limit = OPTION_AUTO;
+    int argument_index = 1;
+    for (; argument_index < argument_count && arguments[argument_index][0] == '-'; argument_index++) {
+        const char *limit_text = NULL;
+        if (strcmp(arguments[argument_index], "--") == 0) {
+            argument_index++;
+            break;
+        } else if (strcmp(arguments[argument_index], "-j") == 0 && argument_index + 1 < argument_count) {
+            limit_text = arguments[++argument_index];
+        } else if (strncmp(arguments[argument_index], "-j", 2) == 0 && arguments[argument_index][2]) {
+            limit_text = arguments[argument_index] + 2;
+        }
+        char *number_end;
+        if (!limit_text || (requested_limit = strtol(limit_text, &number_end, 10)) < 0 || *number_end ||
+            number_end == limit_text) {
+            fprintf(stderr, "parallel: usage: parallel [-j jobs] [file...]\n");
+            return 2;
+        }
+        if (requested_limit == 0) requested_limit = OPTION_MAX;
+    }
+
+    memory_arena job_arena = {NULL}; // Holds every command's AST until all jobs are done
+    syntax_node **commands = NULL;
+    int command_count = 0, command_capacity = 0, exit_status = 0;
+    for (int file_index = argument_index; file_index < argument_count || file_index == argument_index;
+         file_index++) {
+        int input_fd = STDIN_FILENO;
+        if (file_index < argument_count && (input_fd = open(arguments[file_index], O_RDONLY | O_CLOEXEC)) < 0) {
+            fprintf(stderr, "parallel: %s: %s\n", arguments[file_index], strerror(errno));
+            exit_status = 1;
+            continue;
+        }
+        input_reader reader;
+        if (open_input_reader(&reader, input_fd, 0) == 0) {
+            char *line;
+            while ((line = get_user_command(&reader)) != NULL) {
+                int parse_failed;
+                syntax_node *command_tree = parse_command_line(&job_arena, line, &parse_failed);
+                if (parse_failed == PARSE_INCOMPLETE) report_incomplete_command(); // Jobs are one line each
+                if (parse_failed) exit_status = 1;
+                if (!command_tree) continue;
+                commands = (syntax_node **)append_to_array(&job_arena, (void **)commands, command_count++,
+                                                           &command_capacity, command_tree);
+            }
+            close_input_reader(&reader);
+        }
+        if (input_fd != STDIN_FILENO) close(input_fd);
+    }
+
+    int failed_jobs = run_parallel_jobs(&job_arena, commands, command_count,
+                                        parallel_job_limit(requested_limit, command_count));
+    arena_reset(&job_arena);
+    free(job_arena.current_block);
+    return failed_jobs ? failed_jobs : exit_status;
+}
+
+// ======== COMMAND CACHE ======== //
+
+// Feeds bytes into both halves of a 128-bit cache key. The low half is
+// plain FNV-1a; the high half starts from another basis and folds its
+// high bits back in, so the two halves do not collide together.
+void hash_cache_bytes(cache_key *key, const void *data, size_t length) {
+    const unsigned char *bytes = data;
+    for (size_t byte_index = 0; byte_index < length; byte_index++) {
+        key->low = (key->low ^ bytes[byte_index]) * 0x100000001b3ULL;
+        key->high = (key->high ^ bytes[byte_index]) * 0x100000001b3ULL;
+        key->high ^= key->high >> 29;
+    }
+}
+
+void hash_cache_string(cache_key *key, const char *text) {
+    hash_cache_bytes(key, text, strlen(text) + 1); // The terminator keeps "ab","c" apart from "a","bc"
+}
+
+// Adds a file's identity and version to the key: path, device, inode, size
+// and modification time. A missing file hashes as missing.
+void hash_cache_file(cache_key *key, const char *file_name) {
+    struct stat file_info;
+    hash_cache_string(key, file_name);
+    if (stat(file_name, &file_info) < 0) {
+        hash_cache_string(key, "(missing)");
+        return;
+    }
+    long long fingerprint[6] = {(long long)file_info.st_dev, (long long)file_info.st_ino,
+                                (long long)file_info.st_size, (long long)file_info.st_mtim.tv_sec,
+                                (long long)file_info.st_mtim.tv_nsec, (long long)file_info.st_mode};
+    hash_cache_bytes(key, fingerprint, sizeof(fingerprint));
+}
+
+// Fingerprints the shell's own stdin for a command that reads it. Only a
+// regular file (identity, size, mtime and read offset) or /dev/null can
+// be keyed; a pipe or terminal gives different input on every run.
+int hash_cache_input(cache_key *key) {
+    struct stat input_info, null_info;
+    if (fstat(STDIN_FILENO, &input_info) < 0) return -1;
+    if (S_ISCHR(input_info.st_mode) && stat("/dev/null", &null_info) == 0 && input_info.st_rdev == null_info.st_rdev) {
+        hash_cache_string(key, "(null input)");
+        return 0;
+    }
+    if (!S_ISREG(input_info.st_mode)) return -1;
+    long long fingerprint[6] = {(long long)input_info.st_dev, (long long)input_info.st_ino,
+                                (long long)input_info.st_size, (long long)input_info.st_mtim.tv_sec,
+                                (long long)input_info.st_mtim.tv_nsec, (long long)lseek(STDIN_FILENO, 0, SEEK_CUR)};
+    hash_cache_bytes(key, fingerprint, sizeof(fingerprint));
+    return 0;
+}
+
+int compare_environment_entries(const void *first, const void *second) {
+    return strcmp(*(char * const *)first, *(char * const *)second);
+}
+
+// Adds the exported variables to the key, sorted so the order a session
+// happened to export them in does not matter
+void hash_cache_environment(cache_key *key, memory_arena *arena) {
+    char **entries = arena_alloc(arena, (environment_count + 1) * sizeof(char *));
+    memcpy(entries, shell_environment, environment_count * sizeof(char *));
+    qsort(entries, environment_count, sizeof(char *), compare_environment_entries);
+    for (int entry_index = 0; entry_index < environment_count; entry_index++)
+        hash_cache_string(key, entries[entry_index]);
+    hash_cache_string(key, "(environment end)");
+}
+
+// Builtins whose only effect is their output, so replaying it is enough
+int builtin_is_output_only(builtin_handler builtin) {
+    return builtin == builtin_echo || builtin == builtin_pwd || builtin == builtin_true ||
+           builtin == builtin_false || builtin == builtin_test;
+}
+
+// Hashes the parsed command tree. Operands of '#', '++' and '+', '<'
+// sources, plain arguments that name regular files, the program binary
+// itself and (for commands reading the shell's stdin, as reads_input
+// marks) stdin are fingerprinted, so editing any input changes the key.
+// Returns -1 for trees whose effects a replay cannot reproduce ('>', '+',
+// '&', loops, '$(...)', assignments and builtins that change the shell)
+// or whose input cannot be keyed (stdin from a pipe or terminal).
+int hash_cache_node(cache_key *key, memory_arena *arena, syntax_node *node, int reads_input) {
+    int node_shape[2] = {node->type, node->kind};
+    hash_cache_bytes(key, node_shape, sizeof(node_shape));
+    if (node->type == NODE_BACKGROUND || node->kind == COMMAND_MUTUAL_APPEND) return -1;
+    if (node->type == NODE_FOR || node->type == NODE_WHILE || node->type == NODE_REPEAT) return -1;
+    if (node->type != NODE_COMMAND) { // Only a pipeline's first stage and a '|&' producer see stdin
+        if (node->left && hash_cache_node(key, arena, node->left, reads_input) < 0) return -1;
+        if (node->right && hash_cache_node(key, arena, node->right, reads_input) < 0) return -1;
+        for (int stage_index = 0; stage_index < node->stage_count; stage_index++)
+            if (hash_cache_node(key, arena, node->stages[stage_index],
+                                reads_input && node->type == NODE_PIPELINE && stage_index == 0) < 0) return -1;
+        return 0;
+    }
+
+    for (int word_index = 0; word_index < node->word_count; word_index++)
+        if (strstr(node->words[word_index], "$(")) return -1; // Would run the substitution just to hash it
+    int argument_count;
+    char **arguments = expand_arguments(arena, node, &argument_count);
+    for (int argument_index = 0; argument_index < argument_count; argument_index++) {
+        struct stat file_info;
+        hash_cache_string(key, arguments[argument_index]);
+        if (node->kind != COMMAND_SIMPLE ||
+            (argument_index > 0 && stat(arguments[argument_index], &file_info) == 0 && S_ISREG(file_info.st_mode)))
+            hash_cache_file(key, arguments[argument_index]);
+    }
+    if (node->kind == COMMAND_SIMPLE && argument_count > 0) {
+        builtin_handler builtin = find_builtin(arguments[0]);
+        if (is_assignment_word(arguments[0]) || (builtin && !builtin_is_output_only(builtin))) return -1;
+        const char *program_path = builtin ? NULL : resolve_command_path(arguments[0]);
+        if (program_path) hash_cache_file(key, program_path);
+        if (builtin) reads_input = 0; // None of the output-only builtins reads stdin
+    } else {
+        reads_input = 0; // The operators read their operand files
+    }
+    int input_redirected = 0;
+    for (redirection *redirect = node->redirections; redirect; redirect = redirect->next_redirection) {
+        if (redirect->redirect_type != TOKEN_REDIRECT_OUTPUT && redirect->redirect_type != TOKEN_REDIRECT_APPEND)
+            input_redirected = 1;
+        if (redirect->redirect_type == TOKEN_HERE_STRING || redirect->redirect_type == TOKEN_HERE_DOCUMENT) {
+            if (strstr(redirect->target_word, "$(")) return -1;
+            hash_cache_string(key, redirect->literal_document ? redirect->target_word
+                                                              : expand_text(arena, redirect->target_word, 1));
+            continue;
+        }
+        if (redirect->redirect_type != TOKEN_REDIRECT_INPUT) return -1; // Output files would not be replayed
+        hash_cache_file(key, expand_word(arena, redirect->target_word));
+    }
+    if (reads_input && !input_redirected && hash_cache_input(key) < 0) return -1;
+    return 0;
+}
+
+// Opens (creating as needed) $MBASH25_CACHE_DIR, else
+// $XDG_CACHE_HOME/mbash25, else ~/.cache/mbash25
+int open_cache_directory() {
+    if (cache_directory_fd >= 0) return cache_directory_fd;
+    char directory_path[4096];
+    const char *configured_path = getenv("MBASH25_CACHE_DIR");
+    const char *cache_home = getenv("XDG_CACHE_HOME");
+    const char *home_directory = getenv("HOME");
+    if (configured_path && *configured_path) snprintf(directory_path, sizeof(directory_path), "%s", configured_path);
+    else if (cache_home && *cache_home) snprintf(directory_path, sizeof(directory_path), "%s/mbash25", cache_home);
+    else if (home_directory) snprintf(directory_path, sizeof(directory_path), "%s/.cache/mbash25", home_directory);
+    else return -1;
+
+    for (char *separator = strchr(directory_path + 1, '/'); ; separator = strchr(separator + 1, '/')) {
+        if (separator) *separator = '\0'; // Create each missing parent in turn
+        if (mkdir(directory_path, 0700) < 0 && errno != EEXIST) return -1;
+        if (!separator) break;
+        *separator = '/';
+    }
+    cache_directory_fd = open(directory_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    return cache_directory_fd;
+}
+
+long cache_size_limit() {
+    if (cache_size_setting == OPTION_AUTO) return CACHE_DEFAULT_LIMIT;
+    return cache_size_setting == OPTION_MAX ? LONG_MAX : cache_size_setting;
+}
+
+// Orders entries oldest first
+int compare_cache_entries(const void *first, const void *second) {
+    long long first_used = ((const cache_entry_info *)first)->last_used;
+    long long second_used = ((const cache_entry_info *)second)->last_used;
+    return (first_used > second_used) - (first_used < second_used);
+}
+
+// Walks the cache entries, returning their count and total size. With
+// trim_to_bytes >= 0, the least recently used entries (oldest mtime;
+// hits refresh it) are deleted until the total fits.
+int scan_cache_entries(long long *total_bytes, long long trim_to_bytes) {
+    int directory_fd = open_cache_directory();
+    if (directory_fd < 0) return -1;
+    DIR *directory = fdopendir(openat(directory_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (!directory) return -1;
+    cache_entry_info *entries = NULL;
+    int entry_count = 0, entry_capacity = 0;
+    struct dirent *directory_entry;
+    *total_bytes = 0;
+    while ((directory_entry = readdir(directory)) != NULL) {
+        struct stat entry_info;
+        if (strlen(directory_entry->d_name) != 32 ||
+            fstatat(directory_fd, directory_entry->d_name, &entry_info, 0) < 0)
+            continue; // Only key-named entries; temporaries are skipped
+        if (entry_count == entry_capacity) {
+            entry_capacity = entry_capacity ? entry_capacity * 2 : 64;
+            cache_entry_info *grown = realloc(entries, entry_capacity * sizeof(cache_entry_info));
+            if (!grown) break;
+            entries = grown;
+        }
+        memcpy(entries[entry_count].entry_name, directory_entry->d_name, 33);
+        entries[entry_count].entry_bytes = entry_info.st_size;
+        entries[entry_count].last_used = entry_info.st_mtim.tv_sec * 1000000000LL + entry_info.st_mtim.tv_nsec;
+        entry_count++;
+        *total_bytes += entry_info.st_size;
+    }
+    closedir(directory);
+
+    if (trim_to_bytes >= 0 && *total_bytes > trim_to_bytes) {
+        qsort(entries, entry_count, sizeof(cache_entry_info), compare_cache_entries);
+        for (int entry_index = 0; entry_index < entry_count && *total_bytes > trim_to_bytes; entry_index++) {
+            if (unlinkat(directory_fd, entries[entry_index].entry_name, 0) == 0) {
+                *total_bytes -= entries[entry_index].entry_bytes;
+                cache_evictions++;
+            }
+        }
+        entry_count = 0; // Count is stale after eviction; callers only want the size here
+    }
+    free(entries);
+    cache_total_bytes = *total_bytes;
+    return entry_count;
+}
+
+// Adds a new entry to the running cache size. The directory is only walked
+// (and trimmed) when that total passes set -o cachesize, or once to learn
+// the size left by earlier sessions, so a store normally costs one fstat.
+void note_cache_store(int entry_fd) {
+    struct stat entry_info;
+    long size_limit = cache_size_limit();
+    long long total_bytes;
+    if (cache_total_bytes >= 0 && fstat(entry_fd, &entry_info) == 0) cache_total_bytes += entry_info.st_size;
+    else cache_total_bytes = -1;
+    if (cache_total_bytes < 0 || (size_limit != LONG_MAX && cache_total_bytes > size_limit))
+        scan_cache_entries(&total_bytes, size_limit == LONG_MAX ? -1 : size_limit);
+}
+
+// Replays a stored entry: its stdout goes to the shell's stdout with
+// sendfile/splice and its status is returned. -1 means no usable entry.
+int replay_cache_entry(int directory_fd, const char *entry_name) {
+    int entry_fd = openat(directory_fd, entry_name, O_RDONLY | O_CLOEXEC);
+    if (entry_fd < 0) return -1;
+    char header[CACHE_HEADER_SIZE + 1] = {0};
+    int exit_status;
+    if (read(entry_fd, header, CACHE_HEADER_SIZE) != CACHE_HEADER_SIZE ||
+        sscanf(header, "mbash25:%d", &exit_status) != 1) {
+        close(entry_fd);
+        return -1;
+    }
+    futimens(entry_fd, NULL); // Mark as recently used for LRU eviction
+    flush_shell_output();
+    stream_file_to_output(entry_fd, "cache entry", STDOUT_FILENO, "cache");
+    close(entry_fd);
+    return exit_status;
+}
+
+// Runs a tree prefixed with 'cache'. On a hit the stored output and status
+// are replayed; on a miss the tree runs with stdout captured in a new
+// entry, which is then renamed into place and replayed.
+int execute_cached(memory_arena *arena, syntax_node *node) {
+    cache_key key = {0xcbf29ce484222325ULL, 0x84222325cbf29ce4ULL};
+    char working_directory[4096];
+    if (getcwd(working_directory, sizeof(working_directory))) hash_cache_string(&key, working_directory);
+    hash_cache_environment(&key, arena);
+    int directory_fd = open_cache_directory();
+    if (directory_fd < 0 || hash_cache_node(&key, arena, node, 1) < 0) {
+        cache_bypasses++;
+        return execute_node(arena, node); // Not cacheable: run as usual
+    }
+    char entry_name[33];
+    snprintf(entry_name, sizeof(entry_name), "%016llx%016llx", key.high, key.low);
+
+    int exit_status = replay_cache_entry(directory_fd, entry_name);
+    if (exit_status >= 0) {
+        cache_hits++;
+        return exit_status;
+    }
+    cache_misses++;
+
+    char temporary_name[64];
+    snprintf(temporary_name, sizeof(temporary_name), "tmp.%d.%s", (int)getpid(), entry_name);
+    int entry_fd = openat(directory_fd, temporary_name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (entry_fd < 0) return execute_node(arena, node);
+    lseek(entry_fd, CACHE_HEADER_SIZE, SEEK_SET);
+
+    flush_shell_output();
+    int saved_output = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+    dup2(entry_fd, STDOUT_FILENO);
+    check_output_target();
+    exit_status = execute_node(arena, node);
+    flush_shell_output();
+    dup2(saved_output, STDOUT_FILENO);
+    close(saved_output);
+    check_output_target();
+
+    char header[CACHE_HEADER_SIZE + 1];
+    snprintf(header, sizeof(header), "mbash25:%7d\n", exit_status);
+    int stored = exit_status < 128 && // Killed by a signal: the output is not the command's answer
+                 pwrite(entry_fd, header, CACHE_HEADER_SIZE, 0) == CACHE_HEADER_SIZE &&
+                 renameat(directory_fd, temporary_name, directory_fd, entry_name) == 0;
+    if (!stored) unlinkat(directory_fd, temporary_name, 0);
+
+    lseek(entry_fd, CACHE_HEADER_SIZE, SEEK_SET);
+    stream_file_to_output(entry_fd, "cache entry", STDOUT_FILENO, "cache");
+    if (stored) note_cache_store(entry_fd);
+    close(entry_fd);
+    return exit_status;
+}
+
+// ======== SHELL BUILTINS ======== //
+
+int builtin_killterm(int argument_count, char **arguments) {
+    (void)argument_count, (void)arguments;
+    flush_shell_output();
+    exit(0); // Exit shell
+}
+
+// newt: opens a session and, on a terminal, switches to it right away
+int builtin_newt(int argument_count, char **arguments) {
+    (void)argument_count, (void)arguments;
+    int session_number = create_session();
+    if (session_number < 0) return 1;
+    if (shell_is_interactive && isatty(STDIN_FILENO)) return attach_session(session_number);
+    printf("[session %d] %s\n", session_number, session_table[find_session(session_number)].terminal_name);
+    return 0;
+}
+
+int builtin_sessions(int argument_count, char **arguments) {
+    (void)argument_count, (void)arguments;
+    for (int session_index = 0; session_index < session_count; session_index++) {
+        shell_session *session = &session_table[session_index];
+        printf("[%d] %d %s, %zu bytes waiting\n", session->session_number, (int)session->process_id,
+               session->terminal_name, session->scrollback_length);
+    }
+    return 0;
+}
+
+// attach [N]: switches to session N (default: the newest one)
+int builtin_attach(int argument_count, char **arguments) {
+    if (session_count == 0) {
+        fprintf(stderr, "attach: no sessions\n");
+        return 1;
+    }
+    int session_number = 0;
+    for (int session_index = 0; session_index < session_count; session_index++)
+        if (session_table[session_index].session_number > session_number)
+            session_number = session_table[session_index].session_number;
+    if (argument_count > 1) {
+        session_number = atoi(arguments[1]);
+        if (find_session(session_number) < 0) {
+            fprintf(stderr, "attach: %s: no such session\n", arguments[1]);
+            return 1;
+        }
+    }
+    return attach_session(session_number);
+}
+
+int builtin_true(int argument_count, char **arguments) {
+    (void)argument_count, (void)arguments;
+    return 0;
+}
+
+int builtin_false(int argument_count, char **arguments) {
+    (void)argument_count, (void)arguments;
+    return 1;
+}
+
+int builtin_pwd(int argument_count, char **arguments) {
+    (void)argument_count, (void)arguments;
+    char *current_directory = getcwd(NULL, 0);
+    if (!current_directory) {
+        fprintf(stderr, "pwd: %s\n", strerror(errno));
+        return 1;
+    }
+    printf("%s\n", current_directory);
+    free(current_directory);
+    return 0;
+}
+
+// cd [dir | -]: no operand means $HOME, '-' means $OLDPWD (and prints it)
+int builtin_cd(int argument_count, char **arguments) {
+    const char *target_directory = (argument_count > 1) ? arguments[1] : getenv("HOME");
+    int print_target = 0;
+    if (!target_directory) {
+        fprintf(stderr, "cd: HOME not set\n");
+        return 1;
+    }
+    if (strcmp(target_directory, "-") == 0) {
+        target_directory = getenv("OLDPWD");
+        if (!target_directory) {
+            fprintf(stderr, "cd: OLDPWD not set\n");
+            return 1;
+        }
+        print_target = 1;
+    }
+
+    char *previous_directory = getcwd(NULL, 0);
+    if (chdir(target_directory) < 0) {
+        fprintf(stderr, "cd: %s: %s\n", target_directory, strerror(errno));
+        free(previous_directory);
+        return 1;
+    }
+    char *new_directory = getcwd(NULL, 0);
+    if (previous_directory) set_shell_variable("OLDPWD", previous_directory, 1);
+    if (new_directory) set_shell_variable("PWD", new_directory, 1);
+    if (print_target && new_directory) printf("%s\n", new_directory);
+    free(previous_directory);
+    free(new_directory);
+    return 0;
+}
+
+// Writes one echo -e argument; returns 0 once \c asks to stop all output
+int echo_escaped(const char *text) {
+    for (const char *cursor = text; *cursor; cursor++) {
+        if (*cursor != '\\' || !cursor[1]) {
+            putchar(*cursor);
+            continue;
+        }
+        int value, digits;
+        switch (*++cursor) {
+        case 'a': putchar('\a'); break;
+        case 'b': putchar('\b'); break;
+        case 'c': return 0;
+        case 'e': case 'E': putchar('\033'); break;
+        case 'f': putchar('\f'); break;
+        case 'n': putchar('\n'); break;
+        case 'r': putchar('\r'); break;
+        case 't': putchar('\t'); break;
+        case 'v': putchar('\v'); break;
+        case '\\': putchar('\\'); break;
+        case '0': // \0nnn: up to three octal digits
+            for (value = 0, digits = 0; digits < 3 && cursor[1] >= '0' && cursor[1] <= '7'; digits++)
+                value = value * 8 + (*++cursor - '0');
+            putchar(value);
+            break;
+        case 'x': // \xHH: up to two hex digits
+            for (value = 0, digits = 0; digits < 2 && isxdigit((unsigned char)cursor[1]); digits++) {
+                char hex_digit = *++cursor;
+                value = value * 16 + (isdigit((unsigned char)hex_digit) ? hex_digit - '0'
+                                                                       : tolower(hex_digit) - 'a' + 10);
+            }
+            if (digits) putchar(value);
+            else fputs("\\x", stdout);
+            break;
+        default: // Unknown escapes are printed as written
+            putchar('\\');
+            putchar(*cursor);
+        }
+    }
+    return 1;
+}
+
+// echo [-neE] [arg...], option parsing as in bash
+int builtin_echo(int argument_count, char **arguments) {
+    int print_newline = 1, interpret_escapes = 0, argument_index = 1;
+    for (; argument_index < argument_count; argument_index++) {
+        const char *option = arguments[argument_index];
+        if (option[0] != '-' || option[1] == '\0' || option[strspn(option + 1, "neE") + 1] != '\0')
+            break; // First word that is not purely n/e/E flags starts the text
+        for (option++; *option; option++) {
+            if (*option == 'n') print_newline = 0;
+            else interpret_escapes = (*option == 'e');
+        }
+    }
+
+    for (int first = argument_index; argument_index < argument_count; argument_index++) {
+        if (argument_index > first) putchar(' ');
+        if (!interpret_escapes) fputs(arguments[argument_index], stdout);
+        else if (!echo_escaped(arguments[argument_index])) return 0;
+    }
+    if (print_newline) putchar('\n');
+    return 0;
+}
+
+int is_valid_identifier(const char *name, size_t length) {
+    if (length == 0 || !(isalpha((unsigned char)name[0]) || name[0] == '_')) return 0;
+    for (size_t char_index = 1; char_index < length; char_index++)
+        if (!(isalnum((unsigned char)name[char_index]) || name[char_index] == '_')) return 0;
+    return 1;
+}
+
+// export [NAME[=value]...]; with no operands lists the environment bash-style
+int builtin_export(int argument_count, char **arguments) {
+    int exit_status = 0;
+    if (argument_count == 1) {
+        for (char **variable = environ; *variable; variable++) {
+            const char *equals_sign = strchr(*variable, '=');
+            if (!equals_sign) continue;
+            printf("declare -x %.*s=\"%s\"\n", (int)(equals_sign - *variable), *variable, equals_sign + 1);
+        }
+        return 0;
+    }
+    for (int argument_index = 1; argument_index < argument_count; argument_index++) {
+        char *assignment = arguments[argument_index];
+        char *equals_sign = strchr(assignment, '=');
+        size_t name_length = equals_sign ? (size_t)(equals_sign - assignment) : strlen(assignment);
+        if (!is_valid_identifier(assignment, name_length)) {
+            fprintf(stderr, "export: `%s': not a valid identifier\n", assignment);
+            exit_status = 1;
+            continue;
+        }
+        if (!equals_sign) { // A bare name exports the shell variable's current value
+            const char *variable_value = find_shell_variable(assignment, name_length);
+            if (variable_value) set_shell_variable(assignment, variable_value, 1);
+            continue;
+        }
+        *equals_sign = '\0';
+        set_shell_variable(assignment, equals_sign + 1, 1);
+        *equals_sign = '=';
+    }
+    return exit_status;
+}
+
+// Parses a numeric option value: auto, max, or a number with an optional K/M/G suffix
+int parse_option_value(const char *text, long *size) {
+    if (strcmp(text, "auto") == 0) *size = OPTION_AUTO;
+    else if (strcmp(text, "max") == 0) *size = OPTION_MAX;
+    else {
+        char *suffix;
+        errno = 0;
+        long value = strtol(text, &suffix, 10);
+        if (*suffix == 'K' || *suffix == 'k') value <<= 10, suffix++;
+        else if (*suffix == 'M' || *suffix == 'm') value <<= 20, suffix++;
+        else if (*suffix == 'G' || *suffix == 'g') value <<= 30, suffix++;
+        if (errno || suffix == text || *suffix || value <= 0 || value > INT_MAX) return -1;
+        *size = value;
+    }
+    return 0;
+}
+
+void format_option_value(const shell_option *option, char *text, size_t text_size) {
+    if (option->option_flag) snprintf(text, text_size, "%s", *option->option_flag ? "on" : "off");
+    else if (option->option_cpu_list) snprintf(text, text_size, "%s", *option->option_cpu_list ?: "auto");
+    else if (*option->option_size == OPTION_AUTO) snprintf(text, text_size, "auto");
+    else if (*option->option_size == OPTION_MAX) snprintf(text, text_size, "max");
+    else snprintf(text, text_size, "%ld", *option->option_size);
+}
+
+// set -o NAME enables an option, set +o NAME disables it (size options take
+// set -o NAME=VALUE and go back to auto with +o); set -o alone lists the
+// options and set +o alone prints them as reusable commands
+int builtin_set(int argument_count, char **arguments) {
+    if (argument_count == 1) return 0;
+    int enable = (strcmp(arguments[1], "-o") == 0);
+    if (!enable && strcmp(arguments[1], "+o") != 0) {
+        fprintf(stderr, "mbash25: set: %s: invalid option\n", arguments[1]);
+        fprintf(stderr, "set: usage: set [-o|+o] [option-name[=value]]\n");
+        return 2;
+    }
+    if (argument_count == 2) {
+        for (shell_option *option = shell_options; option->option_name; option++) {
+            char value_text[32];
+            format_option_value(option, value_text, sizeof(value_text));
+            if (enable) printf("%-15s\t%s\n", option->option_name, value_text);
+            else if (option->option_flag) printf("set %co %s\n", *option->option_flag ? '-' : '+', option->option_name);
+            else printf("set -o %s=%s\n", option->option_name, value_text);
+        }
+        return 0;
+    }
+
+    int exit_status = 0;
+    for (int argument_index = 2; argument_index < argument_count; argument_index++) {
+        char *option_text = arguments[argument_index];
+        char *equals_sign = strchr(option_text, '=');
+        size_t name_length = equals_sign ? (size_t)(equals_sign - option_text) : strlen(option_text);
+        shell_option *option = shell_options;
+        while (option->option_name && (strlen(option->option_name) != name_length ||
+                                       strncmp(option->option_name, option_text, name_length) != 0))
+            option++;
+        if (!option->option_name || (option->option_flag && equals_sign)) {
+            fprintf(stderr, "mbash25: set: %s: invalid option name\n", option_text);
+            exit_status = 1;
+        } else if (option->option_flag) {
+            *option->option_flag = enable;
+        } else if (option->option_cpu_list) {
+            cpu_set_t cpu_set;
+            int set_list = enable && !(equals_sign && strcmp(equals_sign + 1, "auto") == 0); // auto: any CPU
+            if (set_list && (!equals_sign || parse_cpu_list(equals_sign + 1, &cpu_set) < 0)) {
+                fprintf(stderr, "mbash25: set: %s: expected %.*s=CPU list (for example 2-3)\n", option_text,
+                        (int)name_length, option_text);
+                exit_status = 1;
+                continue;
+            }
+            free(*option->option_cpu_list);
+            *option->option_cpu_list = set_list ? strdup(equals_sign + 1) : NULL;
+        } else if (!enable) {
+            *option->option_size = OPTION_AUTO;
+        } else if (!equals_sign || parse_option_value(equals_sign + 1, option->option_size) < 0) {
+            fprintf(stderr, "mbash25: set: %s: expected %.*s=auto, max or a number\n", option_text,
+                    (int)name_length, option_text);
+            exit_status = 1;
+        }
+    }
+    return exit_status;
+}
+
+// cache --stats prints this session's counters and the cache's size;
+// cache --clear removes every entry. 'cache command' itself is parsed as
+// a prefix and never reaches the builtin.
+int builtin_cache(int argument_count, char **arguments) {
+    long long total_bytes;
+    if (argument_count == 2 && strcmp(arguments[1], "--stats") == 0) {
+        int entry_count = scan_cache_entries(&total_bytes, -1);
+        if (entry_count < 0) {
+            fprintf(stderr, "cache: cannot open the cache directory\n");
+            return 1;
+        }
+        long size_limit = cache_size_limit();
+        printf("entries    %d\n", entry_count);
+        printf("size       %lld bytes\n", total_bytes);
+        if (size_limit == LONG_MAX) printf("limit      none\n");
+        else printf("limit      %ld bytes\n", size_limit);
+        printf("hits       %lu\n", cache_hits);
+        printf("misses     %lu\n", cache_misses);
+        printf("uncached   %lu\n", cache_bypasses);
+        printf("evictions  %lu\n", cache_evictions);
+        return 0;
+    }
+    if (argument_count == 2 && strcmp(arguments[1], "--clear") == 0)
+        return scan_cache_entries(&total_bytes, 0) < 0 ? 1 : 0;
+    fprintf(stderr, "cache: usage: cache command | cache --stats | cache --clear\n");
+    return 2;
+}
+
+// ======== TEST BUILTIN ======== //
+
+// Cursor over the operands of test/[ for the recursive-descent evaluator
+typedef struct {
+    char **operands;
+    int operand_count;
+    int next_operand;
+    int usage_error; // Set for malformed expressions (exit status 2)
+} test_parser;
+
+int test_integer(test_parser *parser, const char *text, long long *value) {
+    char *number_end;
+    errno = 0;
+    *value = strtoll(text, &number_end, 10);
+    while (isspace((unsigned char)*number_end)) number_end++;
+    if (*text == '\0' || *number_end != '\0' || errno) {
+        fprintf(stderr, "test: %s: integer expression expected\n", text);
+        parser->usage_error = 1;
+        return 0;
+    }
+    return 1;
+}
+
+int test_unary(const char *test_operator, const char *operand) {
+    struct stat file_info;
+    char operator_letter = test_operator[1];
+    if (operator_letter == 'z') return operand[0] == '\0';
+    if (operator_letter == 'n') return operand[0] != '\0';
+    if (operator_letter == 't') return isatty(atoi(operand));
+    if (operator_letter == 'r') return access(operand, R_OK) == 0;
+    if (operator_letter == 'w') return access(operand, W_OK) == 0;
+    if (operator_letter == 'x') return access(operand, X_OK) == 0;
+    if (operator_letter == 'h' || operator_letter == 'L')
+        return lstat(operand, &file_info) == 0 && S_ISLNK(file_info.st_mode);
+    if (stat(operand, &file_info) < 0) return 0;
+    switch (operator_letter) {
+    case 'e': return 1;
+    case 'f': return S_ISREG(file_info.st_mode);
+    case 'd': return S_ISDIR(file_info.st_mode);
+    case 's': return file_info.st_size > 0;
+    case 'p': return S_ISFIFO(file_info.st_mode);
+    case 'S': return S_ISSOCK(file_info.st_mode);
+    case 'b': return S_ISBLK(file_info.st_mode);
+    case 'c': return S_ISCHR(file_info.st_mode);
+    }
+    return 0;
+}
+
+int is_unary_test_operator(const char *text) {
+    return text[0] == '-' && text[1] && !text[2] && strchr("zntrwxhLefdspSbc", text[1]);
+}
+
+int is_binary_test_operator(const char *text) {
+    static const char *binary_operators[] = {
+        "=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt", "-ot", "-ef", NULL
+    };
+    for (const char **candidate = binary_operators; *candidate; candidate++)
+        if (strcmp(*candidate, text) == 0) return 1;
+    return 0;
+}
+
+int test_binary(test_parser *parser, const char *left, const char *test_operator, const char *right) {
+    if (strcmp(test_operator, "=") == 0 || strcmp(test_operator, "==") == 0) return strcmp(left, right) == 0;
+    if (strcmp(test_operator, "!=") == 0) return strcmp(left, right) != 0;
+    if (strcmp(test_operator, "<") == 0) return strcmp(left, right) < 0;
+    if (strcmp(test_operator, ">") == 0) return strcmp(left, right) > 0;
+
+    if (test_operator[1] == 'n' || test_operator[1] == 'o' || strcmp(test_operator, "-ef") == 0) {
+        struct stat left_info, right_info; // File comparisons
+        int left_exists = stat(left, &left_info) == 0, right_exists = stat(right, &right_info) == 0;
+        if (strcmp(test_operator, "-ef") == 0)
+            return left_exists && right_exists && left_info.st_dev == right_info.st_dev &&
+                   left_info.st_ino == right_info.st_ino;
+        if (strcmp(test_operator, "-nt") == 0)
+            return left_exists && (!right_exists || left_info.st_mtim.tv_sec > right_info.st_mtim.tv_sec ||
+                   (left_info.st_mtim.tv_sec == right_info.st_mtim.tv_sec &&
+                    left_info.st_mtim.tv_nsec > right_info.st_mtim.tv_nsec));
+        return right_exists && (!left_exists || right_info.st_mtim.tv_sec > left_info.st_mtim.tv_sec ||
+               (right_info.st_mtim.tv_sec == left_info.st_mtim.tv_sec &&
+                right_info.st_mtim.tv_nsec > left_info.st_mtim.tv_nsec));
+    }
+
+    long long left_value, right_value; // Integer comparisons
+    if (!test_integer(parser, left, &left_value) || !test_integer(parser, right, &right_value)) return 0;
+    if (strcmp(test_operator, "-eq") == 0) return left_value == right_value;
+    if (strcmp(test_operator, "-ne") == 0) return left_value != right_value;
+    if (strcmp(test_operator, "-lt") == 0) return left_value < right_value;
+    if (strcmp(test_operator, "-le") == 0) return left_value <= right_value;
+    if (strcmp(test_operator, "-gt") == 0) return left_value > right_value;
+    return left_value >= right_value;
+}
+
+int test_or_expression(test_parser *parser);
+
+// primary := '!' primary | '(' expr ')' | arg binop arg | unop arg | arg
+int test_primary(test_parser *parser) {
+    int remaining = parser->operand_count - parser->next_operand;
+    char **operand = parser->operands + parser->next_operand;
+    if (remaining <= 0) {
+        fprintf(stderr, "test: argument expected\n");
+        parser->usage_error = 1;
+        return 0;
+    }
+    if (remaining >= 3 && is_binary_test_operator(operand[1])) {
+        parser->next_operand += 3;
+        return test_binary(parser, operand[0], operand[1], operand[2]);
+    }
+    if (strcmp(operand[0], "!") == 0 && remaining >= 2) {
+        parser->next_operand++;
+        return !test_primary(parser);
+    }
+    if (strcmp(operand[0], "(") == 0 && remaining >= 2) {
+        parser->next_operand++;
+        int result = test_or_expression(parser);
+        if (parser->next_operand >= parser->operand_count ||
+            strcmp(parser->operands[parser->next_operand], ")") != 0) {
+            fprintf(stderr, "test: `)' expected\n");
+            parser->usage_error = 1;
+            return 0;
+        }
+        parser->next_operand++;
+        return result;
+    }
+    if (is_unary_test_operator(operand[0]) && remaining >= 2) {
+        parser->next_operand += 2;
+        return test_unary(operand[0], operand[1]);
+    }
+    parser->next_operand++; // A lone word is true when it is non-empty
+    return operand[0][0] != '\0';
+}
+
+int test_and_expression(test_parser *parser) {
+    int result = test_primary(parser);
+    while (parser->next_operand < parser->operand_count &&
+           strcmp(parser->operands[parser->next_operand], "-a") == 0) {
+        parser->next_operand++;
+        result = test_primary(parser) && result;
+    }
+    return result;
+}
+
+int test_or_expression(test_parser *parser) {
+    int result = test_and_expression(parser);
+    while (parser->next_operand < parser->operand_count &&
+           strcmp(parser->operands[parser->next_operand], "-o") == 0) {
+        parser->next_operand++;
+        result = test_and_expression(parser) || result;
+    }
+    return result;
+}
+
+// test EXPR and [ EXPR ]: 0 when true, 1 when false, 2 on a malformed expression
+int builtin_test(int argument_count, char **arguments) {
+    if (strcmp(arguments[0], "[") == 0) {
+        if (strcmp(arguments[argument_count - 1], "]") != 0) {
+            fprintf(stderr, "[: missing `]'\n");
+            return 2;
+        }
+        argument_count--;
+    }
+    if (argument_count == 1) return 1; // No expression is false
+
+    test_parser parser = {arguments + 1, argument_count - 1, 0, 0};
+    int result = test_or_expression(&parser);
+    if (!parser.usage_error && parser.next_operand < parser.operand_count) {
+        fprintf(stderr, "test: %s: unexpected operator\n", parser.operands[parser.next_operand]);
+        parser.usage_error = 1;
+    }
+    if (parser.usage_error) return 2;
+    return result ? 0 : 1;
+}
+
+// ======== ARENA ALLOCATOR ======== //
+
+void* arena_alloc(memory_arena *arena, size_t size) {
+    size = (size + 15) & ~(size_t)15; // Keep every allocation 16-byte aligned
+    arena_block *block = arena->current_block;
+    if (!block || block->used_bytes + size > block->capacity) { // Start a new block
+        size_t capacity = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        arena_block *new_block = malloc(sizeof(arena_block) + capacity);
+        if (!new_block) {
+            perror("Arena allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        new_block->older_block = block;
+        new_block->used_bytes = 0;
+        new_block->capacity = capacity;
+        arena->current_block = block = new_block;
+    }
+    void *memory = block->block_data + block->used_bytes;
+    block->used_bytes += size;
+    return memory;
+}
+
+void* arena_zalloc(memory_arena *arena, size_t size) {
+    return memset(arena_alloc(arena, size), 0, size);
+}
+
+char* arena_strndup(memory_arena *arena, const char *text, size_t length) {
+    char *copy = arena_alloc(arena, length + 1);
+    memcpy(copy, text, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+// Frees everything allocated since the arena was last reset. The oldest
+// block is kept so steady-state lines never touch malloc.
+void arena_reset(memory_arena *arena) {
+    arena_block *block = arena->current_block;
+    while (block && block->older_block) {
+        arena_block *older_block = block->older_block;
+        free(block);
+        block = older_block;
+    }
+    if (block) block->used_bytes = 0;
+    arena->current_block = block;
+}
+
+arena_position arena_mark(memory_arena *arena) {
+    arena_position position = {arena->current_block, arena->current_block ? arena->current_block->used_bytes : 0};
+    return position;
+}
+
+// Frees everything allocated since the mark, so loops can drop each
+// iteration's scratch memory without touching the line's syntax tree
+void arena_release(memory_arena *arena, arena_position position) {
+    arena_block *block = arena->current_block;
+    while (block && block != position.block) {
+        arena_block *older_block = block->older_block;
+        free(block);
+        block = older_block;
+    }
+    arena->current_block = block;
+    if (block) block->used_bytes = position.used_bytes;
+}
+
+// ======== LEXER ======== //
+
+const char* token_text(token_type type) {
+    static const char *token_names[] = {
+        "word", "|", "~", "&&", "||", ";", "&", "newline", "<", ">", ">>", "#", "++", "+", ":::",
+        "|&", "{", ",", "}", "<<<", "<<", "end of line"
+    };
+    return token_names[type];
+}
+
+// Reports a parse error. Running out of text inside a loop, a '|&' group
+// or a here-document, or right after an operator that needs a right-hand
+// side, only marks the command incomplete so the caller can read more lines.
+void report_syntax_error(command_lexer *lexer, const char *message, const char *detail) {
+    token_type previous_type = lexer->previous_type;
+    if (!lexer->syntax_error && lexer->current_type == TOKEN_END &&
+        (lexer->compound_depth || lexer->group_depth || lexer->pending_document_count ||
+         previous_type == TOKEN_PIPE || previous_type == TOKEN_REVERSE_PIPE || previous_type == TOKEN_AND ||
+         previous_type == TOKEN_OR || previous_type == TOKEN_PARALLEL || previous_type == TOKEN_FAN_OUT))
+        lexer->incomplete = 1;
+    if (!lexer->syntax_error && !lexer->incomplete) // Only the first error of a line is worth showing
+        fprintf(stderr, "mbash25: syntax error: %s%s%s\n", message, detail ? " " : "", detail ? detail : "");
+    lexer->syntax_error = 1;
+    lexer->current_type = TOKEN_END;
+}
+
+// Reports a command still unfinished when the input ran out
+void report_incomplete_command() {
+    fprintf(stderr, "mbash25: syntax error: unexpected end of file\n");
+}
+
+// Reports an unterminated quote or substitution, which more lines may close
+void report_unterminated(command_lexer *lexer, const char *opening) {
+    if (!lexer->syntax_error) lexer->incomplete = 1;
+    report_syntax_error(lexer, "unterminated", opening);
+}
+
+// Returns the offset just past the '"' closing the string that starts at
+// start, or 0 if the text ends first. "$(...)" inside may hold quotes.
+size_t skip_double_quotes(const char *text, size_t start) {
+    size_t cursor = start + 1;
+    while (text[cursor] && text[cursor] != '"') {
+        if (text[cursor] == '\\' && text[cursor + 1]) cursor += 2;
+        else if (text[cursor] == '$' && (text[cursor + 1] == '(' || text[cursor + 1] == '{')) {
+            if (!(cursor = skip_substitution(text, cursor))) return 0;
+        } else cursor++;
+    }
+    return text[cursor] ? cursor + 1 : 0;
+}
+
+// Returns the offset just past the ')' or '}' closing the "$(" or "${" at
+// start, or 0 if the text ends first. Quotes and nested substitutions
+// inside are skipped whole, so their parentheses do not count.
+size_t skip_substitution(const char *text, size_t start) {
+    char closing = (text[start + 1] == '(') ? ')' : '}';
+    int nesting = 0;
+    size_t cursor = start + 2;
+    while (text[cursor]) {
+        if (text[cursor] == '\\' && text[cursor + 1]) {
+            cursor += 2;
+        } else if (text[cursor] == '\'' && closing == ')') {
+            const char *closing_quote = strchr(text + cursor + 1, '\'');
+            if (!closing_quote) return 0;
+            cursor = closing_quote - text + 1;
+        } else if (text[cursor] == '"') {
+            if (!(cursor = skip_double_quotes(text, cursor))) return 0;
+        } else if (text[cursor] == '$' && (text[cursor + 1] == '(' || text[cursor + 1] == '{')) {
+            if (!(cursor = skip_substitution(text, cursor))) return 0;
+        } else if (text[cursor] == '(' && closing == ')') {
+            nesting++;
+            cursor++;
+        } else if (text[cursor] == closing && nesting-- == 0) {
+            return cursor + 1;
+        } else {
+            cursor++;
+        }
+    }
+    return 0;
+}
+
+// Reads the bodies of the '<<' redirections of the line that ends at the
+// newline at newline_offset. Returns the offset just past the last
+// delimiter line, or 0 (after reporting) if the text ends first.
+size_t read_here_documents(command_lexer *lexer, size_t newline_offset) {
+    const char *text = lexer->input_text;
+    size_t cursor = newline_offset + 1;
+    for (int document_index = 0; document_index < lexer->pending_document_count; document_index++) {
+        redirection *document = lexer->pending_documents[document_index];
+        const char *delimiter = document->target_word;
+        size_t delimiter_length = strlen(delimiter);
+        int strip_tabs = lexer->pending_strip_tabs[document_index];
+        char *body = arena_alloc(lexer->arena, strlen(text + cursor) + 1);
+        size_t body_length = 0;
+        while (1) {
+            if (!text[cursor]) {
+                lexer->current_type = TOKEN_END;
+                report_syntax_error(lexer, "here-document not terminated by", delimiter);
+                return 0;
+            }
+            if (strip_tabs) while (text[cursor] == '\t') cursor++;
+            size_t line_length = strchrnul(text + cursor, '\n') - (text + cursor);
+            int is_delimiter = (line_length == delimiter_length && strncmp(text + cursor, delimiter, line_length) == 0);
+            if (!is_delimiter) {
+                memcpy(body + body_length, text + cursor, line_length);
+                body_length += line_length;
+                body[body_length++] = '\n';
+            }
+            cursor += line_length + (text[cursor + line_length] == '\n');
+            if (is_delimiter) break;
+        }
+        body[body_length] = '\0';
+        document->target_word = body;
+    }
+    lexer->pending_document_count = 0;
+    return cursor;
+}
+
+// A '~' is the reversed pipe unless it starts a "~/path" word; ',' and '}'
+// only end a word inside a '|& { ... }' group
+int is_operator_character(const char *text, int in_group) {
+    switch (*text) {
+    case '|': case '&': case ';': case '<': case '>': case '\n':
+        return 1;
+    case '~':
+        return text[1] != '/';
+    case ',': case '}':
+        return in_group;
+    default:
+        return 0;
+    }
+}
+
+// Scans the next token in one pass over the line. Words keep their quotes
+// so expansion can still tell quoted text apart; the lexer only decides
+// where each word ends. '#', '++', '+' and ':::' are operators only when
+// they stand alone as a whole unquoted word.
+void lexer_advance(command_lexer *lexer) {
+    const char *text = lexer->input_text;
+    if (lexer->syntax_error) return;
+    if (lexer->current_type != TOKEN_NEWLINE) lexer->previous_type = lexer->current_type;
+    while (text[lexer->position] == ' ' || text[lexer->position] == '\t' || text[lexer->position] == '\r')
+        lexer->position++;
+    lexer->token_start = lexer->position;
+    lexer->current_word = NULL;
+
+    const char *cursor = text + lexer->position;
+    token_type operator_type = TOKEN_WORD;
+    int operator_length = 1;
+    switch (*cursor) {
+    case '\0': lexer->current_type = TOKEN_END; return;
+    case '\n':
+        operator_type = TOKEN_NEWLINE;
+        if (lexer->pending_document_count) { // Here-document bodies follow this line
+            size_t bodies_end = read_here_documents(lexer, lexer->position);
+            if (!bodies_end) return;
+            operator_length = bodies_end - lexer->position;
+        }
+        break;
+    case ';': operator_type = TOKEN_SEMICOLON; break;
+    case '<':
+        operator_type = (cursor[1] != '<') ? TOKEN_REDIRECT_INPUT :
+                        (cursor[2] == '<') ? TOKEN_HERE_STRING : TOKEN_HERE_DOCUMENT;
+        operator_length = (cursor[1] != '<') ? 1 : (cursor[2] == '<' || cursor[2] == '-') ? 3 : 2;
+        break;
+    case '|':
+        operator_type = (cursor[1] == '|') ? TOKEN_OR : (cursor[1] == '&') ? TOKEN_FAN_OUT : TOKEN_PIPE;
+        operator_length = (cursor[1] == '|' || cursor[1] == '&') ? 2 : 1;
+        break;
+    case ',':
+        if (lexer->group_depth) operator_type = TOKEN_GROUP_SEPARATOR;
+        break;
+    case '}':
+        if (lexer->group_depth) operator_type = TOKEN_GROUP_END;
+        break;
+    case '&':
+        operator_type = (cursor[1] == '&') ? TOKEN_AND : TOKEN_BACKGROUND;
+        operator_length = (cursor[1] == '&') ? 2 : 1;
+        break;
+    case '>':
+        operator_type = (cursor[1] == '>') ? TOKEN_REDIRECT_APPEND : TOKEN_REDIRECT_OUTPUT;
+        operator_length = (cursor[1] == '>') ? 2 : 1;
+        break;
+    case '~':
+        if (cursor[1] != '/') operator_type = TOKEN_REVERSE_PIPE;
+        break;
+    }
+    if (operator_type != TOKEN_WORD) {
+        lexer->current_type = operator_type;
+        lexer->position += operator_length;
         return;
     }
 
-    char *ending = beginning + strlen(beginning) - 1; // Find end of non-whitespace content
-    while (ending > beginning && isspace((unsigned char)*ending)) 
-        ending--;
-    
-    *(ending + 1) = '\0'; // Null-terminate the trimmed string
-    
-    if (beginning != text) // Move trimmed content to start of buffer
-        memmove(text, beginning, ending - beginning + 2);
-}
-
-void run_single_command(char *cmd_text, pid_t process_id) {
-    if (process_id < 0) { // Fork failed
-        perror("Fork error");
-        exit(0);
-    } else if (process_id == 0) { // Child process execution
-        char *parameters[MAX_PARAMETERS]; // Array to hold command arguments
-        char *current_token = strtok(cmd_text, " "); // Tokenize command by spaces
-        int param_index = 0;
-        while (current_token && param_index < MAX_PARAMETERS - 1) {
-            parameters[param_index++] = current_token; // Store each argument
-            current_token = strtok(NULL, " ");
-        }
-        parameters[param_index] = NULL; // Null-terminate argument array
-        
-        if (execvp(parameters[0], parameters) == -1) { // Execute command
-            perror("Execution failed");
+    size_t word_end = lexer->position;
+    while (text[word_end] && text[word_end] != ' ' && text[word_end] != '\t' &&
+           text[word_end] != '\r' && !is_operator_character(text + word_end, lexer->group_depth > 0)) {
+        if (text[word_end] == '\'') { // Single quotes: everything literal up to the next quote
+            const char *closing_quote = strchr(text + word_end + 1, '\'');
+            if (!closing_quote) {
+                report_unterminated(lexer, "'");
+                return;
+            }
+            word_end = closing_quote - text + 1;
+        } else if (text[word_end] == '"') { // Double quotes: backslash may escape the quote
+            if (!(word_end = skip_double_quotes(text, word_end))) {
+                report_unterminated(lexer, "\"");
+                return;
+            }
+        } else if (text[word_end] == '$' && (text[word_end + 1] == '(' || text[word_end + 1] == '{')) {
+            size_t substitution_end = skip_substitution(text, word_end); // Operators inside stay in the word
+            if (!substitution_end) {
+                report_unterminated(lexer, text[word_end + 1] == '(' ? "$(" : "${");
+                return;
+            }
+            word_end = substitution_end;
+        } else if (text[word_end] == '\\' && text[word_end + 1]) {
+            word_end += 2;
+        } else {
+            word_end++;
+        }
+    }
+
+    size_t word_length = word_end - lexer->position;
+    lexer->current_type = TOKEN_WORD;
+    if (word_length == 1 && *cursor == '#') lexer->current_type = TOKEN_WORD_COUNT;
+    else if (word_length == 1 && *cursor == '+') lexer->current_type = TOKEN_MUTUAL_APPEND;
+    else if (word_length == 2 && cursor[0] == '+' && cursor[1] == '+') lexer->current_type = TOKEN_CONCATENATE;
+    else if (word_length == 3 && strncmp(cursor, ":::", 3) == 0) lexer->current_type = TOKEN_PARALLEL;
+    else lexer->current_word = arena_strndup(lexer->arena, cursor, word_length);
+    lexer->position = word_end;
+}
+
+// ======== PARSER ======== //
+
+syntax_node* new_syntax_node(command_lexer *lexer, node_type type) {
+    syntax_node *node = arena_zalloc(lexer->arena, sizeof(syntax_node));
+    node->type = type;
+    return node;
+}
+
+// Appends to an arena-backed pointer array, doubling it when full
+void** append_to_array(memory_arena *arena, void **array, int count, int *capacity, void *item) {
+    if (count + 1 >= *capacity) { // Keep room for a NULL terminator
+        int new_capacity = *capacity ? *capacity * 2 : 8;
+        void **grown_array = arena_alloc(arena, new_capacity * sizeof(void *));
+        if (count) memcpy(grown_array, array, count * sizeof(void *));
+        array = grown_array;
+        *capacity = new_capacity;
+    }
+    array[count] = item;
+    array[count + 1] = NULL;
+    return array;
+}
+
+syntax_node* parse_syntax_error(command_lexer *lexer) {
+    if (lexer->current_type == TOKEN_WORD)
+        report_syntax_error(lexer, "unexpected word", lexer->current_word);
+    else
+        report_syntax_error(lexer, "unexpected token", token_text(lexer->current_type));
+    return NULL;
+}
+
+int is_redirection_token(token_type type) {
+    return type == TOKEN_REDIRECT_INPUT || type == TOKEN_REDIRECT_OUTPUT || type == TOKEN_REDIRECT_APPEND ||
+           type == TOKEN_HERE_STRING || type == TOKEN_HERE_DOCUMENT;
+}
+
+// redirect := ('<' | '>' | '>>' | '<<<') WORD | ('<<' | '<<-') DELIMITER
+// A here-document's body is filled in by the lexer at the end of the line.
+redirection* parse_redirection(command_lexer *lexer) {
+    token_type redirect_type = lexer->current_type;
+    int strip_tabs = (redirect_type == TOKEN_HERE_DOCUMENT && lexer->input_text[lexer->token_start + 2] == '-');
+    lexer_advance(lexer);
+    if (lexer->current_type != TOKEN_WORD) {
+        report_syntax_error(lexer, redirect_type == TOKEN_HERE_DOCUMENT ? "missing delimiter after"
+                                                                        : "missing file name after",
+                            token_text(redirect_type));
+        return NULL;
+    }
+    redirection *redirect = arena_zalloc(lexer->arena, sizeof(redirection));
+    redirect->redirect_type = redirect_type;
+    redirect->target_word = lexer->current_word;
+    if (redirect_type == TOKEN_HERE_DOCUMENT) {
+        if (lexer->pending_document_count == HERE_DOCUMENT_LIMIT) {
+            report_syntax_error(lexer, "too many here-documents on one line", NULL);
+            return NULL;
+        }
+        char *delimiter = lexer->current_word, *output = delimiter; // Quote removal in place
+        redirect->literal_document = (strpbrk(delimiter, "'\"\\") != NULL);
+        for (const char *cursor = delimiter; *cursor; cursor++) {
+            if (*cursor == '\\' && cursor[1]) *output++ = *++cursor;
+            else if (*cursor != '\'' && *cursor != '"') *output++ = *cursor;
+        }
+        *output = '\0';
+        lexer->pending_strip_tabs[lexer->pending_document_count] = strip_tabs;
+        lexer->pending_documents[lexer->pending_document_count++] = redirect;
+    }
+    return redirect;
+}
+
+int at_reserved_word(command_lexer *lexer, const char *reserved_word) {
+    return lexer->current_type == TOKEN_WORD && strcmp(lexer->current_word, reserved_word) == 0;
+}
+
+// do_group := 'do' list 'done'
+syntax_node* parse_do_group(command_lexer *lexer) {
+    while (lexer->current_type == TOKEN_NEWLINE || lexer->current_type == TOKEN_SEMICOLON)
+        lexer_advance(lexer);
+    if (!at_reserved_word(lexer, "do")) {
+        if (lexer->current_type == TOKEN_END) report_syntax_error(lexer, "missing", "do");
+        else parse_syntax_error(lexer);
+        return NULL;
+    }
+    lexer_advance(lexer);
+    syntax_node *body = parse_list(lexer);
+    if (lexer->syntax_error) return NULL;
+    if (!at_reserved_word(lexer, "done")) {
+        report_syntax_error(lexer, "missing", "done");
+        return NULL;
+    }
+    if (!body) return parse_syntax_error(lexer); // 'do done'
+    lexer_advance(lexer);
+    return body;
+}
+
+// loop := 'for' NAME 'in' WORD* (';' | newline) do_group
+//       | 'while' list do_group
+//       | 'repeat' WORD (do_group | command)
+// followed by redirections that apply to the whole loop. The body is
+// parsed once and run on every iteration.
+syntax_node* parse_loop(command_lexer *lexer) {
+    const char *keyword = lexer->current_word;
+    syntax_node *loop = new_syntax_node(lexer, keyword[0] == 'f' ? NODE_FOR : keyword[0] == 'w' ? NODE_WHILE
+                                                                                                  : NODE_REPEAT);
+    lexer->compound_depth++;
+    lexer_advance(lexer);
+    int word_capacity = 0;
+    if (loop->type == NODE_FOR) {
+        if (lexer->current_type != TOKEN_WORD || !is_valid_identifier(lexer->current_word, strlen(lexer->current_word))) {
+            report_syntax_error(lexer, "expected a variable name after", "for");
+            return NULL;
+        }
+        loop->loop_variable = lexer->current_word;
+        lexer_advance(lexer);
+        if (!at_reserved_word(lexer, "in")) {
+            report_syntax_error(lexer, "expected", "in");
+            return NULL;
+        }
+        lexer_advance(lexer);
+        while (lexer->current_type == TOKEN_WORD) {
+            loop->words = (char **)append_to_array(lexer->arena, (void **)loop->words, loop->word_count++,
+                                                   &word_capacity, lexer->current_word);
+            lexer_advance(lexer);
+        }
+        loop->left = parse_do_group(lexer);
+    } else if (loop->type == NODE_WHILE) {
+        loop->left = parse_list(lexer); // Stops at 'do'
+        if (!loop->left) {
+            if (!lexer->syntax_error) parse_syntax_error(lexer);
+            return NULL;
+        }
+        loop->right = parse_do_group(lexer);
+        if (!loop->right) return NULL;
+    } else {
+        if (lexer->current_type != TOKEN_WORD) {
+            report_syntax_error(lexer, "expected a count after", "repeat");
+            return NULL;
+        }
+        loop->words = (char **)append_to_array(lexer->arena, NULL, loop->word_count++, &word_capacity,
+                                               lexer->current_word);
+        lexer_advance(lexer);
+        loop->left = at_reserved_word(lexer, "do") ? parse_do_group(lexer) : parse_command(lexer);
+    }
+    if (!loop->left) return NULL;
+    lexer->compound_depth--;
+
+    redirection **redirect_tail = &loop->redirections;
+    while (is_redirection_token(lexer->current_type)) {
+        if (!(*redirect_tail = parse_redirection(lexer))) return NULL;
+        redirect_tail = &(*redirect_tail)->next_redirection;
+        lexer_advance(lexer);
+    }
+    return loop;
+}
+
+// command := loop | ('#' | '++')? (WORD | redirect)*   |   WORD '+' WORD
+syntax_node* parse_command(command_lexer *lexer) {
+    if (lexer->current_type == TOKEN_WORD &&
+        (strcmp(lexer->current_word, "for") == 0 || strcmp(lexer->current_word, "while") == 0 ||
+         strcmp(lexer->current_word, "repeat") == 0))
+        return parse_loop(lexer);
+
+    syntax_node *command = new_syntax_node(lexer, NODE_COMMAND);
+    redirection **redirect_tail = &command->redirections;
+    int word_capacity = 0;
+
+    if (lexer->current_type == TOKEN_WORD_COUNT || lexer->current_type == TOKEN_CONCATENATE) {
+        command->kind = (lexer->current_type == TOKEN_WORD_COUNT) ? COMMAND_WORD_COUNT : COMMAND_CONCATENATE;
+        lexer_advance(lexer);
+    }
+
+    while (1) {
+        token_type current_type = lexer->current_type;
+        if (current_type == TOKEN_WORD) {
+            command->words = (char **)append_to_array(lexer->arena, (void **)command->words,
+                                                      command->word_count++, &word_capacity,
+                                                      lexer->current_word);
+        } else if (is_redirection_token(current_type)) {
+            if (!(*redirect_tail = parse_redirection(lexer))) return NULL;
+            redirect_tail = &(*redirect_tail)->next_redirection;
+        } else if (current_type == TOKEN_MUTUAL_APPEND && command->kind == COMMAND_SIMPLE) {
+            if (command->word_count != 1) return parse_syntax_error(lexer);
+            command->kind = COMMAND_MUTUAL_APPEND;
+        } else {
+            break;
+        }
+        lexer_advance(lexer);
+    }
+    if (lexer->syntax_error) return NULL;
+
+    if (command->kind == COMMAND_MUTUAL_APPEND && command->word_count != 2) {
+        report_syntax_error(lexer, "exactly two files required around", "+");
+        return NULL;
+    }
+    if (command->kind == COMMAND_SIMPLE && command->word_count == 0 && !command->redirections)
+        return parse_syntax_error(lexer);
+    return command;
+}
+
+// pipeline := group ('~' newline* group)*, group := command ('|' newline* command)*
+// Groups joined by '~' run right to left, so "c ~ b | x ~ a" runs as "a | b | x | c".
+syntax_node* parse_pipeline(command_lexer *lexer) {
+    syntax_node **stages = NULL;
+    int stage_count = 0;
+
+    while (1) {
+        syntax_node **group = NULL;
+        int group_count = 0, group_capacity = 0;
+        while (1) {
+            syntax_node *command = parse_command(lexer);
+            if (!command) return NULL;
+            group = (syntax_node **)append_to_array(lexer->arena, (void **)group, group_count++,
+                                                    &group_capacity, command);
+            if (lexer->current_type != TOKEN_PIPE) break;
+            do lexer_advance(lexer); while (lexer->current_type == TOKEN_NEWLINE);
+        }
+
+        // Each new '~' group runs before the groups already parsed
+        syntax_node **combined = arena_alloc(lexer->arena, (group_count + stage_count) * sizeof(syntax_node *));
+        memcpy(combined, group, group_count * sizeof(syntax_node *));
+        if (stage_count) memcpy(combined + group_count, stages, stage_count * sizeof(syntax_node *));
+        stages = combined;
+        stage_count += group_count;
+
+        if (lexer->current_type != TOKEN_REVERSE_PIPE) break;
+        do lexer_advance(lexer); while (lexer->current_type == TOKEN_NEWLINE);
+    }
+    syntax_node *pipeline = stages[0];
+    if (stage_count > 1) {
+        pipeline = new_syntax_node(lexer, NODE_PIPELINE);
+        pipeline->stage_count = stage_count;
+        pipeline->stages = stages;
+    }
+    return (lexer->current_type == TOKEN_FAN_OUT) ? parse_fan_out(lexer, pipeline) : pipeline;
+}
+
+// fan_out := pipeline '|&' '{' newline* pipeline (',' newline* pipeline)* newline* '}'
+syntax_node* parse_fan_out(command_lexer *lexer, syntax_node *producer) {
+    syntax_node *fan_out = new_syntax_node(lexer, NODE_FAN_OUT);
+    fan_out->left = producer;
+    lexer_advance(lexer);
+    if (lexer->current_type != TOKEN_WORD || strcmp(lexer->current_word, "{") != 0) {
+        report_syntax_error(lexer, "expected { after", "|&");
+        return NULL;
+    }
+    lexer->group_depth++; // ',' and '}' end words from here on
+    int consumer_capacity = 0;
+    while (1) {
+        do lexer_advance(lexer); while (lexer->current_type == TOKEN_NEWLINE);
+        syntax_node *consumer = parse_pipeline(lexer);
+        if (!consumer) return NULL;
+        fan_out->stages = (syntax_node **)append_to_array(lexer->arena, (void **)fan_out->stages,
+                                                          fan_out->stage_count++, &consumer_capacity, consumer);
+        while (lexer->current_type == TOKEN_NEWLINE) lexer_advance(lexer);
+        if (lexer->current_type != TOKEN_GROUP_SEPARATOR) break;
+    }
+    if (lexer->current_type != TOKEN_GROUP_END) {
+        if (lexer->current_type == TOKEN_END) report_syntax_error(lexer, "missing", "}");
+        else parse_syntax_error(lexer);
+        return NULL;
+    }
+    lexer->group_depth--;
+    lexer_advance(lexer);
+    return fan_out;
+}
+
+// and_or := pipeline (('&&' | '||') newline* pipeline)*
+syntax_node* parse_and_or(command_lexer *lexer) {
+    syntax_node *left = parse_pipeline(lexer);
+    while (left && (lexer->current_type == TOKEN_AND || lexer->current_type == TOKEN_OR)) {
+        syntax_node *condition = new_syntax_node(lexer, lexer->current_type == TOKEN_AND ? NODE_AND : NODE_OR);
+        do lexer_advance(lexer); while (lexer->current_type == TOKEN_NEWLINE);
+        condition->left = left;
+        condition->right = parse_pipeline(lexer);
+        if (!condition->right) return NULL;
+        left = condition;
+    }
+    return left;
+}
+
+// True when the current word is a 'time' or 'cache' prefix. 'cache
+// --option' is left as a call of the cache builtin.
+int at_command_prefix(command_lexer *lexer) {
+    if (lexer->current_type != TOKEN_WORD) return 0;
+    if (strcmp(lexer->current_word, "time") == 0) return 1;
+    if (strcmp(lexer->current_word, "cache") != 0) return 0;
+    const char *next_word = lexer->input_text + lexer->position;
+    next_word += strspn(next_word, " \t");
+    return strncmp(next_word, "--", 2) != 0;
+}
+
+// parallel := ('time' | 'cache')* and_or (':::' newline* and_or)*
+// A leading 'time' or 'cache' covers every && / || chain and ':::' job after it.
+syntax_node* parse_parallel(command_lexer *lexer) {
+    if (at_command_prefix(lexer)) {
+        syntax_node *prefixed = new_syntax_node(lexer, lexer->current_word[0] == 't' ? NODE_TIMED : NODE_CACHED);
+        lexer_advance(lexer);
+        prefixed->left = parse_parallel(lexer);
+        return prefixed->left ? prefixed : NULL;
+    }
+    syntax_node *first = parse_and_or(lexer);
+    if (!first || lexer->current_type != TOKEN_PARALLEL) return first;
+
+    syntax_node *parallel = new_syntax_node(lexer, NODE_PARALLEL);
+    int job_capacity = 0;
+    parallel->stages = (syntax_node **)append_to_array(lexer->arena, NULL, parallel->stage_count++,
+                                                       &job_capacity, first);
+    while (lexer->current_type == TOKEN_PARALLEL) {
+        do lexer_advance(lexer); while (lexer->current_type == TOKEN_NEWLINE);
+        syntax_node *job = parse_and_or(lexer);
+        if (!job) return NULL;
+        parallel->stages = (syntax_node **)append_to_array(lexer->arena, (void **)parallel->stages,
+                                                           parallel->stage_count++, &job_capacity, job);
+    }
+    return parallel;
+}
+
+// A 'do' or 'done' at the start of a statement ends the list of a loop
+int at_list_terminator(command_lexer *lexer) {
+    return lexer->compound_depth && (at_reserved_word(lexer, "do") || at_reserved_word(lexer, "done"));
+}
+
+// list := (parallel (';' | '&' | newline))* parallel?
+syntax_node* parse_list(command_lexer *lexer) {
+    syntax_node *list = NULL;
+    while (lexer->current_type != TOKEN_END && !at_list_terminator(lexer)) {
+        if (lexer->current_type == TOKEN_SEMICOLON || lexer->current_type == TOKEN_NEWLINE) {
+            lexer_advance(lexer); // Empty statement
+            continue;
+        }
+        size_t item_start = lexer->token_start;
+        syntax_node *item = parse_parallel(lexer);
+        if (!item) return NULL;
+
+        if (lexer->current_type == TOKEN_BACKGROUND) {
+            syntax_node *background = new_syntax_node(lexer, NODE_BACKGROUND);
+            size_t item_length = lexer->token_start - item_start;
+            while (item_length > 0 && isspace((unsigned char)lexer->input_text[item_start + item_length - 1]))
+                item_length--;
+            background->source_text = arena_strndup(lexer->arena, lexer->input_text + item_start, item_length);
+            background->left = item;
+            item = background;
+            lexer_advance(lexer);
+        } else if (lexer->current_type == TOKEN_SEMICOLON || lexer->current_type == TOKEN_NEWLINE) {
+            lexer_advance(lexer);
+        } else if (lexer->current_type != TOKEN_END) {
+            return parse_syntax_error(lexer);
+        }
+
+        if (list) { // Chain statements left to right
+            syntax_node *sequence = new_syntax_node(lexer, NODE_SEQUENCE);
+            sequence->left = list;
+            sequence->right = item;
+            item = sequence;
+        }
+        list = item;
+    }
+    return lexer->syntax_error ? NULL : list;
+}
+
+// Parses one command line into an AST allocated in the arena. Returns NULL
+// for an empty line or after reporting a syntax error (*parse_failed set).
+// *parse_failed is PARSE_INCOMPLETE, with nothing reported, when the text
+// ends inside a command that further lines could complete.
+syntax_node* parse_command_line(memory_arena *arena, const char *line_text, int *parse_failed) {
+    command_lexer lexer = {0};
+    lexer.input_text = line_text;
+    lexer.arena = arena;
+    lexer_advance(&lexer);
+    syntax_node *command_tree = parse_list(&lexer);
+    if (!lexer.syntax_error && lexer.pending_document_count) { // Line ended before the bodies
+        lexer.current_type = TOKEN_END;
+        report_syntax_error(&lexer, "here-document not terminated by", lexer.pending_documents[0]->target_word);
+    }
+    *parse_failed = lexer.incomplete ? PARSE_INCOMPLETE : lexer.syntax_error;
+    return lexer.syntax_error ? NULL : command_tree;
+}
+
+// ======== SHELL VARIABLES ======== //
+
+unsigned int hash_variable_name(const char *variable_name, size_t name_length) {
+    unsigned int hash_value = 2166136261u; // FNV-1a
+    for (size_t char_index = 0; char_index < name_length; char_index++) {
+        hash_value ^= (unsigned char)variable_name[char_index];
+        hash_value *= 16777619u;
+    }
+    return hash_value;
+}
+
+// Slot holding the name, or the empty slot where it would go
+shell_variable* find_variable_slot(const char *variable_name, size_t name_length, unsigned int name_hash) {
+    unsigned int slot_mask = variable_table_capacity - 1;
+    for (unsigned int slot = name_hash & slot_mask; ; slot = (slot + 1) & slot_mask) {
+        shell_variable *variable = &variable_table[slot];
+        if (!variable->variable_name) return variable;
+        if (variable->name_hash == name_hash && strncmp(variable->variable_name, variable_name, name_length) == 0 &&
+            variable->variable_name[name_length] == '\0')
+            return variable;
+    }
+}
+
+shell_variable* find_variable_entry(const char *variable_name, size_t name_length) {
+    if (!variable_count) return NULL;
+    shell_variable *variable =
+        find_variable_slot(variable_name, name_length, hash_variable_name(variable_name, name_length));
+    return variable->variable_name ? variable : NULL;
+}
+
+// Value of $NAME (NULL if unset). The environment was imported at startup,
+// so one table lookup covers both.
+const char* find_shell_variable(const char *variable_name, size_t name_length) {
+    shell_variable *variable = find_variable_entry(variable_name, name_length);
+    return variable ? variable->variable_value : NULL;
+}
+
+// Doubles the table once it is 3/4 full, keeping probe runs short
+void grow_variable_table() {
+    int old_capacity = variable_table_capacity;
+    shell_variable *old_table = variable_table;
+    int new_capacity = old_capacity ? old_capacity * 2 : VARIABLE_TABLE_MIN_CAPACITY;
+    shell_variable *new_table = calloc(new_capacity, sizeof(shell_variable));
+    if (!new_table) {
+        perror("Variable table allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    variable_table = new_table;
+    variable_table_capacity = new_capacity;
+    for (int slot = 0; slot < old_capacity; slot++) {
+        shell_variable *variable = &old_table[slot];
+        if (!variable->variable_name) continue;
+        *find_variable_slot(variable->variable_name, strlen(variable->variable_name), variable->name_hash) = *variable;
+    }
+    free(old_table);
+}
+
+// Adds a "NAME=value" string to the exported environment and returns its
+// slot. The array is only reallocated when it fills, so spawning never
+// builds an environment.
+int add_environment_entry(char *assignment_text) {
+    if (environment_count + 1 >= environment_capacity) {
+        int new_capacity = environment_capacity ? environment_capacity * 2 : 64;
+        char **grown_environment = realloc(shell_environment, new_capacity * sizeof(char *));
+        if (!grown_environment) {
+            perror("Environment allocation failed");
             exit(EXIT_FAILURE);
         }
-    } else { // Parent process waits for child completion
-        wait(NULL);
+        shell_environment = grown_environment;
+        environment_capacity = new_capacity;
+    }
+    shell_environment[environment_count] = assignment_text;
+    shell_environment[environment_count + 1] = NULL;
+    environ = shell_environment; // getenv and posix_spawn both read it
+    return environment_count++;
+}
+
+// Sets a shell variable. An exported variable's environment slot is pointed
+// at the new "NAME=value" string in place; export_variable exports it.
+void set_shell_variable(const char *variable_name, const char *variable_value, int export_variable) {
+    size_t name_length = strlen(variable_name), value_length = strlen(variable_value);
+    if ((variable_count + 1) * 4 > variable_table_capacity * 3) grow_variable_table();
+    unsigned int name_hash = hash_variable_name(variable_name, name_length);
+    shell_variable *variable = find_variable_slot(variable_name, name_length, name_hash);
+    char *assignment_text = malloc(name_length + value_length + 2); // The old value may be what is being assigned
+    if (!assignment_text) return;
+    memcpy(assignment_text, variable_name, name_length);
+    assignment_text[name_length] = '=';
+    memcpy(assignment_text + name_length + 1, variable_value, value_length + 1);
+
+    if (!variable->variable_name) {
+        variable->variable_name = strndup(variable_name, name_length);
+        variable->name_hash = name_hash;
+        variable->environment_index = -1;
+        variable->assignment_text = NULL;
+        variable_count++;
+    }
+    free(variable->assignment_text);
+    variable->assignment_text = assignment_text;
+    variable->variable_value = assignment_text + name_length + 1;
+    if (variable->environment_index >= 0) shell_environment[variable->environment_index] = assignment_text;
+    else if (export_variable) variable->environment_index = add_environment_entry(assignment_text);
+    if (variable->environment_index >= 0 && strcmp(variable_name, "PATH") == 0)
+        clear_command_hash(); // Cached plans must re-resolve
+}
+
+// Moves the inherited environment into the variable table, after which
+// environ is the shell's own array
+void import_environment() {
+    char **inherited_environment = environ;
+    environment_capacity = 64;
+    shell_environment = calloc(environment_capacity, sizeof(char *));
+    if (!shell_environment) {
+        perror("Environment allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    for (char **entry = inherited_environment; *entry; entry++) {
+        char *equals_sign = strchr(*entry, '=');
+        if (!equals_sign || equals_sign == *entry) continue;
+        char *variable_name = strndup(*entry, equals_sign - *entry);
+        if (!variable_name) continue;
+        set_shell_variable(variable_name, equals_sign + 1, 1);
+        free(variable_name);
+    }
+    environ = shell_environment;
+}
+
+int is_assignment_word(const char *word) {
+    const char *equals_sign = strchr(word, '=');
+    return equals_sign && is_valid_identifier(word, equals_sign - word);
+}
+
+// Environment for an external command run with NAME=value prefixes: the
+// shell's environment with those names replaced or added
+char** build_command_environment(memory_arena *arena, char **assignments, int assignment_count) {
+    int environment_count = 0;
+    while (environ[environment_count]) environment_count++;
+    char **environment = arena_alloc(arena, (environment_count + assignment_count + 1) * sizeof(char *));
+    memcpy(environment, environ, environment_count * sizeof(char *));
+    for (int assignment_index = 0; assignment_index < assignment_count; assignment_index++) {
+        char *assignment = assignments[assignment_index];
+        size_t name_length = strchr(assignment, '=') - assignment + 1; // Name and '='
+        int variable_index = 0;
+        while (variable_index < environment_count && strncmp(environment[variable_index], assignment, name_length) != 0)
+            variable_index++;
+        environment[variable_index] = assignment;
+        if (variable_index == environment_count) environment_count++;
+    }
+    environment[environment_count] = NULL;
+    return environment;
+}
+
+// ======== GLOBBING ======== //
+
+void clear_listing_cache() {
+    for (int bucket = 0; bucket < LISTING_CACHE_BUCKETS; bucket++) {
+        directory_listing *listing = listing_cache_table[bucket];
+        while (listing) {
+            directory_listing *next_listing = listing->next_listing;
+            free(listing->entries);
+            free(listing->name_storage);
+            free(listing);
+            listing = next_listing;
+        }
+        listing_cache_table[bucket] = NULL;
+    }
+    listing_cache_count = 0;
+}
+
+int compare_listing_entries(const void *first, const void *second) {
+    return strcmp(((const listing_entry *)first)->entry_name, ((const listing_entry *)second)->entry_name);
+}
+
+// Reads a directory with raw getdents64 calls into one block of names and
+// sorts the entries. Returns -1 if it cannot be opened.
+int read_directory_listing(const char *directory_path, directory_listing *listing) {
+    int directory_fd = open(*directory_path ? directory_path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (directory_fd < 0) return -1;
+    struct linux_dirent64 {
+        ino64_t d_ino;
+        off64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[];
+    };
+    char *read_buffer = malloc(DIRECTORY_READ_SIZE);
+    size_t storage_length = 0, storage_capacity = DIRECTORY_READ_SIZE;
+    char *name_storage = malloc(storage_capacity);
+    size_t *name_offsets = NULL; // Names move while the storage grows, so pointers are set at the end
+    listing_entry *entries = NULL;
+    int entry_count = 0, entry_capacity = 0;
+    long read_bytes = 0;
+    while (read_buffer && name_storage &&
+           (read_bytes = syscall(SYS_getdents64, directory_fd, read_buffer, DIRECTORY_READ_SIZE)) > 0) {
+        for (long offset = 0; offset < read_bytes; ) {
+            struct linux_dirent64 *directory_entry = (struct linux_dirent64 *)(read_buffer + offset);
+            offset += directory_entry->d_reclen;
+            const char *name = directory_entry->d_name;
+            if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]))) continue;
+            size_t name_size = strlen(name) + 1;
+            if (storage_length + name_size > storage_capacity) {
+                while (storage_length + name_size > storage_capacity) storage_capacity *= 2;
+                char *grown_storage = realloc(name_storage, storage_capacity);
+                if (!grown_storage) break;
+                name_storage = grown_storage;
+            }
+            if (entry_count == entry_capacity) {
+                entry_capacity = entry_capacity ? entry_capacity * 2 : 256;
+                listing_entry *grown_entries = realloc(entries, entry_capacity * sizeof(listing_entry));
+                size_t *grown_offsets = realloc(name_offsets, entry_capacity * sizeof(size_t));
+                if (grown_entries) entries = grown_entries;
+                if (grown_offsets) name_offsets = grown_offsets;
+                if (!grown_entries || !grown_offsets) break;
+            }
+            memcpy(name_storage + storage_length, name, name_size);
+            name_offsets[entry_count] = storage_length;
+            entries[entry_count++].entry_type = directory_entry->d_type;
+            storage_length += name_size;
+        }
+    }
+    close(directory_fd);
+    free(read_buffer);
+    for (int entry_index = 0; entry_index < entry_count; entry_index++)
+        entries[entry_index].entry_name = name_storage + name_offsets[entry_index];
+    free(name_offsets);
+    if (entry_count > 1) qsort(entries, entry_count, sizeof(listing_entry), compare_listing_entries);
+
+    listing->entries = entries;
+    listing->entry_count = entry_count;
+    listing->name_storage = name_storage;
+    listing_cache_scans++;
+    return 0;
+}
+
+// Returns the sorted entries of a directory ("" is the current one). A
+// cached listing is reused while the directory's mtime is unchanged, so
+// globbing a large, unchanging directory again costs one stat. Listings
+// read in the second the directory last changed are read again next time,
+// since a change within the same timestamp tick would not move the mtime.
+directory_listing* find_directory_listing(const char *directory_path) {
+    struct stat directory_info;
+    if (stat(*directory_path ? directory_path : ".", &directory_info) < 0 || !S_ISDIR(directory_info.st_mode))
+        return NULL;
+    directory_listing **bucket =
+        &listing_cache_table[(directory_info.st_ino ^ directory_info.st_dev) % LISTING_CACHE_BUCKETS];
+    directory_listing *listing = *bucket;
+    while (listing && (listing->inode != directory_info.st_ino || listing->device != directory_info.st_dev))
+        listing = listing->next_listing;
+    if (listing && (listing->checked_walk == glob_walk_number ||
+                    (!listing->racy && listing->modified_time.tv_sec == directory_info.st_mtim.tv_sec &&
+                     listing->modified_time.tv_nsec == directory_info.st_mtim.tv_nsec))) {
+        listing->checked_walk = glob_walk_number;
+        listing_cache_hits++;
+        return listing;
+    }
+
+    if (listing) { // Changed since it was read: only this walk can hold its entries, and it has not
+        free(listing->entries);
+        free(listing->name_storage);
+    } else {
+        listing = calloc(1, sizeof(directory_listing));
+        if (!listing) return NULL;
+        listing->device = directory_info.st_dev;
+        listing->inode = directory_info.st_ino;
+        listing->next_listing = *bucket;
+        *bucket = listing;
+        listing_cache_count++;
     }
+    listing->entries = NULL;
+    listing->entry_count = 0;
+    listing->name_storage = NULL;
+    listing->modified_time = directory_info.st_mtim;
+    listing->checked_walk = glob_walk_number;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    listing->racy = (now.tv_sec <= directory_info.st_mtim.tv_sec + 1);
+    if (read_directory_listing(directory_path, listing) < 0) listing->racy = 1;
+    return listing;
 }
 
-int validate_argument_count(char *cmd_text) {
-    char temp_buffer[100]; // Temporary buffer for tokenization
-    strcpy(temp_buffer, cmd_text);
-    char *parameters[20];
-    char *current_token = strtok(temp_buffer, " ");
-    int param_index = 0;
-    
-    while (current_token) { // Count command arguments
-        if (param_index >= MAX_PARAMETERS) return -1; // Too many parameters
-        parameters[param_index++] = current_token;
-        current_token = strtok(NULL, " ");
+// True when a pattern has a '*', '?' or '[...]' not escaped by a backslash.
+// A '[' without a closing ']' is literal, so '[ -f x ]' stays a plain word.
+int pattern_has_glob(const char *pattern) {
+    for (const char *cursor = pattern; *cursor; cursor++) {
+        if (*cursor == '\\' && cursor[1]) cursor++;
+        else if (*cursor == '*' || *cursor == '?') return 1;
+        else if (*cursor == '[' && strchr(cursor + 1, ']')) return 1;
     }
-    return (param_index < 1) ? -1 : 0; // Return error if no command found
+    return 0;
 }
 
-void run_command_direct(char *cmd_text) {
-    char *parameters[MAX_PARAMETERS]; // Prepare argument array
-    char *current_token = strtok(cmd_text, " ");
-    int param_index = 0;
-    
-    while (current_token && param_index < MAX_PARAMETERS - 1) {
-        parameters[param_index++] = current_token; // Parse command arguments
-        current_token = strtok(NULL, " ");
-    }
-    parameters[param_index] = NULL; // Null-terminate for exec
-    
-    if (execvp(parameters[0], parameters) == -1) { // Direct execution without fork
-        perror("Execution failed");
-        exit(EXIT_FAILURE);
+// Same test on an expanded field, where only unquoted characters count
+int field_has_glob(const expansion_buffer *buffer, size_t field_start, size_t field_end) {
+    for (size_t char_index = field_start; char_index < field_end; char_index++) {
+        if (!(buffer->character_flags[char_index] & EXPANSION_UNQUOTED)) continue;
+        char character = buffer->text[char_index];
+        if (character == '*' || character == '?') return 1;
+        if (character == '[' && memchr(buffer->text + char_index + 1, ']', field_end - char_index - 1)) return 1;
     }
+    return 0;
 }
 
-int create_new_terminal() {
-    char *terminal_args[] = {"xterm", "-e", "./mbash25", NULL}; // Terminal launch arguments
-    pid_t child_process = fork();    
-    if (child_process == 0) { // Child launches new terminal
-        execvp("xterm", terminal_args);
-        perror("execvp failed");
-        exit(EXIT_FAILURE);
-    } else if (child_process == -1) { // Fork failed
-        perror("Fork error");
-        return -1;
+// Turns an expanded field into a pattern: quoted glob characters and every
+// backslash get a backslash, so they only match themselves
+char* glob_pattern(memory_arena *arena, const expansion_buffer *buffer, size_t field_start, size_t field_end) {
+    char *pattern = arena_alloc(arena, 2 * (field_end - field_start) + 1), *output = pattern;
+    for (size_t char_index = field_start; char_index < field_end; char_index++) {
+        char character = buffer->text[char_index];
+        if (character == '\\' ||
+            (!(buffer->character_flags[char_index] & EXPANSION_UNQUOTED) && strchr("*?[]", character)))
+            *output++ = '\\';
+        *output++ = character;
     }
-    return 0; // Success
+    *output = '\0';
+    return pattern;
+}
+
+// Characters before a segment's first glob or escape, which every match starts with
+size_t literal_prefix_length(const char *segment) {
+    return strcspn(segment, "*?[\\");
 }
 
-// ======== PIPING IMPLEMENTATION ======== //
+char* join_glob_path(memory_arena *arena, const char *directory_path, const char *name, size_t name_length,
+                     int add_slash) {
+    size_t path_length = strlen(directory_path);
+    char *path = arena_alloc(arena, path_length + name_length + 2);
+    memcpy(path, directory_path, path_length);
+    memcpy(path + path_length, name, name_length);
+    if (add_slash) path[path_length + name_length++] = '/';
+    path[path_length + name_length] = '\0';
+    return path;
+}
 
-void handle_piped_commands(char *cmd_text) {
-    int total_pipes = -1; // Counter for number of pipes needed
-    char *individual_commands[20]; // Array to store individual commands
-    char *current_token = strtok(cmd_text, "|"); // Split by pipe character
-    int cmd_index = 0;
-    while (current_token) {
-        individual_commands[cmd_index++] = current_token; // Store each command
-        total_pipes++; // Count pipes (commands - 1)
-        current_token = strtok(NULL, "|");
-    }
+// True when a listing entry may be a directory to descend into. '**' does
+// not follow symbolic links, like bash's globstar.
+int glob_entry_is_directory(const char *path, unsigned char entry_type, int follow_links) {
+    if (entry_type == DT_DIR) return 1;
+    if (entry_type != DT_UNKNOWN && (entry_type != DT_LNK || !follow_links)) return 0;
+    struct stat entry_info;
+    int stat_result = follow_links ? stat(path, &entry_info) : lstat(path, &entry_info);
+    return stat_result == 0 && S_ISDIR(entry_info.st_mode);
+}
 
-    int original_stdin = dup(STDIN_FILENO); // Save original stdin/stdout
-    int original_stdout = dup(STDOUT_FILENO);
-    int main_shell_pid = getpid(); // Get parent process ID
-    int pipe_descriptors[total_pipes][2]; // Array of pipe file descriptors
-    int total_commands = total_pipes + 1;
+// Matches segments[segment_index...] below directory_path ("" or ending
+// in '/'), appending matching paths in the directory's sorted order
+void match_glob_segments(glob_search *search, const char *directory_path, int segment_index) {
+    const char *segment = search->segments[segment_index];
+    int last_segment = (segment_index == search->segment_count - 1);
 
-    // Create all required pipes
-    for(int pipe_counter = 0; pipe_counter < total_pipes; pipe_counter++) {
-        if(main_shell_pid == getpid()) { // Only parent creates pipes
-            int pipe_fd[2];
-            pipe(pipe_fd); // Create pipe
-            pipe_descriptors[pipe_counter][0] = pipe_fd[0]; // Read end
-            pipe_descriptors[pipe_counter][1] = pipe_fd[1]; // Write end
+    if (!pattern_has_glob(segment)) { // Literal: no need to read the directory
+        char *name = arena_alloc(search->arena, strlen(segment) + 1), *output = name;
+        for (const char *cursor = segment; *cursor; cursor++) {
+            if (*cursor == '\\' && cursor[1]) cursor++;
+            *output++ = *cursor;
         }
+        *output = '\0';
+        char *path = join_glob_path(search->arena, directory_path, name, output - name, !last_segment);
+        struct stat path_info;
+        if (!last_segment) match_glob_segments(search, path, segment_index + 1);
+        else if (lstat(path, &path_info) == 0)
+            search->matches = (char **)append_to_array(search->arena, (void **)search->matches,
+                                                       search->match_count++, &search->match_capacity, path);
+        return;
     }
 
-    int pipe_index = 0;
-    for(int cmd_counter = 0; cmd_counter < total_commands; cmd_counter++) {
-        if(validate_argument_count(individual_commands[cmd_counter]) == -1) {
-            printf("Invalid argument count\n");
-            return;
-        }
-        
-        pid_t process_id = fork(); // Fork for each command
-        if (process_id == 0) { // Child process setup
-            // First command - output to first pipe
-            if(cmd_counter == 0) {
-                dup2(pipe_descriptors[pipe_index][1], STDOUT_FILENO);
-                for (int fd_index = 0; fd_index < total_pipes; fd_index++) {
-                    close(pipe_descriptors[fd_index][0]); // Close unused read ends
-                    if(fd_index != pipe_index) close(pipe_descriptors[fd_index][1]);
-                }
-            }
-            // Last command - input from last pipe
-            else if(cmd_counter == total_commands-1) {
-                dup2(pipe_descriptors[pipe_index-1][0], STDIN_FILENO);
-                for (int fd_index = 0; fd_index < total_pipes; fd_index++) {
-                    close(pipe_descriptors[fd_index][1]); // Close unused write ends
-                    if(fd_index != pipe_index-1) close(pipe_descriptors[fd_index][0]);
-                }
-            }
-            // Middle commands - input from previous, output to next pipe
-            else {
-                dup2(pipe_descriptors[pipe_index-1][0], STDIN_FILENO);
-                dup2(pipe_descriptors[pipe_index][1], STDOUT_FILENO);
-                for (int fd_index = 0; fd_index < total_pipes; fd_index++) {
-                    if(fd_index != pipe_index-1) close(pipe_descriptors[fd_index][0]);
-                    if(fd_index != pipe_index) close(pipe_descriptors[fd_index][1]);
-                }
-            }
-            
-            run_command_direct(individual_commands[cmd_counter]); // Execute command
+    int recursive = (strcmp(segment, "**") == 0);
+    if (recursive) match_glob_segments(search, directory_path, segment_index + 1); // '**' as no directories
+    directory_listing *listing = find_directory_listing(directory_path);
+    if (!listing) return;
+
+    // The listing is sorted, so the names sharing the literal prefix are one run found by binary search
+    size_t prefix_length = recursive ? 0 : literal_prefix_length(segment);
+    int first_entry = 0, last_entry = listing->entry_count;
+    while (first_entry < last_entry) {
+        int middle_entry = first_entry + (last_entry - first_entry) / 2;
+        if (strncmp(listing->entries[middle_entry].entry_name, segment, prefix_length) < 0)
+            first_entry = middle_entry + 1;
+        else
+            last_entry = middle_entry;
+    }
+    for (int entry_index = first_entry; entry_index < listing->entry_count; entry_index++) {
+        listing_entry *entry = &listing->entries[entry_index];
+        if (strncmp(entry->entry_name, segment, prefix_length) != 0) break;
+        if (entry->entry_name[0] == '.' && segment[0] != '.') continue; // Hidden unless asked for
+        if (!recursive && fnmatch(segment, entry->entry_name, 0) != 0) continue;
+        size_t name_length = strlen(entry->entry_name);
+        if (last_segment && !recursive) {
+            char *path = join_glob_path(search->arena, directory_path, entry->entry_name, name_length, 0);
+            search->matches = (char **)append_to_array(search->arena, (void **)search->matches,
+                                                       search->match_count++, &search->match_capacity, path);
+            continue;
         }
-        pipe_index++;
+        if (entry->entry_type != DT_DIR && entry->entry_type != DT_UNKNOWN && entry->entry_type != DT_LNK)
+            continue; // Cannot hold the next segment
+        char *path = join_glob_path(search->arena, directory_path, entry->entry_name, name_length, 1);
+        if (recursive && !glob_entry_is_directory(path, entry->entry_type, 0)) continue;
+        match_glob_segments(search, path, recursive ? segment_index : segment_index + 1);
     }
+}
 
-    // Close all pipes in parent process
-    for (int fd_index = 0; fd_index < total_pipes; fd_index++) {
-        close(pipe_descriptors[fd_index][0]);
-        close(pipe_descriptors[fd_index][1]);
-    }
+int compare_glob_matches(const void *first, const void *second) {
+    return strcmp(*(char * const *)first, *(char * const *)second);
+}
 
-    // Wait for all child processes to complete
-    for (int cmd_counter = 0; cmd_counter < total_commands; cmd_counter++) {
-        wait(NULL);
+// Appends the paths matching a pattern to an argument vector, sorted.
+// Returns how many matched; with none the caller keeps the word as typed.
+int expand_glob(memory_arena *arena, char *pattern, char ***arguments, int *argument_count, int *argument_capacity) {
+    if (listing_cache_count > LISTING_CACHE_LIMIT) clear_listing_cache(); // Never during a walk
+    glob_walk_number++;
+    glob_search search = {arena, NULL, 0, *arguments, *argument_count, *argument_capacity};
+    int segment_capacity = 0;
+    char *cursor = pattern;
+    const char *directory_path = "";
+    if (*cursor == '/') {
+        directory_path = "/";
+        while (*cursor == '/') cursor++;
     }
+    while (1) {
+        char *separator = strchr(cursor, '/');
+        if (separator) *separator = '\0';
+        search.segments = (char **)append_to_array(arena, (void **)search.segments, search.segment_count++,
+                                                   &segment_capacity, cursor);
+        if (!separator) break;
+        cursor = separator + 1;
+    }
+    if (strcmp(search.segments[search.segment_count - 1], "**") == 0) // A final '**' lists everything below
+        search.segments = (char **)append_to_array(arena, (void **)search.segments, search.segment_count++,
+                                                   &segment_capacity, "*");
 
-    // Restore original stdin/stdout
-    dup2(original_stdin, STDIN_FILENO);
-    dup2(original_stdout, STDOUT_FILENO);
-    close(original_stdin);
-    close(original_stdout);
+    int first_match = search.match_count;
+    match_glob_segments(&search, directory_path, 0);
+    int match_total = search.match_count - first_match;
+    if (match_total > 1 && search.segment_count > 1) // One directory's matches are already in order
+        qsort(search.matches + first_match, match_total, sizeof(char *), compare_glob_matches);
+    *arguments = search.matches;
+    *argument_count = search.match_count;
+    *argument_capacity = search.match_capacity;
+    return match_total;
 }
 
-// ======== NEW FUNCTIONALITY ======== //
+// ======== EXPANSION ======== //
 
-void process_word_counter(char *cmd_text) {
-    char *file_list[5]; // Array to store file names
-    char *current_token = strtok(cmd_text, " ");
-    int file_index = 0;
-    
-    while (current_token) {
-        if (strcmp(current_token, "#") != 0) // Skip the '#' operator
-            file_list[file_index++] = current_token;
-        current_token = strtok(NULL, " ");
-    }
-    file_list[file_index] = NULL;
-    
-    if (file_index > 4 || file_index < 1) { // Validate file count
-        printf("Invalid file count (1-4 allowed)\n");
-        return;
-    }
-    
-    for (int file_counter = 0; file_counter < file_index; file_counter++) {
-        pid_t process_id = fork();
-        if (process_id == 0) { // Child executes wc for each file
-            execlp("wc", "wc", "-w", file_list[file_counter], NULL);
-            perror("wc failed");
+void append_expansion(expansion_buffer *buffer, const char *text, size_t length, int flags) {
+    if (buffer->length + length + 1 > buffer->capacity) {
+        size_t new_capacity = buffer->capacity ? buffer->capacity * 2 : 64;
+        while (new_capacity < buffer->length + length + 1) new_capacity *= 2;
+        char *grown_text = realloc(buffer->text, new_capacity);
+        char *grown_mask = realloc(buffer->character_flags, new_capacity);
+        if (grown_text) buffer->text = grown_text;
+        if (grown_mask) buffer->character_flags = grown_mask;
+        if (!grown_text || !grown_mask) {
+            perror("Expansion failed");
             exit(EXIT_FAILURE);
-        } else {
-            wait(NULL); // Wait for word count completion
         }
+        buffer->capacity = new_capacity;
     }
+    memcpy(buffer->text + buffer->length, text, length);
+    memset(buffer->character_flags + buffer->length, flags, length);
+    buffer->length += length;
 }
 
-void process_file_concatenation(char *cmd_text) {
-    char *file_list[6]; // Array to store file names for concatenation
-    char *current_token = strtok(cmd_text, " ");
-    int file_index = 0;
-    
-    while (current_token) {
-        if (strcmp(current_token, "++") != 0) // Skip the '++' operator
-            file_list[file_index++] = current_token;
-        current_token = strtok(NULL, " ");
+// Runs the command line in "$(...)" in a forked shell and returns its
+// output without trailing newlines. The output is read from a pipe into a
+// buffer that doubles as it fills; nothing goes through a file.
+char* substitute_command(memory_arena *arena, const char *command_text, size_t text_length) {
+    int parse_failed;
+    syntax_node *command_tree = parse_command_line(arena, arena_strndup(arena, command_text, text_length),
+                                                   &parse_failed);
+    if (parse_failed == PARSE_INCOMPLETE) report_incomplete_command();
+    int output_pipe[2];
+    if (!command_tree) return "";
+    if (pipe2(output_pipe, O_CLOEXEC) < 0) {
+        perror("Pipe failed");
+        return "";
     }
-    file_list[file_index] = NULL;
-    
-    if (file_index > 5 || file_index < 2) { // Validate file count
-        printf("Invalid file count (2-5 allowed)\n");
-        return;
+    stage_wiring wiring = {-1, output_pipe[1], output_pipe[0], -1, 1, 0};
+    pid_t process_id = fork_shell_child(&wiring);
+    if (process_id == 0) {
+        int exit_status = execute_node(arena, command_tree);
+        exit_shell_child(exit_status);
     }
-    
-    pid_t process_id = fork();
-    if (process_id == 0) { // Child executes cat with all files
-        execvp("cat", file_list);
-        perror("cat failed");
-        exit(EXIT_FAILURE);
-    } else {
-        wait(NULL); // Wait for concatenation completion
+    close(output_pipe[1]);
+
+    size_t output_length = 0, output_capacity = SUBSTITUTION_BUFFER_SIZE;
+    char *output = malloc(output_capacity);
+    while (output) {
+        if (output_length + 1 == output_capacity) {
+            char *grown = realloc(output, output_capacity * 2);
+            if (!grown) break;
+            output = grown;
+            output_capacity *= 2;
+        }
+        ssize_t read_bytes = read(output_pipe[0], output + output_length, output_capacity - output_length - 1);
+        if (read_bytes < 0 && errno == EINTR) continue;
+        if (read_bytes <= 0) break;
+        output_length += read_bytes;
     }
+    close(output_pipe[0]);
+    if (process_id > 0) wait_for_command(process_id);
+    if (!output) return "";
+    while (output_length > 0 && output[output_length - 1] == '\n') output_length--;
+    char *result = arena_strndup(arena, output, output_length);
+    free(output);
+    return result;
 }
 
-void process_mutual_file_append(char *cmd_text) {
-    char *file_list[3]; // Array for exactly two files
-    char *current_token = strtok(cmd_text, " ");
-    int file_index = 0;
-    
-    while (current_token && file_index < 2) {
-        if (strcmp(current_token, "+") != 0) // Skip the '+' operator
-            file_list[file_index++] = current_token;
-        current_token = strtok(NULL, " ");
+// Expands "${name}", "${name-word}" or "${name:-word}" (the word when name
+// is unset, or with ':' also when it is empty). The word is expanded like
+// the rest of the text, so it may hold quotes and further expansions.
+void expand_braced_variable(memory_arena *arena, const char *text, size_t consumed, expansion_buffer *buffer,
+                            int quoted) {
+    size_t name_length = 0;
+    while (isalnum((unsigned char)text[2 + name_length]) || text[2 + name_length] == '_') name_length++;
+    const char *operator = text + 2 + name_length, *closing_brace = text + consumed - 1;
+    int colon = (*operator == ':');
+    if (!is_valid_identifier(text + 2, name_length) || (operator != closing_brace && operator[colon] != '-')) {
+        fprintf(stderr, "mbash25: %.*s: bad substitution\n", (int)consumed, text);
+        return;
     }
-    file_list[2] = NULL;
-    
-    if (file_index != 2) { // Exactly two files required
-        printf("Exactly two files required\n");
+    const char *value = find_shell_variable(text + 2, name_length);
+    if (operator == closing_brace || (value && (*value || !colon))) {
+        if (value) append_expansion(buffer, value, strlen(value), quoted ? 0 : EXPANSION_SPLITTABLE | EXPANSION_UNQUOTED);
         return;
     }
-    
-    pid_t process_id = fork();
-    if (process_id == 0) { // Child handles file operations
-        
-        // Step 1: Append file2 to file1
-        FILE *second_file = fopen(file_list[1], "r");
-        if (!second_file) {
-            perror("Open failed");
-            exit(EXIT_FAILURE);
-        }
-        
-        FILE *first_file_append = fopen(file_list[0], "a");
-        if (!first_file_append) {
-            perror("Open failed");
-            fclose(second_file);
-            exit(EXIT_FAILURE);
+    const char *default_word = operator + colon + 1;
+    char *word_copy = arena_strndup(arena, default_word, closing_brace - default_word);
+    if (quoted) {
+        char *expanded_word = expand_text(arena, word_copy, 0);
+        append_expansion(buffer, expanded_word, strlen(expanded_word), 0);
+    } else { // Unquoted blanks in the word separate fields too
+        expansion_buffer word_buffer = {0};
+        expand_into_buffer(arena, word_copy, 0, &word_buffer);
+        for (size_t char_index = 0; char_index < word_buffer.length; char_index++) {
+            int flags = word_buffer.character_flags[char_index];
+            append_expansion(buffer, word_buffer.text + char_index, 1,
+                             (flags & EXPANSION_UNQUOTED) ? flags | EXPANSION_SPLITTABLE : flags);
         }
-        
-        char data_buffer[4096]; // Buffer for file content transfer
-        size_t read_bytes;
-        while ((read_bytes = fread(data_buffer, 1, sizeof(data_buffer), second_file)) > 0) {
-            fwrite(data_buffer, 1, read_bytes, first_file_append); // Copy data
-        }
-        
-        fclose(second_file);
-        fclose(first_file_append);
-        
-        // Step 2: Append updated file1 to file2
-        FILE *first_file_read = fopen(file_list[0], "r");
-        if (!first_file_read) {
-            perror("Open failed");
-            exit(EXIT_FAILURE);
-        }
-        
-        FILE *second_file_append = fopen(file_list[1], "a");
-        if (!second_file_append) {
-            perror("Open failed");
-            fclose(first_file_read);
-            exit(EXIT_FAILURE);
+        buffer->has_quotes |= word_buffer.has_quotes;
+        free(word_buffer.text);
+        free(word_buffer.character_flags);
+    }
+}
+
+// Expands the "$name", "${...}", "$(command)", "$?", "$$" or "$!" at text
+// into the buffer. Returns the characters consumed, or 0 when the '$' is
+// literal.
+size_t expand_dollar(memory_arena *arena, const char *text, expansion_buffer *buffer, int quoted) {
+    const char *value = NULL;
+    size_t consumed = 0;
+    char number_text[24];
+    if (text[1] == '(') {
+        if (!(consumed = skip_substitution(text, 0))) return 0;
+        value = substitute_command(arena, text + 2, consumed - 3);
+    } else if (text[1] == '{') {
+        if (!(consumed = skip_substitution(text, 0))) return 0;
+        expand_braced_variable(arena, text, consumed, buffer, quoted);
+        return consumed;
+    } else if (text[1] == '?' || text[1] == '$' || text[1] == '!') {
+        consumed = 2;
+        long number = (text[1] == '?') ? last_exit_status : (text[1] == '$') ? shell_process_id : last_background_id;
+        if (text[1] != '!' || last_background_id) {
+            snprintf(number_text, sizeof(number_text), "%ld", number);
+            value = number_text;
         }
-        
-        while ((read_bytes = fread(data_buffer, 1, sizeof(data_buffer), first_file_read)) > 0) {
-            fwrite(data_buffer, 1, read_bytes, second_file_append); // Copy data back
-        }
-        
-        fclose(first_file_read);
-        fclose(second_file_append);
-        
-        printf("Mutually appended %s and %s\n", file_list[0], file_list[1]);
-        exit(EXIT_SUCCESS);
-    } else if (process_id > 0) {
-        wait(NULL); // Wait for mutual append completion
+    } else if (isalpha((unsigned char)text[1]) || text[1] == '_') {
+        consumed = 2;
+        while (isalnum((unsigned char)text[consumed]) || text[consumed] == '_') consumed++;
+        value = find_shell_variable(text + 1, consumed - 1);
     } else {
-        perror("Fork failed");
+        return 0;
     }
+    if (value) append_expansion(buffer, value, strlen(value), quoted ? 0 : EXPANSION_SPLITTABLE | EXPANSION_UNQUOTED);
+    return consumed;
 }
 
-void handle_reversed_pipe(char *cmd_text) {
-    char *command_list[5]; // Array to store commands
-    char *current_token = strtok(cmd_text, "~"); // Split by tilde operator
-    int command_count = 0;
-    
-    while (current_token && command_count < 4) {
-        remove_whitespace(current_token); // Clean whitespace
-        command_list[command_count++] = current_token;
-        current_token = strtok(NULL, "~");
+// Expands one word into the buffer: quote removal plus $ expansions.
+// Here-document bodies keep their quotes and only '\' before $ \ ` escapes.
+void expand_into_buffer(memory_arena *arena, const char *word, int here_document, expansion_buffer *buffer) {
+    const char *cursor = word;
+    while (*cursor) {
+        size_t plain_length = strcspn(cursor, here_document ? "\\$" : "'\"\\$");
+        append_expansion(buffer, cursor, plain_length, here_document ? 0 : EXPANSION_UNQUOTED);
+        cursor += plain_length;
+        if (*cursor == '\'') { // Literal up to the closing quote
+            const char *closing_quote = strchrnul(cursor + 1, '\'');
+            append_expansion(buffer, cursor + 1, closing_quote - cursor - 1, 0);
+            cursor = *closing_quote ? closing_quote + 1 : closing_quote;
+            buffer->has_quotes = 1;
+        } else if (*cursor == '"') { // Backslash only escapes " \ $ ` inside double quotes
+            buffer->has_quotes = 1;
+            for (cursor++; *cursor && *cursor != '"'; ) {
+                size_t consumed;
+                if (*cursor == '\\' && cursor[1] && strchr("\"\\$`", cursor[1])) {
+                    append_expansion(buffer, cursor + 1, 1, 0);
+                    cursor += 2;
+                } else if (*cursor == '$' && (consumed = expand_dollar(arena, cursor, buffer, 1))) {
+                    cursor += consumed;
+                } else {
+                    append_expansion(buffer, cursor++, 1, 0);
+                }
+            }
+            if (*cursor) cursor++;
+        } else if (*cursor == '\\') {
+            if (!cursor[1]) {
+                append_expansion(buffer, cursor++, 1, 0);
+            } else if (here_document && !strchr("\\$`", cursor[1])) {
+                append_expansion(buffer, cursor, 2, 0);
+                cursor += 2;
+            } else {
+                append_expansion(buffer, cursor + 1, 1, 0);
+                cursor += 2;
+            }
+        } else if (*cursor == '$') {
+            size_t consumed = expand_dollar(arena, cursor, buffer, here_document);
+            if (consumed) cursor += consumed;
+            else append_expansion(buffer, cursor++, 1, here_document ? 0 : EXPANSION_UNQUOTED);
+        }
     }
-    command_list[command_count] = NULL;
-    
-    if (command_count < 2) { // Need at least two commands
-        printf("At least two commands required\n");
+}
+
+// Expands a word to one string: quote removal and $ expansions, without
+// splitting. Words with nothing to expand are returned as they are.
+char* expand_text(memory_arena *arena, char *word, int here_document) {
+    if (!strpbrk(word, here_document ? "\\$" : "'\"\\$")) return word;
+    expansion_buffer buffer = {0};
+    expand_into_buffer(arena, word, here_document, &buffer);
+    char *expanded = arena_strndup(arena, buffer.text ? buffer.text : "", buffer.length);
+    free(buffer.text);
+    free(buffer.character_flags);
+    return expanded;
+}
+
+char* expand_word(memory_arena *arena, char *word) {
+    return expand_text(arena, word, 0);
+}
+
+// Builds the NULL-terminated argument vector of a command (or the items of
+// a for loop). Text from unquoted $ expansions is split at blanks, so one
+// word may give several arguments or none, and each field with unquoted
+// glob characters is replaced by the sorted paths it matches. Leading
+// NAME=value words are neither split nor globbed.
+char** expand_arguments(memory_arena *arena, syntax_node *command, int *argument_count) {
+    *argument_count = command->word_count;
+    if (command->plan_arguments) return command->plan_arguments;
+    char **arguments = arena_alloc(arena, (command->word_count + 1) * sizeof(char *));
+    int argument_capacity = command->word_count + 1, count = 0;
+    int in_assignments = (command->type == NODE_COMMAND && command->kind == COMMAND_SIMPLE);
+    for (int word_index = 0; word_index < command->word_count; word_index++) {
+        char *word = command->words[word_index];
+        in_assignments = in_assignments && is_assignment_word(word);
+        if (in_assignments || !strpbrk(word, "$*?[")) {
+            arguments = (char **)append_to_array(arena, (void **)arguments, count++, &argument_capacity,
+                                                 expand_word(arena, word));
+            continue;
+        }
+        expansion_buffer buffer = {0};
+        expand_into_buffer(arena, word, 0, &buffer);
+        int fields_added = 0;
+        size_t field_start = 0;
+        for (size_t char_index = 0; char_index <= buffer.length; char_index++) {
+            int at_separator = (char_index == buffer.length) ||
+                               ((buffer.character_flags[char_index] & EXPANSION_SPLITTABLE) &&
+                                strchr(" \t\n", buffer.text[char_index]));
+            if (!at_separator) continue;
+            if (char_index > field_start) {
+                if (!field_has_glob(&buffer, field_start, char_index) ||
+                    !expand_glob(arena, glob_pattern(arena, &buffer, field_start, char_index),
+                                 &arguments, &count, &argument_capacity))
+                    arguments = (char **)append_to_array(arena, (void **)arguments, count++, &argument_capacity,
+                                                         arena_strndup(arena, buffer.text + field_start,
+                                                                       char_index - field_start));
+                fields_added++;
+            }
+            field_start = char_index + 1;
+        }
+        if (!fields_added && buffer.has_quotes) // "" and "$empty" still count
+            arguments = (char **)append_to_array(arena, (void **)arguments, count++, &argument_capacity, "");
+        free(buffer.text);
+        free(buffer.character_flags);
+    }
+    arguments[count] = NULL;
+    *argument_count = count;
+    return arguments;
+}
+
+// ======== PLAN CACHE ======== //
+
+// True when a word can only be expanded at run time
+int word_needs_expansion(const char *word) {
+    return strpbrk(word, "$`") != NULL || pattern_has_glob(word);
+}
+
+// Fills in the execution plan of every command in a cached tree: the
+// argument vector (when no word depends on run-time state), the builtin
+// it names and the binary it resolves to. Pipe topology and redirections
+// are already in the tree.
+void build_command_plans(memory_arena *arena, syntax_node *node) {
+    if (!node) return;
+    if (node->type != NODE_COMMAND) {
+        build_command_plans(arena, node->left);
+        build_command_plans(arena, node->right);
+        for (int stage_index = 0; stage_index < node->stage_count; stage_index++)
+            build_command_plans(arena, node->stages[stage_index]);
         return;
     }
-    
-    // Reverse command order for execution
-    for (int reverse_index = 0; reverse_index < command_count / 2; reverse_index++) {
-        char *temp_cmd = command_list[reverse_index];
-        command_list[reverse_index] = command_list[command_count - 1 - reverse_index];
-        command_list[command_count - 1 - reverse_index] = temp_cmd;
+    for (int word_index = 0; word_index < node->word_count; word_index++)
+        if (word_needs_expansion(node->words[word_index])) return;
+    if (node->word_count && is_assignment_word(node->words[0])) return; // Expanded per run, like bash
+    int argument_count;
+    node->plan_arguments = expand_arguments(arena, node, &argument_count);
+    if (node->kind != COMMAND_SIMPLE || argument_count == 0) return;
+    node->plan_builtin = find_builtin(node->plan_arguments[0]);
+    if (!node->plan_builtin) { // Missing binaries are looked up again on each run
+        node->plan_path = resolve_command_path(node->plan_arguments[0]);
+        node->plan_path_generation = command_hash_generation;
     }
-    
-    // Build pipe command string from reversed commands
-    char piped_command[150] = "";
-    for (int build_index = 0; build_index < command_count; build_index++) {
-        strcat(piped_command, command_list[build_index]);
-        if (build_index < command_count - 1) strcat(piped_command, "|");
+}
+
+// Binary a planned command runs, or NULL to resolve it at spawn time. The
+// plan's path points into the command hash, so it is only trusted while the
+// hash has not been cleared or pruned since.
+const char* planned_program_path(syntax_node *command) {
+    if (!command->plan_arguments || command->plan_builtin) return NULL;
+    if (command->plan_path_generation != command_hash_generation || !command->plan_path) {
+        command->plan_path = resolve_command_path(command->plan_arguments[0]);
+        command->plan_path_generation = command_hash_generation;
     }
-    
-    handle_piped_commands(piped_command); // Execute as normal pipe
+    return command->plan_path;
 }
 
-// ======== BACKGROUND PROCESSES ======== //
+void clear_plan_cache() {
+    memset(plan_cache_table, 0, sizeof(plan_cache_table));
+    plan_cache_count = 0;
+    arena_reset(&plan_arena);
+}
 
-void manage_background_execution(char *cmd_text) {
-    if (strcmp(cmd_text, "fg") == 0) { // Foreground command
-        if (active_background_count > 0) {
-            pid_t process_id = background_task_ids[--active_background_count]; // Get last background process
-            waitpid(process_id, NULL, 0); // Bring to foreground
-            printf("Process %d brought to foreground\n", process_id);
-        } else {
-            printf("No background processes\n");
+// Returns the syntax tree of a command line, parsing it only the first
+// time the exact text is seen. Trees and plans live in plan_arena; a full
+// cache is dropped as a whole rather than evicted entry by entry. Lines
+// that fail to parse (or are still incomplete) are not cached, so their
+// errors are reported each time, and their nodes are released right away.
+syntax_node* find_command_plan(const char *line_text, int *parse_failed) {
+    unsigned int hash_value = 2166136261u; // FNV-1a over the raw line
+    for (const char *cursor = line_text; *cursor; cursor++) {
+        hash_value ^= (unsigned char)*cursor;
+        hash_value *= 16777619u;
+    }
+    command_plan **bucket = &plan_cache_table[hash_value % PLAN_CACHE_BUCKETS];
+    for (command_plan *plan = *bucket; plan; plan = plan->next_plan) {
+        if (plan->line_hash == hash_value && strcmp(plan->line_text, line_text) == 0) {
+            plan_cache_hits++;
+            *parse_failed = 0;
+            return plan->command_tree;
         }
-        return;
     }
-    
-    char *command_list[5]; // Array for background commands
-    char *current_token = strtok(cmd_text, "&"); // Split by ampersand
-    int command_count = 0;
-    
-    while (current_token && command_count < 4) {
-        remove_whitespace(current_token); // Clean whitespace
-        if (*current_token) command_list[command_count++] = current_token;
-        current_token = strtok(NULL, "&");
+
+    plan_cache_misses++;
+    if (plan_cache_count >= PLAN_CACHE_LIMIT) clear_plan_cache();
+    bucket = &plan_cache_table[hash_value % PLAN_CACHE_BUCKETS];
+    arena_position parse_start = arena_mark(&plan_arena);
+    syntax_node *command_tree = parse_command_line(&plan_arena, line_text, parse_failed);
+    if (*parse_failed || !command_tree) { // Nothing worth keeping
+        arena_release(&plan_arena, parse_start);
+        return NULL;
     }
-    
-    for (int cmd_index = 0; cmd_index < command_count; cmd_index++) {
-        if (active_background_count >= MAX_BACKGROUND_TASKS) { // Check limit
-            printf("Background process limit reached\n");
-            return;
-        }
-        
-        pid_t process_id = fork();
-        if (process_id == 0) { // Child becomes background process
-            setpgid(0, 0); // Set new process group
-            run_command_direct(command_list[cmd_index]);
-        } else if (process_id > 0) {
-            background_task_ids[active_background_count++] = process_id; // Track process
-            printf("Started background process %d: %s\n", process_id, command_list[cmd_index]);
-        } else {
-            perror("Fork failed");
+    build_command_plans(&plan_arena, command_tree);
+
+    command_plan *plan = arena_alloc(&plan_arena, sizeof(command_plan));
+    plan->line_text = arena_strndup(&plan_arena, line_text, strlen(line_text));
+    plan->line_hash = hash_value;
+    plan->command_tree = command_tree;
+    plan->next_plan = *bucket;
+    *bucket = plan;
+    plan_cache_count++;
+    return command_tree;
+}
+
+// ======== EVALUATOR ======== //
+
+builtin_handler find_builtin(const char *command_name) {
+    for (const builtin_entry *entry = builtin_table; entry->builtin_name; entry++)
+        if (strcmp(entry->builtin_name, command_name) == 0) return entry->handler;
+    return NULL;
+}
+
+// Puts here-string or here-document text in an anonymous memory file and
+// returns it rewound, ready to be a command's stdin. Unlike a pipe it never
+// blocks the shell, however long the text, and children can seek in it.
+int open_inline_input(const char *content) {
+    int file_descriptor = memfd_create("mbash25-here", MFD_CLOEXEC);
+    if (file_descriptor < 0) {
+        perror("mbash25: here-document");
+        return -1;
+    }
+    size_t content_length = strlen(content), written_bytes = 0;
+    while (written_bytes < content_length) {
+        ssize_t chunk = write(file_descriptor, content + written_bytes, content_length - written_bytes);
+        if (chunk < 0 && errno == EINTR) continue;
+        if (chunk < 0) {
+            perror("mbash25: here-document");
+            close(file_descriptor);
+            return -1;
         }
+        written_bytes += chunk;
     }
+    lseek(file_descriptor, 0, SEEK_SET);
+    return file_descriptor;
 }
 
-// ======== REDIRECTION ======== //
+// Opens a command's redirections on top of its pipeline wiring; the last
+// redirection of each direction wins, as in bash. Every descriptor opened
+// is recorded so the caller can close it once the command has started.
+int apply_redirections(memory_arena *arena, syntax_node *command, stage_wiring *wiring,
+                       int *opened_fds, int *opened_count) {
+    for (redirection *redirect = command->redirections; redirect; redirect = redirect->next_redirection) {
+        if (redirect->redirect_type == TOKEN_HERE_STRING || redirect->redirect_type == TOKEN_HERE_DOCUMENT) {
+            const char *content;
+            if (redirect->redirect_type == TOKEN_HERE_STRING) {
+                char *expanded_word = expand_word(arena, redirect->target_word);
+                size_t word_length = strlen(expanded_word);
+                char *line = arena_alloc(arena, word_length + 2);
+                memcpy(line, expanded_word, word_length);
+                memcpy(line + word_length, "\n", 2);
+                content = line;
+            } else {
+                content = redirect->literal_document ? redirect->target_word
+                                                     : expand_text(arena, redirect->target_word, 1);
+            }
+            int file_descriptor = open_inline_input(content);
+            if (file_descriptor < 0) return -1;
+            opened_fds[(*opened_count)++] = file_descriptor;
+            wiring->input_fd = file_descriptor;
+            continue;
+        }
+        char *file_name = expand_word(arena, redirect->target_word);
+        int open_flags = O_CLOEXEC;
+        if (redirect->redirect_type == TOKEN_REDIRECT_INPUT) open_flags |= O_RDONLY;
+        else if (redirect->redirect_type == TOKEN_REDIRECT_OUTPUT) open_flags |= O_WRONLY | O_CREAT | O_TRUNC;
+        else open_flags |= O_WRONLY | O_CREAT | O_APPEND;
 
-void handle_input_redirection(char *cmd_text) {
-    char *input_file; // File to read from
-    char *command_part; // Command to execute
-    int saved_stdin = dup(STDIN_FILENO); // Save original stdin
-    
-    char *current_token = strtok(cmd_text, "<"); // Split by input redirection
-    command_part = current_token;
-    remove_whitespace(command_part);
-    current_token = strtok(NULL, "<");
-    input_file = current_token;
-    remove_whitespace(input_file);
-    
-    pid_t process_id = fork();
-    if (process_id == 0) { // Child handles redirection
-        int file_descriptor = open(input_file, O_RDONLY); // Open input file
+        int file_descriptor = open(file_name, open_flags, 0644);
         if (file_descriptor < 0) {
-            perror("Open failed");
-            exit(EXIT_FAILURE);
+            fprintf(stderr, "mbash25: %s: %s\n", file_name, strerror(errno));
+            return -1;
         }
-        dup2(file_descriptor, STDIN_FILENO); // Redirect stdin to file
-        close(file_descriptor);
-        run_command_direct(command_part); // Execute command
-    } else if (process_id > 0) {
-        waitpid(process_id, NULL, 0); // Wait for completion
-        dup2(saved_stdin, STDIN_FILENO); // Restore stdin
-        close(saved_stdin);
+        opened_fds[(*opened_count)++] = file_descriptor;
+        if (redirect->redirect_type == TOKEN_REDIRECT_INPUT) wiring->input_fd = file_descriptor;
+        else wiring->output_fd = file_descriptor;
     }
+    return 0;
 }
 
-void handle_output_redirection(char *cmd_text, char *redirect_type) {
-    char *output_file; // File to write to
-    char *command_part; // Command to execute
-    int saved_stdout = dup(STDOUT_FILENO); // Save original stdout
-    
-    if(strcmp(redirect_type,">")==0) { // Standard output redirection
-        char *current_token = strtok(cmd_text, ">");
-        command_part = current_token;
-        remove_whitespace(command_part);
-        current_token = strtok(NULL, ">");
-        output_file = current_token;
-        remove_whitespace(output_file);
-        
-        pid_t process_id = fork();
-        if(process_id==0) { // Child handles redirection
-            int file_descriptor = open(output_file, O_CREAT|O_WRONLY|O_TRUNC, 0644); // Create/truncate file
-            dup2(file_descriptor, STDOUT_FILENO); // Redirect stdout to file
-            close(file_descriptor);
-            run_command_direct(command_part);
-        } else {
-            waitpid(process_id, NULL, 0); // Wait for completion
-            dup2(saved_stdout, STDOUT_FILENO); // Restore stdout
-            close(saved_stdout);
-        }
-    }
-    else if(strcmp(redirect_type,">>")==0) { // Append output redirection
-        char *current_token = strtok(cmd_text, ">>");
-        command_part = current_token;
-        remove_whitespace(command_part);
-        current_token = strtok(NULL, ">>");
-        output_file = current_token;
-        remove_whitespace(output_file);
-        
-        pid_t process_id = fork();
-        if(process_id==0) { // Child handles append redirection
-            int file_descriptor = open(output_file, O_CREAT|O_WRONLY|O_APPEND, 0644); // Create/append to file
-            dup2(file_descriptor, STDOUT_FILENO); // Redirect stdout to file
-            close(file_descriptor);
-            run_command_direct(command_part);
-        } else {
-            waitpid(process_id, NULL, 0); // Wait for completion
-            dup2(saved_stdout, STDOUT_FILENO); // Restore stdout
-            close(saved_stdout);
+// Forks a copy of the shell for work that cannot be exec'd (operators and
+// builtins inside pipelines or in the background). The child gets its
+// wiring installed on stdin/stdout; the parent only sees the PID.
+pid_t fork_shell_child(const stage_wiring *wiring) {
+    flush_shell_output();
+    fflush(stderr);
+    unsigned long long fork_start_ns = trace_enabled ? trace_clock_ns() : 0;
+    pid_t process_id = fork();
+    if (process_id < 0) {
+        perror("Fork failed");
+        return -1;
+    }
+    if (process_id > 0) {
+        if (wiring->process_group >= 0) setpgid(process_id, wiring->process_group);
+        if (trace_enabled) trace_record(TRACE_FORK, process_id, 0, "mbash25 (forked)", fork_start_ns);
+        return process_id;
+    }
+
+    detach_output_ring();
+    if (wiring->process_group >= 0) setpgid(0, wiring->process_group);
+    if (wiring->unused_fd >= 0) close(wiring->unused_fd);
+    if (wiring->input_fd >= 0 && wiring->input_fd != STDIN_FILENO) dup2(wiring->input_fd, STDIN_FILENO);
+    if (wiring->output_fd >= 0 && wiring->output_fd != STDOUT_FILENO) dup2(wiring->output_fd, STDOUT_FILENO);
+    check_output_target();
+    return 0;
+}
+
+int run_internal_command(syntax_node *command, int argument_count, char **arguments, builtin_handler builtin) {
+    switch (command->kind) {
+    case COMMAND_WORD_COUNT:
+        return process_word_counter(argument_count, arguments);
+    case COMMAND_CONCATENATE:
+        return process_file_concatenation(argument_count, arguments);
+    case COMMAND_MUTUAL_APPEND:
+        if (argument_count != 2) { // Field splitting can turn one operand into several
+            fprintf(stderr, "mbash25: +: expected exactly one file on each side\n");
+            return 1;
         }
+        return process_mutual_file_append(arguments[0], arguments[1]);
+    default:
+        return builtin(argument_count, arguments);
     }
 }
 
-// ======== SEQUENTIAL EXECUTION ======== //
+// Temporarily points the shell's own stdin/stdout at a wiring's
+// descriptors, keeping copies of the originals in saved_fds. Output the
+// shell has buffered only needs flushing when stdout actually moves.
+void redirect_shell_streams(const stage_wiring *wiring, int saved_fds[2]) {
+    saved_fds[0] = saved_fds[1] = -1;
+    if (wiring->input_fd >= 0) {
+        saved_fds[0] = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 10);
+        dup2(wiring->input_fd, STDIN_FILENO);
+    }
+    if (wiring->output_fd >= 0) {
+        flush_shell_output();
+        saved_fds[1] = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+        dup2(wiring->output_fd, STDOUT_FILENO);
+        check_output_target();
+    }
+}
 
-void run_sequential_commands(char *cmd_text) {
-    char *command_list[20]; // Array to store commands
-    char *current_token = strtok(cmd_text, ";"); // Split by semicolon
-    int command_count = 0;
-    
-    while (current_token) {
-        command_list[command_count++] = current_token; // Store each command
-        current_token = strtok(NULL, ";");
+void restore_shell_streams(const int saved_fds[2]) {
+    if (saved_fds[0] >= 0) {
+        dup2(saved_fds[0], STDIN_FILENO);
+        close(saved_fds[0]);
     }
-    
-    for(int cmd_index = 0; cmd_index < command_count; cmd_index++) {
-        pid_t process_id = fork();
-        if (process_id == 0) { // Child executes command
-            run_command_direct(command_list[cmd_index]);
-        } else {
-            waitpid(process_id, NULL, 0); // Wait before next command
-        }
+    if (saved_fds[1] >= 0) {
+        flush_shell_output();
+        if (output_sync_enabled) sync_output_target();
+        dup2(saved_fds[1], STDOUT_FILENO);
+        close(saved_fds[1]);
+        check_output_target();
     }
 }
 
-// ======== CONDITIONAL EXECUTION ======== //
+// Runs an internal command in the shell process itself, temporarily
+// pointing the shell's stdin/stdout at the command's wiring
+int run_in_shell(syntax_node *command, int argument_count, char **arguments, builtin_handler builtin,
+                 const stage_wiring *wiring) {
+    int saved_fds[2];
+    redirect_shell_streams(wiring, saved_fds);
+    int exit_status = run_internal_command(command, argument_count, arguments, builtin);
+    exit_status = finish_builtin_output(command->kind == COMMAND_SIMPLE ? arguments[0] : "mbash25",
+                                        saved_fds[1] >= 0, exit_status);
+    restore_shell_streams(saved_fds);
+    return exit_status;
+}
 
-void handle_conditional_execution(char *cmd_text) {
-    int total_length = strlen(cmd_text);
-    char *current_command = malloc((total_length + 1) * sizeof(char)); // Buffer for current command
-    int execution_status = -1; // Track last command result (-1: not set, 0: failed, 1: success)
-    char operator_type[3] = ""; // Track current operator type
-    int char_index = 0, cmd_index = 0;
-    
-    while(1) {
-        if(cmd_text[char_index]=='&' && cmd_text[char_index+1]=='&') { // AND operator
-            char_index += 2;
-            if(execution_status == -1 || // First command
-               (execution_status == 1 && strcmp(operator_type,"&&") == 0) || // Previous success with AND
-               (execution_status == 0 && strcmp(operator_type,"||") == 0)) { // Previous fail with OR
-                
-                if(validate_argument_count(current_command) == -1) {
-                    printf("Invalid argument count\n");
-                    continue;
-                }
-                
-                current_command[cmd_index] = '\0';
-                pid_t process_id = fork();
-                if(process_id == 0) { // Child executes command
-                    run_command_direct(current_command);
-                } else {
-                    int process_status;
-                    waitpid(process_id, &process_status, 0);
-                    if(WIFEXITED(process_status)) { // Check exit status
-                        execution_status = (WEXITSTATUS(process_status) == 0) ? 1 : 0;
-                    }
-                    cmd_index = 0; // Reset for next command
-                }
-            }
-            strcpy(operator_type, "&&"); // Set operator type
-        }
-        else if(cmd_text[char_index]=='|' && cmd_text[char_index+1]=='|') { // OR operator
-            char_index += 2;
-            if(execution_status == -1 || // First command
-               (execution_status == 1 && strcmp(operator_type,"&&") == 0) || // Previous success with AND
-               (execution_status == 0 && strcmp(operator_type,"||") == 0)) { // Previous fail with OR
-                
-                if(validate_argument_count(current_command) == -1) {
-                    printf("Invalid argument count\n");
-                    continue;
-                }
-                
-                current_command[cmd_index] = '\0';
-                pid_t process_id = fork();
-                if(process_id == 0) { // Child executes command
-                    run_command_direct(current_command);
-                } else {
-                    int process_status;
-                    waitpid(process_id, &process_status, 0);
-                    if(WIFEXITED(process_status)) { // Check exit status
-                        execution_status = (WEXITSTATUS(process_status) == 0) ? 1 : 0;
-                    }
-                    cmd_index = 0; // Reset for next command
-                }
+// Starts one command. Returns the PID to wait for, or 0 when the command
+// already finished in-process (or failed to start) with its status in
+// *finished_status. External commands go through the spawn layer; the
+// custom operators and builtins run in the shell unless the wiring asks
+// for a child (pipeline stages, background jobs).
+pid_t start_command(memory_arena *arena, syntax_node *command, stage_wiring wiring, int *finished_status) {
+    int argument_count, opened_count = 0;
+    char **arguments = expand_arguments(arena, command, &argument_count);
+    int redirect_count = 0;
+    for (redirection *redirect = command->redirections; redirect; redirect = redirect->next_redirection)
+        redirect_count++;
+    int opened_fds[redirect_count + 1];
+
+    int assignment_count = 0;
+    while (command->kind == COMMAND_SIMPLE && assignment_count < argument_count &&
+           is_assignment_word(arguments[assignment_count]))
+        assignment_count++;
+    resource_policy policy = {0};
+    int policy_words = 0;
+    if (wiring.process_group == 0) add_background_policy(&policy); // Only '&' jobs lead their own group
+
+    *finished_status = 0;
+    pid_t process_id = 0;
+    int stage_index = begin_stage_statistics(command, argument_count, arguments); // -1 unless timed
+    if (apply_redirections(arena, command, &wiring, opened_fds, &opened_count) < 0) {
+        *finished_status = 1;
+    } else if (command->kind == COMMAND_SIMPLE && argument_count == 0) {
+        // Only redirections: the files have been opened or created. A pipeline
+        // stage with both a source and a sink ('< in | cmd', 'cmd | > out')
+        // pumps its input to its output with splice instead.
+        if (wiring.in_pipeline && wiring.input_fd >= 0 && wiring.output_fd >= 0) {
+            process_id = fork_shell_child(&wiring);
+            if (process_id == 0)
+                _exit(stream_file_to_output(STDIN_FILENO, "pipeline", STDOUT_FILENO, "mbash25") < 0);
+            if (process_id < 0) {
+                *finished_status = 1;
+                process_id = 0;
             }
-            strcpy(operator_type, "||"); // Set operator type
         }
-        else if(cmd_text[char_index] == '\0') { // End of command string
-            if(validate_argument_count(current_command) == -1) {
-                printf("Invalid argument count\n");
-                break;
+    } else if (command->kind == COMMAND_SIMPLE && assignment_count == argument_count) {
+        // Only NAME=value words: they set shell variables (in a pipeline's child they have no effect)
+        for (int argument_index = 0; argument_index < argument_count && !wiring.in_child; argument_index++) {
+            char *equals_sign = strchr(arguments[argument_index], '=');
+            *equals_sign = '\0';
+            set_shell_variable(arguments[argument_index], equals_sign + 1, 0);
+            *equals_sign = '=';
+        }
+    } else if (command->kind == COMMAND_SIMPLE &&
+               (policy_words = parse_policy_prefixes(argument_count - assignment_count,
+                                                     arguments + assignment_count, &policy)) < 0) {
+        *finished_status = 125; // Like coreutils nice and taskset
+    } else {
+        char **command_environment = NULL; // NAME=value prefixes only reach external commands
+        if (assignment_count) {
+            command_environment = build_command_environment(arena, arguments, assignment_count);
+            arguments += assignment_count;
+            argument_count -= assignment_count;
+        }
+        arguments += policy_words; // A wrapped command always runs as a program, like under coreutils nice
+        argument_count -= policy_words;
+        builtin_handler builtin = (command->kind != COMMAND_SIMPLE || policy_words) ? NULL :
+                                  command->plan_arguments ? command->plan_builtin : find_builtin(arguments[0]);
+        if (command->kind == COMMAND_SIMPLE && !builtin) {
+            spawn_options options = {wiring.input_fd, wiring.output_fd, wiring.process_group,
+                                     policy_words ? NULL : planned_program_path(command), command_environment,
+                                     policy_is_empty(&policy) ? NULL : &policy};
+            process_id = spawn_command(arguments, &options);
+            if (process_id < 0) {
+                *finished_status = 127;
+                process_id = 0;
             }
-            
-            current_command[cmd_index] = '\0';
-            if((strcmp(operator_type,"&&") == 0 && execution_status == 1) || // Execute if AND and previous success
-               (strcmp(operator_type,"||") == 0 && execution_status == 0)) { // Execute if OR and previous fail
-                pid_t process_id = fork();
-                if(process_id == 0) { // Child executes final command
-                    run_command_direct(current_command);
-                } else {
-                    waitpid(process_id, NULL, 0);
-                }
+        } else if (wiring.in_child) {
+            process_id = fork_shell_child(&wiring);
+            if (process_id == 0) {
+                int exit_status = run_internal_command(command, argument_count, arguments, builtin);
+                exit_shell_child(finish_builtin_output(command->kind == COMMAND_SIMPLE ? arguments[0] : "mbash25",
+                                                       1, exit_status));
             }
-            break;
+            if (process_id < 0) {
+                *finished_status = 1;
+                process_id = 0;
+            }
+        } else {
+            *finished_status = run_in_shell(command, argument_count, arguments, builtin, &wiring);
         }
-        else {
-            current_command[cmd_index++] = cmd_text[char_index++]; // Build current command
+    }
+    record_stage_launch(stage_index, process_id);
+
+    for (int fd_index = 0; fd_index < opened_count; fd_index++)
+        close(opened_fds[fd_index]);
+    return process_id;
+}
+
+// Buffer size to request for a pipeline's pipes, or 0 for the kernel
+// default (64 KB). With pipesize=auto only long pipelines, whose stages
+// stall each other most on small buffers, get the system maximum.
+long pipeline_pipe_size(int stage_count) {
+    long requested_size = pipe_size_setting;
+    if (requested_size == OPTION_AUTO)
+        requested_size = (stage_count >= LONG_PIPELINE_STAGES) ? OPTION_MAX : 0;
+    if (requested_size != OPTION_MAX) return requested_size;
+
+    if (!system_pipe_max_size) {
+        system_pipe_max_size = -1; // Only try /proc once
+        FILE *limit_file = fopen("/proc/sys/fs/pipe-max-size", "re");
+        if (limit_file) {
+            if (fscanf(limit_file, "%ld", &system_pipe_max_size) != 1) system_pipe_max_size = -1;
+            fclose(limit_file);
         }
     }
-    free(current_command);
+    return system_pipe_max_size > 0 ? system_pipe_max_size : 0;
 }
 
-// ======== MAIN FUNCTION ======== //
+// Closes the shell's copy of a pipe end. The trace shows when a stage's
+// reader can see EOF (write end) or its writer can get EPIPE (read end).
+void close_pipe_end(int pipe_fd, const char *end_name) {
+    close(pipe_fd);
+    if (trace_enabled) trace_record(TRACE_PIPE_CLOSE, 0, pipe_fd, end_name, 0);
+}
 
-int main(int argc, char *argv[]) {
-    while (1) { // Main shell loop
-        char* user_command = get_user_command(); // Get command from user
-        
-        if (strcmp(user_command, "killterm") == 0) { // Exit shell
-            free(user_command);
-            exit(0);
+void set_pipe_size(int pipe_fd, long pipe_size) {
+    // Best effort: unprivileged users may be over their pipe buffer quota
+    if (pipe_size > 0) fcntl(pipe_fd, F_SETPIPE_SZ, (int)pipe_size);
+}
+
+// Starts the stages of a pipeline, the first reading input_fd and the last
+// writing output_fd (-1 keeps the shell's), and records each stage's PID or
+// finished status. input_fd and output_fd stay open for the caller to close.
+void start_pipeline_stages(memory_arena *arena, syntax_node **stages, int stage_count, int input_fd,
+                           int output_fd, long pipe_size, pid_t *stage_ids, int *stage_statuses) {
+    int previous_read_fd = input_fd;
+    for (int stage_index = 0; stage_index < stage_count; stage_index++) {
+        int pipe_fds[2] = {-1, -1};
+        if (stage_index < stage_count - 1) {
+            if (pipe2(pipe_fds, O_CLOEXEC) < 0) perror("Pipe failed");
+            else set_pipe_size(pipe_fds[1], pipe_size);
+        }
+        // Stage reads the previous pipe and writes the next; a forked stage drops the next pipe's read end
+        int stage_output_fd = (stage_index < stage_count - 1) ? pipe_fds[1] : output_fd;
+        stage_wiring wiring = {previous_read_fd, stage_output_fd, pipe_fds[0], -1, 1, 1};
+        if (stages[stage_index]->type == NODE_COMMAND) {
+            stage_ids[stage_index] = start_command(arena, stages[stage_index], wiring, &stage_statuses[stage_index]);
+        } else { // Loops run in their own copy of the shell
+            pid_t process_id = fork_shell_child(&wiring);
+            if (process_id == 0) exit_shell_child(execute_node(arena, stages[stage_index]));
+            stage_ids[stage_index] = (process_id > 0) ? process_id : 0;
+            stage_statuses[stage_index] = (process_id > 0) ? 0 : 1;
         }
-        else if (strcmp(user_command, "newt") == 0) { // Create new terminal
-            create_new_terminal();
+        if (previous_read_fd >= 0 && previous_read_fd != input_fd) close_pipe_end(previous_read_fd, "pipe read end");
+        if (pipe_fds[1] >= 0) close_pipe_end(pipe_fds[1], "pipe write end");
+        previous_read_fd = pipe_fds[0];
+    }
+}
+
+void wait_for_pipeline_stages(pid_t *stage_ids, int *stage_statuses, int stage_count) {
+    for (int stage_index = 0; stage_index < stage_count; stage_index++) {
+        if (stage_ids[stage_index] > 0)
+            stage_statuses[stage_index] = wait_for_command(stage_ids[stage_index]);
+    }
+}
+
+int execute_pipeline(memory_arena *arena, syntax_node *pipeline) {
+    pid_t *stage_ids = arena_alloc(arena, pipeline->stage_count * sizeof(pid_t)); // Process IDs of each stage
+    int *stage_statuses = arena_alloc(arena, pipeline->stage_count * sizeof(int));
+    start_pipeline_stages(arena, pipeline->stages, pipeline->stage_count, -1, -1,
+                          pipeline_pipe_size(pipeline->stage_count), stage_ids, stage_statuses);
+    // The last stage's status is the pipeline's
+    wait_for_pipeline_stages(stage_ids, stage_statuses, pipeline->stage_count);
+    return stage_statuses[pipeline->stage_count - 1];
+}
+
+// Runs 'producer |& { consumer, ... }'. The producer writes into one pipe,
+// a forked pump copies that pipe into one pipe per consumer, and every
+// consumer (a command, a pipeline or a nested '|&') reads its own copy.
+// The status is that of the last consumer that failed, or 0.
+int execute_fan_out(memory_arena *arena, syntax_node *fan_out) {
+    int consumer_count = fan_out->stage_count;
+    syntax_node **producer_stages = &fan_out->left;
+    int producer_count = 1;
+    if (fan_out->left->type == NODE_PIPELINE) {
+        producer_stages = fan_out->left->stages;
+        producer_count = fan_out->left->stage_count;
+    }
+    long pipe_size = pipeline_pipe_size(producer_count + consumer_count);
+
+    int producer_pipe[2];
+    if (pipe2(producer_pipe, O_CLOEXEC) < 0) {
+        perror("Pipe failed");
+        return 1;
+    }
+    set_pipe_size(producer_pipe[1], pipe_size);
+    pid_t *producer_ids = arena_alloc(arena, producer_count * sizeof(pid_t));
+    int *producer_statuses = arena_alloc(arena, producer_count * sizeof(int));
+    start_pipeline_stages(arena, producer_stages, producer_count, -1, producer_pipe[1], pipe_size,
+                          producer_ids, producer_statuses);
+    close_pipe_end(producer_pipe[1], "pipe write end");
+
+    int *consumer_fds = arena_alloc(arena, consumer_count * sizeof(int)); // Write ends the pump fills
+    pid_t **consumer_ids = arena_alloc(arena, consumer_count * sizeof(pid_t *));
+    int **consumer_statuses = arena_alloc(arena, consumer_count * sizeof(int *));
+    int *consumer_stage_counts = arena_zalloc(arena, consumer_count * sizeof(int));
+    for (int consumer_index = 0; consumer_index < consumer_count; consumer_index++) {
+        syntax_node *consumer = fan_out->stages[consumer_index];
+        syntax_node **stages = &fan_out->stages[consumer_index];
+        int stage_count = 1;
+        if (consumer->type == NODE_PIPELINE) {
+            stages = consumer->stages;
+            stage_count = consumer->stage_count;
         }
-        else if (strstr(user_command, "&&") || strstr(user_command, "||")) { // Conditional execution
-            handle_conditional_execution(user_command);
+        consumer_ids[consumer_index] = arena_zalloc(arena, stage_count * sizeof(pid_t));
+        consumer_statuses[consumer_index] = arena_zalloc(arena, stage_count * sizeof(int));
+        consumer_fds[consumer_index] = -1;
+
+        int consumer_pipe[2];
+        if (pipe2(consumer_pipe, O_CLOEXEC) < 0) {
+            perror("Pipe failed");
+            consumer_statuses[consumer_index][0] = 1;
+            consumer_stage_counts[consumer_index] = 1;
+            continue;
         }
-        else if (strstr(user_command, "~")) { // Reversed pipe
-            handle_reversed_pipe(user_command);
+        set_pipe_size(consumer_pipe[1], pipe_size);
+        consumer_stage_counts[consumer_index] = stage_count;
+        if (consumer->type == NODE_COMMAND || consumer->type == NODE_PIPELINE) {
+            start_pipeline_stages(arena, stages, stage_count, consumer_pipe[0], -1, pipe_size,
+                                  consumer_ids[consumer_index], consumer_statuses[consumer_index]);
+        } else { // Nested '|&' runs in its own shell
+            stage_wiring wiring = {consumer_pipe[0], -1, consumer_pipe[1], -1, 1, 0};
+            pid_t process_id = fork_shell_child(&wiring);
+            if (process_id == 0) exit_shell_child(execute_node(arena, consumer));
+            consumer_ids[consumer_index][0] = (process_id > 0) ? process_id : 0;
+            consumer_statuses[consumer_index][0] = (process_id > 0) ? 0 : 1;
         }
-        else if (strstr(user_command, "#")) { // Word counter
-            process_word_counter(user_command);
+        close_pipe_end(consumer_pipe[0], "pipe read end");
+        consumer_fds[consumer_index] = consumer_pipe[1];
+    }
+
+    stage_wiring pump_wiring = {-1, -1, -1, -1, 1, 0};
+    pid_t pump_id = fork_shell_child(&pump_wiring);
+    if (pump_id == 0) _exit(run_fan_out_pump(producer_pipe[0], consumer_fds, consumer_count));
+    close_pipe_end(producer_pipe[0], "pipe read end"); // The pump holds the only copies from here on
+    for (int consumer_index = 0; consumer_index < consumer_count; consumer_index++)
+        if (consumer_fds[consumer_index] >= 0) close_pipe_end(consumer_fds[consumer_index], "pipe write end");
+
+    wait_for_pipeline_stages(producer_ids, producer_statuses, producer_count);
+    if (pump_id > 0) wait_for_command(pump_id);
+    int exit_status = 0;
+    for (int consumer_index = 0; consumer_index < consumer_count; consumer_index++) {
+        int stage_count = consumer_stage_counts[consumer_index];
+        wait_for_pipeline_stages(consumer_ids[consumer_index], consumer_statuses[consumer_index], stage_count);
+        if (stage_count && consumer_statuses[consumer_index][stage_count - 1] != 0)
+            exit_status = consumer_statuses[consumer_index][stage_count - 1];
+    }
+    return exit_status;
+}
+
+// Runs a loop's iterations in the shell itself, so a loop variable and
+// assignments in the body stay visible afterwards. Each iteration's
+// expansions are freed before the next, keeping long loops flat in memory.
+int run_loop(memory_arena *arena, syntax_node *loop) {
+    int exit_status = 0, item_count = 0;
+    long iteration_count = -1; // -1 for while loops
+    char **items = NULL;
+    if (loop->type == NODE_FOR) {
+        items = expand_arguments(arena, loop, &item_count);
+        iteration_count = item_count;
+    } else if (loop->type == NODE_REPEAT) {
+        char *count_text = expand_word(arena, loop->words[0]), *end;
+        errno = 0;
+        iteration_count = strtol(count_text, &end, 10);
+        if (errno || end == count_text || *end || iteration_count < 0) {
+            fprintf(stderr, "mbash25: repeat: %s: invalid count\n", count_text);
+            return 1;
         }
-        else if (strstr(user_command, "++")) { // File concatenation
-            process_file_concatenation(user_command);
+    }
+
+    arena_position iteration_start = arena_mark(arena);
+    for (long iteration = 0; iteration_count < 0 || iteration < iteration_count; iteration++) {
+        if (loop->type == NODE_WHILE) {
+            int condition_status = execute_node(arena, loop->left);
+            if (condition_status != 0) {
+                if (condition_status == 128 + SIGINT) exit_status = condition_status;
+                break;
+            }
+        } else if (loop->type == NODE_FOR) {
+            set_shell_variable(loop->loop_variable, items[iteration], 0);
         }
-        else if (strstr(user_command, "+") && !strstr(user_command, "++")) { // Mutual file append
-            process_mutual_file_append(user_command);
+        exit_status = execute_node(arena, loop->type == NODE_WHILE ? loop->right : loop->left);
+        arena_release(arena, iteration_start);
+        if (exit_status == 128 + SIGINT) break; // Ctrl-C stops the whole loop, not one iteration
+    }
+    return exit_status;
+}
+
+// Applies a loop's own redirections ('done < file', 'done > file') to the
+// shell for the duration of the loop
+int execute_loop(memory_arena *arena, syntax_node *loop) {
+    int redirect_count = 0, opened_count = 0;
+    for (redirection *redirect = loop->redirections; redirect; redirect = redirect->next_redirection)
+        redirect_count++;
+    int opened_fds[redirect_count + 1];
+    stage_wiring wiring = {-1, -1, -1, -1, 0, 0};
+    int exit_status = 1;
+    if (apply_redirections(arena, loop, &wiring, opened_fds, &opened_count) == 0) {
+        int saved_fds[2];
+        redirect_shell_streams(&wiring, saved_fds);
+        exit_status = run_loop(arena, loop);
+        restore_shell_streams(saved_fds);
+    }
+    for (int fd_index = 0; fd_index < opened_count; fd_index++)
+        close(opened_fds[fd_index]);
+    return exit_status;
+}
+
+// Evaluates an AST node and returns its exit status, which is also $?
+// for whatever runs next
+int execute_node(memory_arena *arena, syntax_node *node) {
+    int exit_status = 0;
+    switch (node->type) {
+    case NODE_COMMAND: {
+        stage_wiring wiring = {-1, -1, -1, -1, 0, 0};
+        pid_t process_id = start_command(arena, node, wiring, &exit_status);
+        if (process_id > 0) exit_status = wait_for_command(process_id);
+        break;
+    }
+    case NODE_PIPELINE:
+        exit_status = execute_pipeline(arena, node);
+        break;
+    case NODE_AND: // Right side only after success
+        exit_status = execute_node(arena, node->left);
+        if (exit_status == 0) exit_status = execute_node(arena, node->right);
+        break;
+    case NODE_OR: // Right side only after failure
+        exit_status = execute_node(arena, node->left);
+        if (exit_status != 0) exit_status = execute_node(arena, node->right);
+        break;
+    case NODE_SEQUENCE:
+        execute_node(arena, node->left);
+        exit_status = execute_node(arena, node->right);
+        break;
+    case NODE_BACKGROUND:
+        exit_status = start_background_job(arena, node);
+        break;
+    case NODE_TIMED:
+        exit_status = execute_with_statistics(arena, node->left);
+        break;
+    case NODE_FAN_OUT:
+        exit_status = execute_fan_out(arena, node);
+        break;
+    case NODE_CACHED:
+        exit_status = execute_cached(arena, node->left);
+        break;
+    case NODE_PARALLEL:
+        exit_status = run_parallel_jobs(arena, node->stages, node->stage_count,
+                                        parallel_job_limit(parallel_job_setting, node->stage_count));
+        break;
+    case NODE_FOR:
+    case NODE_WHILE:
+    case NODE_REPEAT:
+        exit_status = execute_loop(arena, node);
+        break;
+    }
+    last_exit_status = exit_status;
+    return exit_status;
+}
+
+// ======== COMMAND SERVER ======== //
+
+void stop_command_server(int signal_number) {
+    (void)signal_number;
+    server_stopping = 1;
+}
+
+// Runs one client connection in a worker: the client's command lines go
+// through the normal evaluator with stdout and stderr on the socket, then
+// the exit status follows as a final "mbash25-status: N" line.
+void serve_connection(int connection_fd, int null_fd, int server_directory_fd, memory_arena *line_arena) {
+    if (fchdir(server_directory_fd) < 0) perror("fchdir"); // Every request starts where the server did
+    int saved_error_fd = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 10);
+    dup2(connection_fd, STDOUT_FILENO);
+    dup2(connection_fd, STDERR_FILENO);
+    check_output_target();
+
+    input_reader reader;
+    int exit_status = 1;
+    if (open_input_reader(&reader, connection_fd, 0) == 0) {
+        exit_status = run_command_loop(&reader, line_arena);
+        close_input_reader(&reader);
+    }
+    flush_shell_output();
+    dprintf(connection_fd, SERVER_STATUS_PREFIX "%d\n", exit_status);
+
+    dup2(null_fd, STDOUT_FILENO);
+    if (saved_error_fd >= 0) {
+        dup2(saved_error_fd, STDERR_FILENO);
+        close(saved_error_fd);
+    }
+    close(connection_fd);
+}
+
+// Body of a pre-forked worker. Everything a request needs (job control,
+// the line arena, the stream buffer) is set up before the first accept,
+// so a request costs one accept and the commands themselves.
+void run_server_worker(int listen_fd) {
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGPIPE, SIG_IGN); // A client that hangs up must not kill the worker
+    detach_output_ring();
+    init_job_control(0);
+    int null_fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+    int server_directory_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    dup2(null_fd, STDIN_FILENO); // Commands must not read the request stream
+    dup2(null_fd, STDOUT_FILENO);
+
+    memory_arena line_arena = {NULL};
+    arena_alloc(&line_arena, 1); // Keep the first arena block for every request
+    arena_reset(&line_arena);
+    if (!stream_buffer) stream_buffer = malloc(STREAM_BUFFER_SIZE);
+
+    while (1) {
+        int connection_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (connection_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("accept");
+            _exit(EXIT_FAILURE);
         }
-        else if (strstr(user_command, "&") || strcmp(user_command, "fg") == 0) { // Background execution
-            manage_background_execution(user_command);
+        serve_connection(connection_fd, null_fd, server_directory_fd, &line_arena);
+    }
+}
+
+// mbash25 --serve SOCKET [WORKERS]: listens on a UNIX socket with a pool of
+// pre-forked workers (default: one per online CPU, at least two) that all
+// accept on the shared socket. Workers that exit are replaced; SIGTERM or
+// SIGINT stops the pool and removes the socket.
+int run_command_server(const char *socket_path, int worker_count) {
+    struct sockaddr_un address = {0};
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "mbash25: %s: socket path too long\n", socket_path);
+        return 2;
+    }
+    strcpy(address.sun_path, socket_path);
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(socket_path); // Left behind by a server that did not shut down cleanly
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+        listen(listen_fd, SOMAXCONN) < 0) {
+        fprintf(stderr, "mbash25: %s: %s\n", socket_path, strerror(errno));
+        return 1;
+    }
+    if (worker_count <= 0) {
+        long online_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        worker_count = (online_cpus > 2) ? online_cpus : 2;
+    }
+
+    struct sigaction stop_action = {0};
+    stop_action.sa_handler = stop_command_server; // No SA_RESTART: waitpid must return
+    sigaction(SIGTERM, &stop_action, NULL);
+    sigaction(SIGINT, &stop_action, NULL);
+
+    pid_t *worker_ids = calloc(worker_count, sizeof(pid_t));
+    int exit_status = 0;
+    while (!server_stopping && worker_ids) {
+        for (int worker_index = 0; worker_index < worker_count; worker_index++) {
+            if (worker_ids[worker_index] > 0) continue;
+            unsigned long long fork_start_ns = trace_enabled ? trace_clock_ns() : 0;
+            worker_ids[worker_index] = fork();
+            if (worker_ids[worker_index] == 0) run_server_worker(listen_fd);
+            if (worker_ids[worker_index] < 0) perror("Fork failed");
+            else if (trace_enabled) trace_record(TRACE_FORK, worker_ids[worker_index], 0, "server worker", fork_start_ns);
         }
-        else if (strstr(user_command, "|")) { // Pipe execution
-            handle_piped_commands(user_command);
+        int worker_status;
+        pid_t exited_id = waitpid(-1, &worker_status, 0);
+        if (exited_id < 0) {
+            if (errno == EINTR) continue;
+            break;
         }
-        else if (strstr(user_command, "<")) { // Input redirection
-            handle_input_redirection(user_command);
+        for (int worker_index = 0; worker_index < worker_count; worker_index++)
+            if (worker_ids[worker_index] == exited_id) worker_ids[worker_index] = 0;
+        if (trace_enabled)
+            trace_record(TRACE_REAP, exited_id, WIFEXITED(worker_status) ? WEXITSTATUS(worker_status)
+                                                                      : 128 + WTERMSIG(worker_status), NULL, 0);
+        if (WIFEXITED(worker_status) && WEXITSTATUS(worker_status) == EXIT_FAILURE) { // Socket is unusable
+            exit_status = 1;
+            break;
         }
-        else if (strstr(user_command, ">>")) { // Append output redirection
-            handle_output_redirection(user_command, ">>");
+    }
+
+    for (int worker_index = 0; worker_ids && worker_index < worker_count; worker_index++)
+        if (worker_ids[worker_index] > 0) kill(worker_ids[worker_index], SIGTERM);
+    while (waitpid(-1, NULL, 0) > 0 || errno == EINTR)
+        ;
+    free(worker_ids);
+    close(listen_fd);
+    unlink(socket_path);
+    return exit_status;
+}
+
+// mbash25 --connect SOCKET [COMMAND]: sends COMMAND (or stdin) to a server,
+// copies the output to stdout and exits with the status the server sent
+int run_command_client(const char *socket_path, const char *command_text) {
+    struct sockaddr_un address = {0};
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", socket_path);
+    int connection_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (connection_fd < 0 || connect(connection_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        fprintf(stderr, "mbash25: %s: %s\n", socket_path, strerror(errno));
+        return 255;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    if (command_text) dprintf(connection_fd, "%s\n", command_text);
+    else stream_file_to_output(STDIN_FILENO, "stdin", connection_fd, "mbash25");
+    shutdown(connection_fd, SHUT_WR);
+
+    // The status line can only be in the last bytes, so those are held back
+    // until the server closes the connection
+    enum { TRAILER_WINDOW = 48 };
+    static char relay_buffer[TRAILER_WINDOW + 64 * 1024];
+    size_t held_bytes = 0;
+    ssize_t read_bytes;
+    while ((read_bytes = read(connection_fd, relay_buffer + held_bytes, sizeof(relay_buffer) - held_bytes)) != 0) {
+        if (read_bytes < 0 && errno == EINTR) continue;
+        if (read_bytes < 0) break;
+        held_bytes += read_bytes;
+        if (held_bytes > TRAILER_WINDOW) {
+            size_t release_bytes = held_bytes - TRAILER_WINDOW;
+            if (write(STDOUT_FILENO, relay_buffer, release_bytes) < 0) break;
+            memmove(relay_buffer, relay_buffer + release_bytes, TRAILER_WINDOW);
+            held_bytes = TRAILER_WINDOW;
         }
-        else if (strstr(user_command, ">")) { // Output redirection
-            handle_output_redirection(user_command, ">");
+    }
+    close(connection_fd);
+
+    int exit_status = 255; // Connection lost before the status arrived
+    size_t output_bytes = held_bytes;
+    size_t prefix_length = strlen(SERVER_STATUS_PREFIX);
+    for (size_t offset = held_bytes >= prefix_length ? held_bytes - prefix_length + 1 : 0; offset-- > 0; ) {
+        if (memcmp(relay_buffer + offset, SERVER_STATUS_PREFIX, prefix_length) == 0) {
+            exit_status = atoi(relay_buffer + offset + prefix_length);
+            output_bytes = offset;
+            break;
         }
-        else if (strstr(user_command, ";")) { // Sequential execution
-            run_sequential_commands(user_command);
+    }
+    if (output_bytes && write(STDOUT_FILENO, relay_buffer, output_bytes) < 0) return 255;
+    return exit_status;
+}
+
+// ======== MAIN FUNCTION ======== //
+
+// Reads, parses and runs command lines until the reader is exhausted.
+// Returns the status of the last command, like a script's exit status.
+// Lines are joined with newlines until they parse as a whole command, so
+// loops and here-documents can span several lines
+int run_command_loop(input_reader *reader, memory_arena *line_arena) {
+    int line_number = 0, last_status = 0;
+    char *user_command, *unfinished_command = NULL;
+    while (reap_background_jobs(reader->interactive),
+           (user_command = get_user_command(reader)) != NULL) { // Main shell loop
+        line_number++;
+        if (line_number == 1 && strncmp(user_command, "#!", 2) == 0) continue; // Script interpreter line
+
+        char *expanded_command = NULL;
+        if (history_enabled) {
+            int expansion_failed;
+            expanded_command = expand_history(user_command, &expansion_failed);
+            if (expansion_failed) {
+                last_status = last_exit_status = 1;
+                continue;
+            }
+            if (expanded_command) { // Show the command that will run, like bash
+                user_command = expanded_command;
+                printf("%s\n", user_command);
+            }
         }
-        else { // Single command execution
-            if (validate_argument_count(user_command) == -1) {
-                printf("Invalid argument count (1-5 allowed)\n");
-            } else {
-                pid_t process_id = fork(); // Fork for single command
-                run_single_command(user_command, process_id);
+        char *joined_command = NULL;
+        if (unfinished_command) {
+            size_t unfinished_length = strlen(unfinished_command), line_length = strlen(user_command);
+            joined_command = malloc(unfinished_length + line_length + 2);
+            if (!joined_command) {
+                perror("malloc");
+                exit(EXIT_FAILURE);
             }
+            memcpy(joined_command, unfinished_command, unfinished_length);
+            joined_command[unfinished_length] = '\n';
+            memcpy(joined_command + unfinished_length + 1, user_command, line_length + 1);
+            free(unfinished_command);
+            unfinished_command = NULL;
+            user_command = joined_command;
         }
-        free(user_command); // Clean up memory
+        int parse_failed;
+        syntax_node *command_tree = find_command_plan(user_command, &parse_failed);
+        reader->continuation = (parse_failed == PARSE_INCOMPLETE);
+        if (parse_failed == PARSE_INCOMPLETE) { // Keep reading until the command is complete
+            unfinished_command = joined_command ? joined_command : strdup(user_command);
+            free(expanded_command);
+            continue;
+        }
+        if (history_enabled) add_history_entry(user_command);
+        if (parse_failed) last_status = last_exit_status = 2;
+        else if (command_tree && stats_mode_enabled) last_status = execute_with_statistics(line_arena, command_tree);
+        else if (command_tree) last_status = execute_node(line_arena, command_tree);
+        arena_reset(line_arena); // Free the whole line at once
+        free(expanded_command);
+        free(joined_command);
     }
-    return 0;
+    if (unfinished_command) { // Input ended inside a loop, quote or here-document
+        report_incomplete_command();
+        free(unfinished_command);
+        last_status = 2;
+    }
+    return last_status;
+}
+
+int main(int argc, char *argv[]) {
+    input_reader reader;
+    shell_process_id = getpid();
+    import_environment();
+    init_output_layer();
+
+    if (argc > 2 && strcmp(argv[1], "--serve") == 0) { // mbash25 --serve /path/sock [workers]
+        return run_command_server(argv[2], argc > 3 ? atoi(argv[3]) : 0);
+    } else if (argc > 2 && strcmp(argv[1], "--connect") == 0) { // mbash25 --connect /path/sock [command]
+        return run_command_client(argv[2], argc > 3 ? argv[3] : NULL);
+    } else if (argc > 2 && strcmp(argv[1], "-c") == 0) { // mbash25 -c 'cmd; cmd'
+        open_string_reader(&reader, argv[2]);
+    } else if (argc > 1) { // mbash25 script.sh
+        int script_fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+        if (script_fd < 0) {
+            fprintf(stderr, "mbash25: %s: %s\n", argv[1], strerror(errno));
+            exit(127);
+        }
+        if (open_input_reader(&reader, script_fd, 0) < 0) exit(EXIT_FAILURE);
+    } else { // Prompt only when stdin is a terminal
+        if (open_input_reader(&reader, STDIN_FILENO, isatty(STDIN_FILENO)) < 0) exit(EXIT_FAILURE);
+    }
+
+    init_job_control(reader.interactive);
+    history_enabled = reader.interactive;
+    memory_arena line_arena = {NULL}; // Holds each line's AST until the line has run
+    int last_status = run_command_loop(&reader, &line_arena);
+    if (reader.interactive) printf("\n"); // Leave the terminal on a fresh line at EOF
+    return last_status;
 }
@@ -0,0 +1,101 @@
+#!/usr/bin/env bash
+# Benchmarks mbash25 against bash -c on the same workloads and prints CSV:
+#   benchmark,shell,size_bytes,operations,best_seconds,rate,rate_unit,speedup_vs_bash
+# Usage: bench/run_bench.sh ./mbash25
+# Environment: BENCH_SIZES (default "1M 64M 256M"), BENCH_REPEAT (default 3),
+#              BENCH_COMMANDS (commands per launch benchmark, default 2000),
+#              BENCH_DIR (scratch directory parent, default $TMPDIR or /tmp)
+set -u
+
+shell_under_test=$(realpath "${1:-./mbash25}")
+sizes=${BENCH_SIZES:-1M 64M 256M}
+repeat=${BENCH_REPEAT:-3}
+command_total=${BENCH_COMMANDS:-2000}
+work_dir=$(mktemp -d "${BENCH_DIR:-${TMPDIR:-/tmp}}/mbash25-bench.XXXXXX") || exit 1
+trap 'rm -rf "$work_dir"' EXIT
+cd "$work_dir" || exit 1
+
+# Runs "$@" BENCH_REPEAT times and prints the fastest wall time in seconds.
+# $prepare (if set) is evaluated before every run, outside the timing.
+prepare=""
+fastest_run() {
+    local best=0 run start end elapsed
+    for ((run = 0; run < repeat; run++)); do
+        [ -n "$prepare" ] && eval "$prepare"
+        start=$(date +%s%N)
+        "$@" > /dev/null 2>&1
+        end=$(date +%s%N)
+        elapsed=$((end - start))
+        if ((best == 0 || elapsed < best)); then best=$elapsed; fi
+    done
+    awk -v ns="$best" 'BEGIN { printf "%.6f", ns / 1e9 }'
+}
+
+# emit NAME SIZE OPERATIONS UNIT BASH_SECONDS MBASH_SECONDS
+# UNIT is "cmd/s" (OPERATIONS per second) or "MB/s" (SIZE bytes per second)
+emit() {
+    local name=$1 size=$2 operations=$3 unit=$4 bash_seconds=$5 mbash_seconds=$6
+    awk -v name="$name" -v size="$size" -v ops="$operations" -v unit="$unit" \
+        -v b="$bash_seconds" -v m="$mbash_seconds" 'BEGIN {
+        amount = (unit == "MB/s") ? size / 1048576 : ops
+        printf "%s,bash,%d,%d,%.6f,%.2f,%s,1.00\n", name, size, ops, b, (b > 0 ? amount / b : 0), unit
+        printf "%s,mbash25,%d,%d,%.6f,%.2f,%s,%.2f\n", name, size, ops, m, (m > 0 ? amount / m : 0), unit,
+               (m > 0 ? b / m : 0)
+    }'
+}
+
+# compare NAME SIZE OPERATIONS UNIT MBASH_COMMAND BASH_COMMAND
+compare() {
+    local bash_seconds mbash_seconds
+    bash_seconds=$(fastest_run bash -c "$6")
+    mbash_seconds=$(fastest_run "$shell_under_test" -c "$5")
+    emit "$1" "$2" "$3" "$4" "$bash_seconds" "$mbash_seconds"
+}
+
+# compare_script NAME OPERATIONS SCRIPT: both shells run the same script file
+compare_script() {
+    local bash_seconds mbash_seconds
+    bash_seconds=$(fastest_run bash "$3")
+    mbash_seconds=$(fastest_run "$shell_under_test" "$3")
+    emit "$1" 0 "$2" "cmd/s" "$bash_seconds" "$mbash_seconds"
+}
+
+echo "benchmark,shell,size_bytes,operations,best_seconds,rate,rate_unit,speedup_vs_bash"
+
+# ---- Command launch rate ----
+line_count=$((command_total / 4))
+for ((line = 0; line < command_total; line++)); do echo /bin/true; done > single.sh
+for ((line = 0; line < command_total; line++)); do echo true; done > builtin.sh
+for ((line = 0; line < line_count; line++)); do echo "/bin/true ; /bin/true ; /bin/true ; /bin/true"; done > sequence.sh
+for ((line = 0; line < line_count; line++)); do echo "/bin/true && /bin/false || /bin/true && /bin/true"; done > conditional.sh
+compare_script single_command "$command_total" single.sh
+compare_script builtin_command "$command_total" builtin.sh
+compare_script sequence_chain $((line_count * 4)) sequence.sh
+compare_script conditional_chain $((line_count * 4)) conditional.sh
+output_lines=$((command_total * 100))
+compare builtin_output 0 "$output_lines" "cmd/s" \
+    "repeat $output_lines do echo the quick brown fox; done > output.txt" \
+    "for ((line = 0; line < $output_lines; line++)); do echo the quick brown fox; done > output.txt"
+rm -f output.txt
+
+# ---- Data throughput ----
+for size_text in $sizes; do
+    size=$(numfmt --from=iec "$size_text") || continue
+    yes "the quick brown fox jumps over the lazy dog" | head -c "$size" > data_a
+    cp data_a data_b
+
+    compare pipe_4_stages "$size" 1 "MB/s" \
+        "cat data_a | cat | cat | cat > /dev/null" "cat data_a | cat | cat | cat > /dev/null"
+    compare reverse_pipe_4_stages "$size" 1 "MB/s" \
+        "cat > /dev/null ~ cat ~ cat ~ cat data_a" "cat data_a | cat | cat | cat > /dev/null"
+    compare word_count "$size" 1 "MB/s" "# data_a" "wc -w data_a"
+    compare concatenate $((size * 2)) 1 "MB/s" "++ data_a data_b > joined" "cat data_a data_b > joined"
+    rm -f joined
+
+    # a + b moves size bytes into a, then 2 * size bytes into b
+    prepare='cp data_a mutual_a && cp data_a mutual_b'
+    compare mutual_append $((size * 3)) 1 "MB/s" \
+        "mutual_a + mutual_b" "cat mutual_b >> mutual_a && cat mutual_a >> mutual_b"
+    prepare=""
+    rm -f data_a data_b mutual_a mutual_b
+done
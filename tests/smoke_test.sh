@@ -0,0 +1,119 @@
+#!/usr/bin/env bash
+# Smoke tests for mbash25: runs command lines with -c and compares stdout
+# (and the exit status) with the expected values.
+# Usage: tests/smoke_test.sh ./mbash25
+set -u
+
+shell_under_test=$(realpath "${1:-./mbash25}")
+work_dir=$(mktemp -d "${TMPDIR:-/tmp}/mbash25-test.XXXXXX") || exit 1
+trap 'rm -rf "$work_dir"' EXIT
+cd "$work_dir" || exit 1
+printf 'one two\nthree\n' > words.txt
+printf 'alpha\n' > first.txt
+printf 'beta\n' > second.txt
+export MBASH25_HISTFILE="$work_dir/history"
+export MBASH25_CACHE_DIR="$work_dir/cache"
+
+failures=0
+test_count=0
+
+# check NAME EXPECTED_STATUS EXPECTED_OUTPUT COMMAND_LINE
+# check_pattern takes a glob for the output instead of the exact text
+check() {
+    compare_output "$@" exact
+}
+check_pattern() {
+    compare_output "$@" pattern
+}
+compare_output() {
+    local actual_output actual_status output_matches=1
+    test_count=$((test_count + 1))
+    actual_output=$("$shell_under_test" -c "$4" 2>/dev/null)
+    actual_status=$?
+    if [ "$5" = pattern ]; then
+        [[ "$actual_output" == $3 ]] || output_matches=0
+    else
+        [ "$actual_output" = "$3" ] || output_matches=0
+    fi
+    if [ "$output_matches" -eq 0 ] || [ "$actual_status" != "$2" ]; then
+        failures=$((failures + 1))
+        printf 'FAIL %s\n  command:  %s\n  expected: [%s] status %s\n  actual:   [%s] status %s\n' \
+            "$1" "$4" "$3" "$2" "$actual_output" "$actual_status"
+    fi
+}
+
+check simple_command 0 "hello" "echo hello"
+check pipeline 0 "2" "cat words.txt | wc -l"
+check reverse_pipe 0 "2" "wc -l ~ cat words.txt"
+check sequence 0 "$(printf 'a\nb')" "echo a ; echo b"
+check and_chain 1 "" "false && echo no"
+check or_chain 0 "yes" "false || echo yes"
+check quoting 0 "a | b" "echo 'a | b'"
+check redirect_roundtrip 0 "saved" "echo saved > out.txt ; cat < out.txt"
+check append 0 "$(printf 'x\ny')" "echo x > log.txt ; echo y >> log.txt ; cat log.txt"
+check redirect_stages 0 "ONE TWO" "< words.txt | head -1 | tr a-z A-Z | > upper.txt ; cat upper.txt"
+check fan_out 0 "$(printf '2\none two')" "cat words.txt |& { wc -l > n.txt, head -1 > h.txt } ; cat n.txt h.txt"
+# Consumers sharing stdout may finish in either order
+check_pattern fan_out_shared_output 0 "$(printf '@(2\none two|one two\n2)')" "cat words.txt |& { wc -l, head -1 }"
+check word_count 0 "3 words.txt" "# words.txt"
+check concatenate 0 "$(printf 'alpha\nbeta')" "++ first.txt second.txt"
+check mutual_append 0 "$(printf 'alpha\nbeta\nbeta\nalpha\nbeta')" \
+    "cp first.txt m1 ; cp second.txt m2 ; m1 + m2 > /dev/null ; ++ m1 m2"
+check parallel_operator 2 "$(printf 'a\nb')" "set -o parallel=1 ; echo a ::: false ::: echo b ::: false"
+check history_expansion 0 "$(printf 'hi\necho hi\nhi\n    1  echo hi\n    2  echo hi\n    3  history -s hi')" "set -o history
+echo hi
+!!
+history -s hi"
+check command_cache 0 "$(printf '2\n2\n3\nhits       1')" \
+    "cp words.txt c.txt ; cache wc -l < c.txt ; cache wc -l < c.txt ; echo x >> c.txt ; cache wc -l < c.txt ; cache --stats | grep hits"
+check trace_dump 0 "$(printf 'words.txt\n2')" \
+    "set -o trace ; ls words.txt | cat ; trace dump trace.json ; grep -c posix_spawn trace.json"
+check plan_cache 0 "$(printf 'a\na\nplans: 1 hits, 2 misses, 2 cached')" "echo a
+echo a
+stats | grep plans"
+check globbing 0 "$(printf 'g/a.txt g/b.txt\ng/*.txt\ng/sub/deep/n.txt')" \
+    'mkdir -p g/sub/deep ; touch g/a.txt g/b.txt g/sub/deep/n.txt ; echo g/*.txt ; echo "g/*.txt" ; echo g/**/n.t?t'
+check variables 0 "$(printf '1 fallback\nexported')" 'false ; echo $? ${unset_name:-fallback} ; E=exported ; export E ; sh -c "echo \$E"'
+check resource_policy 0 "$(printf '40\nCpus_allowed_list:\t0\n125')" \
+    'ulimit -n 40 sh -c "ulimit -n" ; taskset -c 0 grep Cpus_allowed_list /proc/self/status ; nice -n x true ; echo $?'
+check chained_ulimits 0 "$(printf '2\n64')" \
+    'ulimit -t 5 ulimit -f 100 ulimit -n 64 ulimit -v 900000 ulimit -t 2 sh -c "ulimit -t ; ulimit -n"'
+check buffered_output 0 "$(printf '60000\na\nalpha\nb\n60000\nz')" \
+    'repeat 60000 do echo line; done > big.txt ; wc -l < big.txt ; echo a ; cat first.txt ; echo b ; set +o uring ; repeat 60000 echo line | wc -l ; set -o syncout ; echo z > s.txt ; cat s.txt'
+check_pattern sessions 1 "$(printf '[[]session 1[]] /dev/pts/*\n[[]1[]] * /dev/pts/*, 0 bytes waiting')" \
+    'newt ; sessions ; attach 2'
+check_pattern jobs_reaped_during_parallel 0 "$(printf '[[]1[]] Started background process *: sleep 0.3\nafter')" 'sleep 0.3 &
+sleep 1 ::: sleep 1
+jobs
+echo after
+jobs'
+check cache_builtins 0 "$(printf '/\n1')" \
+    'mkdir -p rv ; cache cd / ; cd rv ; cache cd / ; pwd ; cache export Q=1 ; cache export Q=1 ; echo $Q'
+check cache_environment 0 "$(printf 'one\ntwo')" \
+    'export FOO=one ; cache sh -c "echo \$FOO" ; export FOO=two ; cache sh -c "echo \$FOO"'
+check echo_write_error 0 "$(printf '1\n1')" 'echo x > /dev/full ; echo $? ; pwd > /dev/full ; echo $?'
+check test_builtin 0 "ok" "[ -f words.txt ] && echo ok"
+check loops 0 "$(printf 'ONE\nTWO\nTHREE\nr\nr\n2 here')" 'for w in $(cat words.txt); do echo $w; done | tr a-z A-Z
+repeat 2 echo r
+n=2; cat <<EOF
+$n here
+EOF'
+check missing_command 127 "" "no_such_command_mbash25"
+check_pattern background_wait 0 "\[1\] Started background process *: sleep 0*done" "sleep 0 & wait ; echo done"
+
+# Command server: one request through the worker pool
+"$shell_under_test" --serve "$work_dir/server.sock" 2 &
+server_pid=$!
+for attempt in 1 2 3 4 5 6 7 8 9 10; do [ -S "$work_dir/server.sock" ] && break; sleep 0.1; done
+test_count=$((test_count + 1))
+server_output=$("$shell_under_test" --connect "$work_dir/server.sock" "echo served ; false")
+server_status=$?
+if [ "$server_output" != "served" ] || [ "$server_status" != 1 ]; then
+    failures=$((failures + 1))
+    printf 'FAIL command_server\n  actual:   [%s] status %s\n' "$server_output" "$server_status"
+fi
+kill "$server_pid"
+wait "$server_pid" 2>/dev/null
+
+echo "$((test_count - failures))/$test_count smoke tests passed"
+[ "$failures" -eq 0 ]